@@ -1,15 +1,32 @@
+SET check_function_bodies = false;
+
 CREATE TABLE pulses (
     meter integer NOT NULL,
     start timestamp with time zone NOT NULL,
     stop timestamp with time zone,
     CONSTRAINT valid_pulse CHECK ((stop >= start))
+) PARTITION BY RANGE (start);
+
+CREATE TABLE pulses_default PARTITION OF pulses DEFAULT;
+
+CREATE TABLE pulse_counts (
+    meter integer NOT NULL,
+    start timestamp with time zone NOT NULL,
+    stop timestamp with time zone NOT NULL,
+    count bigint NOT NULL,
+    first timestamp with time zone,
+    last timestamp with time zone,
+    ontime interval DEFAULT '0'::interval NOT NULL,
+    CONSTRAINT valid_interval CHECK ((stop > start)),
+    CONSTRAINT valid_count CHECK (((count = 0 AND first IS NULL AND last IS NULL) OR (count > 0 AND first >= start AND last >= first AND last < stop)))
 );
 
 CREATE TABLE meters (
     id serial NOT NULL,
     name text NOT NULL,
     pulse numeric(9,4),
-    "offset" numeric(9,4)
+    "offset" numeric(9,4),
+    compacted timestamp with time zone
 );
 
 CREATE TABLE readings (
@@ -45,9 +62,12 @@ ALTER TABLE ONLY meters
 ALTER TABLE ONLY meters
     ADD CONSTRAINT meters_pkey PRIMARY KEY (id);
 
-ALTER TABLE ONLY pulses
+ALTER TABLE pulses
     ADD CONSTRAINT pulses_pkey PRIMARY KEY (meter, start);
 
+ALTER TABLE ONLY pulse_counts
+    ADD CONSTRAINT pulse_counts_pkey PRIMARY KEY (meter, start);
+
 ALTER TABLE ONLY readings
     ADD CONSTRAINT readings_pkey PRIMARY KEY (meter, ts);
 
@@ -57,21 +77,26 @@ ALTER TABLE ONLY twitter_accounts
 ALTER TABLE ONLY twitter_oauth
     ADD CONSTRAINT twitter_oauth_pkey PRIMARY KEY (name);
 
-CREATE RULE notify_delete AS ON DELETE TO pulses DO NOTIFY changed;
+CREATE FUNCTION notify_changed() RETURNS trigger
+    AS $_$BEGIN NOTIFY changed; RETURN NULL; END;$_$
+    LANGUAGE plpgsql;
 
-CREATE RULE notify_delete AS ON DELETE TO readings DO NOTIFY changed;
+CREATE TRIGGER notify_changed AFTER INSERT OR UPDATE OR DELETE ON pulses FOR EACH STATEMENT EXECUTE FUNCTION notify_changed();
 
-CREATE RULE notify_insert AS ON INSERT TO pulses DO NOTIFY changed;
+CREATE TRIGGER notify_changed AFTER INSERT OR UPDATE OR DELETE ON pulse_counts FOR EACH STATEMENT EXECUTE FUNCTION notify_changed();
 
-CREATE RULE notify_insert AS ON INSERT TO readings DO NOTIFY changed;
+CREATE RULE notify_delete AS ON DELETE TO readings DO NOTIFY changed;
 
-CREATE RULE notify_update AS ON UPDATE TO pulses DO NOTIFY changed;
+CREATE RULE notify_insert AS ON INSERT TO readings DO NOTIFY changed;
 
 CREATE RULE notify_update AS ON UPDATE TO readings DO NOTIFY changed;
 
-ALTER TABLE ONLY pulses
+ALTER TABLE pulses
     ADD CONSTRAINT pulses_meter_fkey FOREIGN KEY (meter) REFERENCES meters(id);
 
+ALTER TABLE ONLY pulse_counts
+    ADD CONSTRAINT pulse_counts_meter_fkey FOREIGN KEY (meter) REFERENCES meters(id);
+
 ALTER TABLE ONLY readings
     ADD CONSTRAINT readings_meter_fkey FOREIGN KEY (meter) REFERENCES meters(id);
 
@@ -81,8 +106,30 @@ ALTER TABLE ONLY twitter_accounts
 ALTER TABLE ONLY pachube
     ADD CONSTRAINT pachube_pkey PRIMARY KEY (feed, data);
 
-CREATE VIEW abs_pulses AS
-    SELECT pulses.meter, pulses.start AS ts, reading_calculate(pulses.meter, pulses.start) AS value, (pulses.stop - pulses.start) AS pulse FROM pulses;
+CREATE FUNCTION partition_create(parent regclass, month timestamp with time zone) RETURNS void
+    AS $_$DECLARE first timestamp with time zone; name text; def regclass; moving boolean := false;
+    BEGIN IF (SELECT relkind FROM pg_class WHERE oid = parent) <> 'p' THEN RETURN; END IF;
+    first := date_trunc('month', month AT TIME ZONE 'UTC') AT TIME ZONE 'UTC';
+    name := (SELECT relname FROM pg_class WHERE oid = parent) || '_' || to_char(first AT TIME ZONE 'UTC', 'YYYYMM');
+    IF to_regclass(quote_ident(name)) IS NOT NULL THEN RETURN; END IF;
+    def := (SELECT pg_inherits.inhrelid::regclass FROM pg_inherits JOIN pg_class ON pg_class.oid = pg_inherits.inhrelid
+    WHERE pg_inherits.inhparent = parent AND pg_get_expr(pg_class.relpartbound, pg_class.oid) = 'DEFAULT');
+    IF def IS NOT NULL THEN
+    EXECUTE format('SELECT EXISTS (SELECT FROM %s WHERE start >= %L AND start < %L)', def, first, first + '1 month'::interval) INTO moving;
+    END IF;
+    -- rows for the month in the default partition would make the new partition invalid, so they are moved into it
+    -- while the default partition is detached (the parent is locked until the end of the transaction)
+    IF moving THEN EXECUTE format('ALTER TABLE %s DETACH PARTITION %s', parent, def); END IF;
+    EXECUTE format('CREATE TABLE %I PARTITION OF %s FOR VALUES FROM (%L) TO (%L)', name, parent, first, first + '1 month'::interval);
+    IF moving THEN
+    EXECUTE format('WITH moved AS (DELETE FROM %s WHERE start >= %L AND start < %L RETURNING *) INSERT INTO %I SELECT * FROM moved', def, first, first + '1 month'::interval, name);
+    EXECUTE format('ALTER TABLE %s ATTACH PARTITION %s DEFAULT', parent, def);
+    END IF; EXCEPTION WHEN duplicate_table THEN NULL; END;$_$
+    LANGUAGE plpgsql STRICT;
+
+CREATE FUNCTION partition_ensure(parent regclass, ts timestamp with time zone) RETURNS void
+    AS $_$SELECT partition_create($1, $2); SELECT partition_create($1, $2 + '1 month'::interval);$_$
+    LANGUAGE sql STRICT;
 
 CREATE FUNCTION prev_reading_ts(meter integer, before timestamp with time zone) RETURNS timestamp with time zone
     AS $_$SELECT ts FROM readings WHERE meter = $1 AND ts <= $2 ORDER BY ts DESC LIMIT 1;$_$
@@ -108,8 +155,18 @@ CREATE FUNCTION meter_pulse_offset(meter integer) RETURNS numeric
     LANGUAGE sql STABLE STRICT
     AS $_$SELECT "offset" FROM meters WHERE id = $1;$_$;
 
+CREATE FUNCTION pulse_count_upto(count bigint, first timestamp with time zone, last timestamp with time zone, upto timestamp with time zone) RETURNS bigint
+    AS $_$SELECT CASE WHEN $4 < $2 THEN 0 WHEN $4 >= $3 THEN $1
+    ELSE 1 + floor(($1 - 1) * extract(epoch FROM $4 - $2) / extract(epoch FROM $3 - $2))::bigint END;$_$
+    LANGUAGE sql IMMUTABLE STRICT;
+
+CREATE FUNCTION pulse_count_range(meter integer, after timestamp with time zone, upto timestamp with time zone) RETURNS bigint
+    AS $_$SELECT (SELECT COUNT(*) FROM pulses WHERE meter = $1 AND start > $2 AND start <= $3)
+    + COALESCE((SELECT SUM(pulse_count_upto(count, first, last, $3) - pulse_count_upto(count, first, last, $2)) FROM pulse_counts WHERE meter = $1 AND count > 0 AND last > $2 AND first <= $3), 0)::bigint;$_$
+    LANGUAGE sql STABLE STRICT;
+
 CREATE FUNCTION pulse_count_backward(meter integer, before timestamp with time zone) RETURNS bigint
-    AS $_$SELECT COUNT(*) FROM pulses WHERE meter = $1 AND start > prev_reading_ts($1, $2) AND start <= $2;$_$
+    AS $_$SELECT pulse_count_range($1, prev_reading_ts($1, $2), $2);$_$
     LANGUAGE sql STABLE STRICT;
 
 CREATE FUNCTION pulse_calculate_backward(meter integer, before timestamp with time zone, pulses bigint) RETURNS numeric
@@ -121,7 +178,7 @@ CREATE FUNCTION reading_calculate_backward(meter integer, before timestamp with
     LANGUAGE sql STABLE STRICT;
 
 CREATE FUNCTION pulse_count_forward(meter integer, after timestamp with time zone) RETURNS bigint
-    AS $_$SELECT COUNT(*) FROM pulses WHERE meter = $1 AND start <= next_reading_ts($1, $2) AND start > $2;$_$
+    AS $_$SELECT pulse_count_range($1, $2, next_reading_ts($1, $2));$_$
     LANGUAGE sql STABLE STRICT;
 
 CREATE FUNCTION pulse_calculate_forward(meter integer, after timestamp with time zone, pulses bigint) RETURNS numeric
@@ -137,11 +194,16 @@ CREATE FUNCTION reading_floor(meter integer, value numeric) RETURNS numeric
     LANGUAGE sql STABLE STRICT;
 
 CREATE FUNCTION reading_calculate(meter integer, pulse timestamp with time zone) RETURNS numeric
-    AS $_$BEGIN; IF prev_reading_value(meter, pulse) IS NOT NULL THEN RETURN reading_calculate_backward(meter, pulse);
+    AS $_$BEGIN IF prev_reading_value(meter, pulse) IS NOT NULL THEN RETURN reading_calculate_backward(meter, pulse);
     ELSIF next_reading_value(meter, pulse) IS NOT NULL THEN RETURN reading_calculate_forward(meter, pulse);
     ELSE RETURN NULL; END IF; END;$_$
     LANGUAGE plpgsql STABLE STRICT;
 
+CREATE VIEW abs_pulses AS
+    SELECT pulses.meter, pulses.start AS ts, reading_calculate(pulses.meter, pulses.start) AS value, (pulses.stop - pulses.start) AS pulse FROM pulses
+    UNION ALL
+    SELECT pulse_counts.meter, pulse_counts.last AS ts, reading_calculate(pulse_counts.meter, pulse_counts.last) AS value, (pulse_counts.ontime / pulse_counts.count) AS pulse FROM pulse_counts WHERE pulse_counts.count > 0;
+
 CREATE FUNCTION dow_char(ts timestamp with time zone) RETURNS text
     AS $_$SELECT dow[extract(dow FROM $1)+1] FROM (SELECT ARRAY['Sun','Mon','Tue','Wed','Thu','Fri','Sat'] AS dow) AS temp;$_$
     LANGUAGE sql STABLE STRICT;
@@ -153,7 +215,67 @@ CREATE VIEW meter_usage AS
         reading_calculate(meters.id, date_trunc('day', pulses.start) + '1 day'::interval) - reading_calculate(meters.id, date_trunc('day', pulses.start)) AS usage,
         reading_calculate(meters.id, date_trunc('day', pulses.start) + '12 hours'::interval) - reading_calculate(meters.id, date_trunc('day', pulses.start)) AS am,
         reading_calculate(meters.id, date_trunc('day', pulses.start) + '1 day'::interval) - reading_calculate(meters.id, date_trunc('day', pulses.start) + '12 hours'::interval) AS pm
-    FROM meters, pulses
+    FROM meters, (SELECT meter, start FROM pulses UNION ALL SELECT meter, first FROM pulse_counts WHERE count > 0) AS pulses
     WHERE meters.id = pulses.meter
     GROUP BY meters.id, date_trunc('day', pulses.start)
     ORDER BY meters.id, date_trunc('day', pulses.start);
+
+CREATE FUNCTION usage_buckets(meter integer, after timestamp with time zone, upto timestamp with time zone, width interval) RETURNS TABLE(start timestamp with time zone, stop timestamp with time zone, usage numeric)
+    AS $_$#variable_conflict use_column
+    DECLARE m_pulse numeric; m_offset numeric; cuts timestamp with time zone[]; th timestamp with time zone[];
+    rvalue numeric[]; reading boolean[]; counts bigint[]; calc numeric[]; n integer; i integer; j integer; r integer; b integer; c bigint;
+    BEGIN IF width <= '0'::interval OR upto <= after THEN RETURN; END IF;
+    SELECT meters.pulse, meters."offset" INTO m_pulse, m_offset FROM meters WHERE meters.id = $1;
+    cuts := ARRAY(SELECT s FROM generate_series($2, $3, $4) AS s WHERE s < $3) || $3;
+    -- thresholds are the bucket boundaries and every reading used to calculate them
+    SELECT array_agg(t.ts ORDER BY t.ts), array_agg(t.value ORDER BY t.ts), array_agg(t.reading ORDER BY t.ts) INTO th, rvalue, reading
+    FROM (SELECT DISTINCT ON (u.ts) u.ts, u.value, u.reading FROM (SELECT x AS ts, NULL::numeric AS value, false AS reading FROM unnest(cuts) AS x
+    UNION ALL SELECT readings.ts, readings.value, true FROM readings WHERE readings.meter = $1
+    AND readings.ts >= COALESCE(prev_reading_ts($1, $2), $2) AND readings.ts <= COALESCE(next_reading_ts($1, $3), $3)) AS u ORDER BY u.ts, u.reading DESC) AS t;
+    n := array_length(th, 1);
+    -- pulses in (th[b], th[b + 1]] are counted at b + 1
+    counts := array_fill(0::bigint, ARRAY[n]);
+    FOR b, c IN SELECT width_bucket(pulses.start - '1 microsecond'::interval, th), COUNT(*) FROM pulses
+    WHERE pulses.meter = $1 AND pulses.start > th[1] AND pulses.start <= th[n] GROUP BY 1 LOOP
+    counts[b + 1] := counts[b + 1] + c; END LOOP;
+    FOR b, c IN SELECT s.b, SUM(pulse_count_upto(pulse_counts.count, pulse_counts.first, pulse_counts.last, th[s.b + 1]) - pulse_count_upto(pulse_counts.count, pulse_counts.first, pulse_counts.last, th[s.b]))
+    FROM pulse_counts, generate_series(greatest(width_bucket(pulse_counts.first - '1 microsecond'::interval, th), 1), least(width_bucket(pulse_counts.last - '1 microsecond'::interval, th), n - 1)) AS s(b)
+    WHERE pulse_counts.meter = $1 AND pulse_counts.count > 0 AND pulse_counts.last > th[1] AND pulse_counts.first <= th[n] GROUP BY s.b LOOP
+    counts[b + 1] := counts[b + 1] + c; END LOOP;
+    FOR i IN 2..n LOOP counts[i] := counts[i] + counts[i - 1]; END LOOP;
+    -- the same as reading_calculate(): backward from the previous reading unless it is a reset, otherwise forward from the next reading
+    calc := array_fill(NULL::numeric, ARRAY[n]); r := NULL;
+    FOR i IN 1..n LOOP IF reading[i] THEN r := i; END IF;
+    IF r IS NOT NULL AND rvalue[r] IS NOT NULL THEN calc[i] := rvalue[r] - MOD(rvalue[r] - m_offset, m_pulse) + (counts[i] - counts[r]) * m_pulse; END IF; END LOOP;
+    r := NULL;
+    FOR i IN REVERSE n..1 LOOP IF reading[i] THEN r := i; END IF;
+    IF calc[i] IS NULL AND r IS NOT NULL AND rvalue[r] IS NOT NULL THEN calc[i] := rvalue[r] - MOD(rvalue[r] - m_offset, m_pulse) - (counts[r] - counts[i]) * m_pulse; END IF; END LOOP;
+    j := 1;
+    FOR i IN 1..array_length(cuts, 1) LOOP WHILE th[j] < cuts[i] LOOP j := j + 1; END LOOP;
+    IF i > 1 THEN usage := calc[j] - usage; RETURN NEXT; END IF;
+    start := cuts[i]; stop := cuts[i + 1]; usage := calc[j]; END LOOP; END;$_$
+    LANGUAGE plpgsql STABLE STRICT;
+
+CREATE FUNCTION pulses_compact(meter integer, age interval) RETURNS bigint
+    AS $_$#variable_conflict use_column
+    DECLARE upto timestamp with time zone; anchors timestamp with time zone[]; n bigint;
+    BEGIN upto := date_trunc('hour', now() - $2);
+    -- completed pulses before meters.compacted have been compacted, pulseimport and pulserecon don't add pulses
+    -- before it (so they're not counted twice) and the row lock waits for them to finish
+    UPDATE meters SET compacted = greatest(meters.compacted, upto) WHERE meters.id = $1;
+    anchors := ARRAY['-infinity'::timestamp with time zone] || ARRAY(SELECT readings.ts FROM readings WHERE readings.meter = $1 ORDER BY readings.ts);
+    -- completed pulses are replaced by counts for each hour (in the session time zone) split at every reading, so that the
+    -- number of pulses up to any hour or reading is unchanged (readings added within compacted hours can't be split later)
+    -- pulses in (anchors[b], anchors[b + 1]] are in segment b
+    WITH old AS (DELETE FROM pulses WHERE pulses.meter = $1 AND pulses.start < upto AND pulses.stop IS NOT NULL RETURNING pulses.start, pulses.stop),
+    segments AS (SELECT date_trunc('hour', old.start) AS hour, width_bucket(old.start - '1 microsecond'::interval, anchors) AS b,
+    COUNT(*) AS count, min(old.start) AS first, max(old.start) AS last, SUM(old.stop - old.start) AS ontime FROM old GROUP BY 1, 2),
+    merged AS (INSERT INTO pulse_counts AS c (meter, start, stop, count, first, last, ontime)
+    SELECT $1, greatest(s.hour, anchors[s.b]), least(s.hour + '1 hour'::interval, anchors[s.b + 1] + '1 microsecond'::interval), s.count, s.first, s.last, s.ontime FROM segments AS s
+    ON CONFLICT (meter, start) DO UPDATE SET stop = greatest(c.stop, EXCLUDED.stop), count = c.count + EXCLUDED.count,
+    first = least(c.first, EXCLUDED.first), last = greatest(c.last, EXCLUDED.last), ontime = c.ontime + EXCLUDED.ontime)
+    SELECT COUNT(*) INTO n FROM old;
+    RETURN n; END;$_$
+    LANGUAGE plpgsql STRICT;
+
+SELECT partition_ensure('pulses', now());
@@ -0,0 +1,612 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <mqueue.h>
+#include <poll.h>
+#include <postgresql/libpq-fe.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pulsebench.h"
+#include "pulseq.h"
+
+struct scenario {
+	const char *name;
+	unsigned int (*generate)(pulse_t *edges, unsigned int max, unsigned long long *now);
+};
+
+struct result {
+	unsigned int edges;
+	unsigned long long elapsed;
+	long pulses;
+	long total;
+	unsigned long long latency[BENCH_LATENCY_EDGES];
+	unsigned int committed;
+	unsigned int sent;
+	long calls;
+	long syscalls;
+};
+
+char *pulsedb;
+const char *variant;
+char *table;
+char *meter;
+char mqueue[64];
+char mqueue_backup[66];
+char pair_name[72];
+mqd_t q;
+PGconn *conn;
+pid_t child;
+bool strace;
+char strace_file[64];
+pulse_t stream[BENCH_EDGES];
+
+static void setup(int argc, char *argv[]) {
+	if (argc != 4) {
+		printf("Usage: %s <pulsedb> <table> <meter>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	pulsedb = argv[1];
+	variant = strrchr(pulsedb, '/');
+	variant = variant == NULL ? pulsedb : variant + 1;
+	table = argv[2];
+	meter = argv[3];
+
+	snprintf(mqueue, sizeof(mqueue), "/pulsebench.%u", (unsigned int)getpid());
+	snprintf(mqueue_backup, sizeof(mqueue_backup), "%s~", mqueue);
+	snprintf(pair_name, sizeof(pair_name), "%s" PAIR_STATE, mqueue);
+
+	/* count the system calls made by pulsedb */
+	strace = getenv("PULSEBENCH_STRACE") != NULL;
+	snprintf(strace_file, sizeof(strace_file), "/tmp/pulsebench.%u.strace", (unsigned int)getpid());
+}
+
+static unsigned long long now_us(void) {
+	struct timespec ts;
+
+	cerror("clock_gettime", clock_gettime(CLOCK_MONOTONIC, &ts) != 0);
+	return (unsigned long long)ts.tv_sec * 1000000 + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+static void add_edge(pulse_t *edges, unsigned int *n, unsigned long long ts, bool on) {
+	edges[*n].tv.tv_sec = ts / 1000000;
+	edges[*n].tv.tv_usec = ts % 1000000;
+	edges[*n].on = on;
+	(*n)++;
+}
+
+/* 100ms pulses once a second */
+static unsigned int gen_clean(pulse_t *edges, unsigned int max, unsigned long long *now) {
+	unsigned int n = 0;
+
+	while (n + 2 <= max) {
+		add_edge(edges, &n, *now, true);
+		add_edge(edges, &n, *now + 100000, false);
+		*now += 1000000;
+	}
+	return n;
+}
+
+/* 4 pulses of 5ms noise before every real pulse */
+static unsigned int gen_noise(pulse_t *edges, unsigned int max, unsigned long long *now) {
+	unsigned int n = 0;
+
+	while (n + 10 <= max) {
+		int i;
+
+		for (i = 0; i < 4; i++) {
+			add_edge(edges, &n, *now, true);
+			add_edge(edges, &n, *now + 5000, false);
+			*now += 10000;
+		}
+
+		add_edge(edges, &n, *now, true);
+		add_edge(edges, &n, *now + 100000, false);
+		*now += 1000000;
+	}
+	return n;
+}
+
+/* 400ms pulses that drop out for 10ms half way through */
+static unsigned int gen_interrupted(pulse_t *edges, unsigned int max, unsigned long long *now) {
+	unsigned int n = 0;
+
+	while (n + 4 <= max) {
+		add_edge(edges, &n, *now, true);
+		add_edge(edges, &n, *now + 200000, false);
+		add_edge(edges, &n, *now + 210000, true);
+		add_edge(edges, &n, *now + 400000, false);
+		*now += 1000000;
+	}
+	return n;
+}
+
+/* meter reset after every 20 pulses */
+static unsigned int gen_reset(pulse_t *edges, unsigned int max, unsigned long long *now) {
+	unsigned int n = 0;
+
+	while (n + 41 <= max) {
+		int i;
+
+		for (i = 0; i < 20; i++) {
+			add_edge(edges, &n, *now, true);
+			add_edge(edges, &n, *now + 100000, false);
+			*now += 1000000;
+		}
+
+		add_edge(edges, &n, 0, false);
+	}
+	return n;
+}
+
+const struct scenario scenarios[] = {
+	{ "clean", gen_clean },
+	{ "noise", gen_noise },
+	{ "interrupted", gen_interrupted },
+	{ "reset", gen_reset },
+	{ NULL, NULL }
+};
+
+static PGresult *db_exec(const char *sql, int nparams, const char **param, ExecStatusType status) {
+	PGresult *res = PQexecParams(conn, sql, nparams, NULL, param, NULL, NULL, 0);
+
+	if (PQresultStatus(res) != status) {
+		fprintf(stderr, "%s: %s", sql, PQerrorMessage(conn));
+		exit(EXIT_FAILURE);
+	}
+	return res;
+}
+
+static void init(void) {
+	PGresult *res;
+	char *ident;
+	char sql[256];
+
+	conn = PQconnectdb("");
+	if (PQstatus(conn) != CONNECTION_OK) {
+		fprintf(stderr, "%s", PQerrorMessage(conn));
+		exit(EXIT_FAILURE);
+	}
+
+	ident = PQescapeIdentifier(conn, table, strlen(table));
+	cerror("PQescapeIdentifier", ident == NULL);
+	table = ident;
+
+	res = db_exec("LISTEN changed " BENCH_TAG, 0, NULL, PGRES_COMMAND_OK);
+	PQclear(res);
+
+	snprintf(sql, sizeof(sql), "SELECT NULL FROM %s LIMIT 1 " BENCH_TAG, table);
+	res = db_exec(sql, 0, NULL, PGRES_TUPLES_OK);
+	PQclear(res);
+}
+
+/* wait for a change notification, returning false on timeout */
+static bool db_wait(unsigned long long timeout) {
+	unsigned long long end = now_us() + timeout;
+	PGnotify *notify;
+
+	for (;;) {
+		struct pollfd pfd = { .fd = PQsocket(conn), .events = POLLIN };
+		unsigned long long now;
+		int ret;
+
+		cerror("PQconsumeInput", !PQconsumeInput(conn));
+		notify = PQnotifies(conn);
+		if (notify != NULL) {
+			PQfreemem(notify);
+			return true;
+		}
+
+		now = now_us();
+		if (now >= end)
+			return false;
+
+		ret = poll(&pfd, 1, (end - now + 999) / 1000);
+		cerror("poll", ret < 0 && errno != EINTR);
+	}
+}
+
+static void db_drain(void) {
+	PGnotify *notify;
+
+	cerror("PQconsumeInput", !PQconsumeInput(conn));
+	while ((notify = PQnotifies(conn)) != NULL)
+		PQfreemem(notify);
+}
+
+static void db_clear(void) {
+	const char *param[1] = { meter };
+	PGresult *res;
+	char sql[256];
+
+	snprintf(sql, sizeof(sql), "DELETE FROM %s WHERE meter = $1 " BENCH_TAG, table);
+	res = db_exec(sql, 1, param, PGRES_COMMAND_OK);
+	PQclear(res);
+
+	res = db_exec("DELETE FROM readings WHERE meter = $1 " BENCH_TAG, 1, param, PGRES_COMMAND_OK);
+	PQclear(res);
+	db_drain();
+}
+
+/* pg_stat_statements is optional, so round trips are not always available */
+static bool db_calls_reset(void) {
+	PGresult *res = PQexec(conn, "SELECT pg_stat_statements_reset() " BENCH_TAG);
+	bool ok = (PQresultStatus(res) == PGRES_TUPLES_OK);
+
+	PQclear(res);
+	return ok;
+}
+
+static long db_calls(void) {
+	PGresult *res = db_exec("SELECT coalesce(sum(calls), 0) FROM pg_stat_statements"
+		" WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database())"
+		" AND query NOT LIKE '%pulsebench%'", 0, NULL, PGRES_TUPLES_OK);
+	long calls = strtol(PQgetvalue(res, 0, 0), NULL, 10);
+
+	PQclear(res);
+	return calls;
+}
+
+static bool db_committed(const pulse_t *on) {
+	const char *param[2] = { meter, NULL };
+	PGresult *res;
+	char tmp[32];
+	char sql[256];
+	bool done;
+
+	sprintf(tmp, "%lu.%06u", (unsigned long int)on->tv.tv_sec, (unsigned int)on->tv.tv_usec);
+	param[1] = tmp;
+
+	snprintf(sql, sizeof(sql), "SELECT NULL FROM %s WHERE meter = $1 AND start = to_timestamp($2) AND stop IS NOT NULL " BENCH_TAG, table);
+	res = db_exec(sql, 2, param, PGRES_TUPLES_OK);
+	done = (PQntuples(res) > 0);
+	PQclear(res);
+	return done;
+}
+
+static long db_count(unsigned long long from, unsigned long long to) {
+	const char *param[3] = { meter, NULL, NULL };
+	PGresult *res;
+	char tmp[2][32];
+	char sql[256];
+	long pulses;
+
+	sprintf(tmp[0], "%llu.%06u", from / 1000000, (unsigned int)(from % 1000000));
+	sprintf(tmp[1], "%llu.%06u", to / 1000000, (unsigned int)(to % 1000000));
+	param[1] = tmp[0];
+	param[2] = tmp[1];
+
+	snprintf(sql, sizeof(sql), "SELECT COUNT(*) FROM %s WHERE meter = $1 AND start >= to_timestamp($2) AND start < to_timestamp($3) AND stop IS NOT NULL " BENCH_TAG, table);
+	res = db_exec(sql, 3, param, PGRES_TUPLES_OK);
+	pulses = strtol(PQgetvalue(res, 0, 0), NULL, 10);
+	PQclear(res);
+	return pulses;
+}
+
+static void open_queue(void) {
+	struct mq_attr q_attr = {
+		.mq_flags = 0,
+		.mq_maxmsg = 4096,
+		.mq_msgsize = sizeof(pulse_t)
+	};
+
+	mq_unlink(mqueue);
+	mq_unlink(mqueue_backup);
+
+	q = mq_open(mqueue, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR, &q_attr);
+	cerror(mqueue, q < 0);
+}
+
+static void close_queue(void) {
+	cerror(mqueue, mq_close(q));
+	mq_unlink(mqueue);
+	mq_unlink(mqueue_backup);
+	shm_unlink(pair_name);
+}
+
+/* one of a pair of processes (without strace) */
+static pid_t spawn_pulsedb(bool pair) {
+	pid_t pid = fork();
+
+	cerror("fork", pid < 0);
+	if (pid == 0) {
+		if (pair)
+			execl(pulsedb, pulsedb, "-p", mqueue, meter, (char *)NULL);
+		else
+			execl(pulsedb, pulsedb, mqueue, meter, (char *)NULL);
+		xerror(pulsedb);
+	}
+	return pid;
+}
+
+static void kill_pulsedb(pid_t pid, int sig) {
+	int status;
+
+	cerror("kill", kill(pid, sig) != 0);
+	cerror("waitpid", waitpid(pid, &status, 0) != pid);
+}
+
+static void start_pulsedb(void) {
+	open_queue();
+
+	child = fork();
+	cerror("fork", child < 0);
+	if (child == 0) {
+		if (strace) {
+			/* in a new process group so that both are stopped */
+			cerror("setpgid", setpgid(0, 0) != 0);
+			execlp("strace", "strace", "-f", "-c", "-o", strace_file, pulsedb, mqueue, meter, (char *)NULL);
+			xerror("strace");
+		}
+
+		execl(pulsedb, pulsedb, mqueue, meter, (char *)NULL);
+		xerror(pulsedb);
+	}
+}
+
+static void stop_pulsedb(void) {
+	int status;
+
+	cerror("kill", kill(strace ? -child : child, SIGTERM) != 0);
+	cerror("waitpid", waitpid(child, &status, 0) != child);
+
+	close_queue();
+}
+
+/* total calls from the summary written by strace -c
+ * (columns are right aligned with the header)
+ */
+static long strace_calls(void) {
+	FILE *f = fopen(strace_file, "r");
+	char line[256];
+	long calls = -1;
+	int end = -1;
+
+	if (f == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *pos = strstr(line, " calls ");
+
+		if (pos != NULL && strstr(line, "syscall") != NULL) {
+			end = pos - line + strlen(" calls");
+		} else if (end > 0 && strstr(line, " total") != NULL && (int)strlen(line) > end) {
+			int start = end;
+
+			while (start > 0 && line[start - 1] != ' ')
+				start--;
+			calls = strtol(&line[start], NULL, 10);
+		}
+	}
+
+	fclose(f);
+	unlink(strace_file);
+	return calls;
+}
+
+static void send_edge(const pulse_t *edge) {
+	cerror("mq_send", mq_send(q, (const char *)edge, sizeof(*edge), 0) != 0);
+}
+
+static void wait_committed(const char *name, const pulse_t *on, unsigned long long start) {
+	while (!db_committed(on)) {
+		if (now_us() - start > BENCH_DRAIN_TIMEOUT * 1000000ULL) {
+			fprintf(stderr, "%s: %s: timed out waiting for backlog\n", variant, name);
+			exit(EXIT_FAILURE);
+		}
+		db_wait(BENCH_TIMEOUT);
+	}
+}
+
+static void run_throughput(const struct scenario *s, struct result *r, unsigned long long *now) {
+	unsigned long long start;
+	unsigned int i, n;
+	pulse_t *sentinel;
+
+	n = s->generate(stream, BENCH_EDGES - 2, now);
+
+	/* finish with a normal pulse to detect when everything
+	 * before it has been committed
+	 */
+	sentinel = &stream[n];
+	add_edge(stream, &n, *now, true);
+	add_edge(stream, &n, *now + 100000, false);
+	*now += 1000000;
+
+	start = now_us();
+	for (i = 0; i < n; i++)
+		send_edge(&stream[i]);
+
+	wait_committed(s->name, sentinel, start);
+
+	r->elapsed = now_us() - start;
+	r->edges = n;
+	r->pulses = db_count(tv_to_ull(stream[0].tv), tv_to_ull(sentinel->tv)) + 1;
+}
+
+static void run_latency(const struct scenario *s, struct result *r, unsigned long long *now) {
+	unsigned int i, n;
+
+	n = s->generate(stream, BENCH_LATENCY_EDGES, now);
+
+	r->sent = r->edges + n;
+	r->committed = 0;
+	for (i = 0; i < n; i++) {
+		unsigned long long start;
+
+		db_drain();
+
+		start = now_us();
+		send_edge(&stream[i]);
+
+		/* edges that don't change anything (e.g. a reset
+		 * that is ignored) are not included
+		 */
+		if (db_wait(BENCH_TIMEOUT))
+			r->latency[r->committed++] = now_us() - start;
+	}
+}
+
+static int compare_ull(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(const struct result *r, unsigned int pc) {
+	if (r->committed == 0)
+		return 0;
+
+	return r->latency[(r->committed - 1) * pc / 100] / 1000.0;
+}
+
+static void report(const struct scenario *s, struct result *r) {
+	char rt[16];
+	char sys[16];
+
+	qsort(r->latency, r->committed, sizeof(r->latency[0]), compare_ull);
+
+	if (r->calls >= 0 && r->total > 0)
+		snprintf(rt, sizeof(rt), "%.2f", (double)r->calls / r->total);
+	else
+		strcpy(rt, "n/a");
+
+	if (r->syscalls >= 0 && r->sent > 0)
+		snprintf(sys, sizeof(sys), "%.2f", (double)r->syscalls / r->sent);
+	else
+		strcpy(sys, "n/a");
+
+	printf("%-10s %-12s %10.0f %10.0f %9.3f %9.3f %9s %9s\n", variant, s->name,
+		r->edges * 1000000.0 / r->elapsed, r->pulses * 1000000.0 / r->elapsed,
+		percentile(r, 50), percentile(r, 99), rt, sys);
+	fflush(stdout);
+}
+
+static void run(const struct scenario *s) {
+	struct result r;
+	struct timeval tv;
+	unsigned long long begin, now;
+	bool calls;
+
+	/* use real timestamps starting from now */
+	cerror("gettimeofday", gettimeofday(&tv, NULL) != 0);
+	begin = now = tv_to_ull(tv);
+
+	db_clear();
+	calls = db_calls_reset();
+
+	start_pulsedb();
+	run_throughput(s, &r, &now);
+	run_latency(s, &r, &now);
+	stop_pulsedb();
+
+	/* system calls per edge cover both runs, including startup */
+	r.syscalls = strace ? strace_calls() : -1;
+
+	/* round trips per pulse cover both runs */
+	if (calls) {
+		r.calls = db_calls();
+		r.total = db_count(begin, now);
+	} else {
+		r.calls = -1;
+	}
+
+	report(s, &r);
+}
+
+/* time from killing the process writing pulses until the next
+ * pulse has been committed, either by starting a new process
+ * or by the standby of a pair that is already waiting
+ */
+static void run_failover(const char *name, bool pair) {
+	struct result r;
+	struct timeval tv;
+	unsigned long long now;
+	pid_t leader, standby = -1;
+	unsigned int i;
+
+	cerror("gettimeofday", gettimeofday(&tv, NULL) != 0);
+	now = tv_to_ull(tv);
+
+	db_clear();
+	open_queue();
+
+	leader = spawn_pulsedb(pair);
+	r.committed = 0;
+	for (i = 0; i <= BENCH_FAILOVERS; i++) {
+		unsigned long long start;
+		unsigned int n = 0;
+
+		add_edge(stream, &n, now, true);
+		add_edge(stream, &n, now + 100000, false);
+		now += 1000000;
+
+		/* the first pulse is written before anything is killed */
+		start = now_us();
+		if (i > 0) {
+			kill_pulsedb(leader, SIGKILL);
+			if (pair) {
+				leader = standby;
+				standby = -1;
+			} else {
+				leader = spawn_pulsedb(false);
+			}
+		}
+
+		send_edge(&stream[0]);
+		send_edge(&stream[1]);
+
+		wait_committed(name, &stream[0], start);
+		if (i > 0)
+			r.latency[r.committed++] = now_us() - start;
+
+		if (pair) {
+			standby = spawn_pulsedb(true);
+			usleep(BENCH_STANDBY_WAIT);
+		}
+	}
+
+	kill_pulsedb(leader, SIGTERM);
+	if (standby != -1)
+		kill_pulsedb(standby, SIGTERM);
+	close_queue();
+
+	qsort(r.latency, r.committed, sizeof(r.latency[0]), compare_ull);
+	printf("%-10s %-12s %10s %10s %9.3f %9.3f %9s %9s\n", variant, name,
+		"-", "-", percentile(&r, 50), percentile(&r, 99), "-", "-");
+	fflush(stdout);
+}
+
+static void cleanup(void) {
+	PQfreemem(table);
+	PQfinish(conn);
+}
+
+int main(int argc, char *argv[]) {
+	const struct scenario *s;
+
+	setup(argc, argv);
+	init();
+
+	printf("%-10s %-12s %10s %10s %9s %9s %9s %9s\n", "variant", "scenario",
+		"edges/s", "pulses/s", "p50 ms", "p99 ms", "rt/pulse", "sys/edge");
+	for (s = scenarios; s->name != NULL; s++)
+		run(s);
+
+	run_failover("restart", false);
+	run_failover("failover", true);
+
+	cleanup();
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,31 @@
+#define xerror(msg) do { perror(msg); exit(EXIT_FAILURE); } while(0)
+#define cerror(msg, expr) do { if (expr) xerror(msg); } while(0)
+
+#define tv_to_ull(x) (unsigned long long)((unsigned long long)(x).tv_sec*1000000 + (unsigned long long)(x).tv_usec)
+
+/* Edges sent as fast as possible to measure sustained throughput
+ * (must fit in the main queue)
+ */
+#define BENCH_EDGES 4000
+
+/* Edges sent one at a time to measure edge-to-commit latency */
+#define BENCH_LATENCY_EDGES 200
+
+/* Give up waiting for the commit of a single edge after 250ms */
+#define BENCH_TIMEOUT 250000
+
+/* Give up waiting for the backlog to be committed after 60s */
+#define BENCH_DRAIN_TIMEOUT 60
+
+/* Times the running pulsedb is killed to measure how long it takes
+ * for writes to continue after a restart or with a standby (-p)
+ */
+#define BENCH_FAILOVERS 10
+
+/* Time for a new standby to connect and wait for the lock (µs) */
+#define BENCH_STANDBY_WAIT 500000
+
+/* Added to every query made by the benchmark so that
+ * they can be excluded from the round trip count
+ */
+#define BENCH_TAG "/* pulsebench */"
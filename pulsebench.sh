@@ -0,0 +1,37 @@
+#!/bin/sh
+# Benchmark pulsedb build variants against a throwaway local database
+#
+# Usage: pulsebench.sh <variant>:<table> [<variant>:<table>...]
+set -e
+
+PATH="$(pg_config --bindir):$PATH"
+export PATH
+
+dir="$(mktemp -d)"
+trap 'pg_ctl -D "$dir/data" -m immediate stop >/dev/null 2>&1; rm -rf "$dir"' EXIT
+
+initdb -D "$dir/data" -A trust -U postgres >/dev/null
+pg_ctl -D "$dir/data" -l "$dir/log" -w -o "-k $dir -c listen_addresses='' -c shared_preload_libraries=pg_stat_statements" start >/dev/null
+
+PGHOST="$dir"
+PGUSER=postgres
+PGDATABASE=postgres
+export PGHOST PGUSER PGDATABASE
+
+psql -q -v ON_ERROR_STOP=1 -f postgres.sql >/dev/null
+psql -q -v ON_ERROR_STOP=1 >/dev/null <<SQL
+CREATE EXTENSION IF NOT EXISTS pg_stat_statements;
+INSERT INTO meters (name, pulse, "offset") VALUES ('bench', 0.01, 0);
+CREATE TABLE heating (LIKE pulses INCLUDING ALL);
+ALTER TABLE ONLY heating ADD CONSTRAINT heating_meter_fkey FOREIGN KEY (meter) REFERENCES meters(id);
+CREATE RULE notify_delete AS ON DELETE TO heating DO NOTIFY changed;
+CREATE RULE notify_insert AS ON INSERT TO heating DO NOTIFY changed;
+CREATE RULE notify_update AS ON UPDATE TO heating DO NOTIFY changed;
+CREATE TABLE heating_counts (LIKE pulse_counts INCLUDING ALL);
+ALTER TABLE ONLY heating_counts ADD CONSTRAINT heating_counts_meter_fkey FOREIGN KEY (meter) REFERENCES meters(id);
+SQL
+meter="$(psql -At -c "SELECT id FROM meters WHERE name = 'bench'")"
+
+for arg in "$@"; do
+	./pulsebench "./${arg%%:*}" "${arg#*:}" "$meter"
+done | awk 'NR == 1 || !/^variant/'
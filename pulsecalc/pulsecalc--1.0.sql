@@ -0,0 +1,11 @@
+\echo Use "CREATE EXTENSION pulsecalc" to load this file. \quit
+
+-- The same values as reading_calculate() for every pulse with after < ts <= upto,
+-- requires the meters, readings, pulses and pulse_counts tables from postgres.sql
+CREATE FUNCTION pulse_values(meter integer, after timestamp with time zone DEFAULT '-infinity', upto timestamp with time zone DEFAULT 'infinity')
+    RETURNS TABLE(ts timestamp with time zone, value numeric, pulse interval)
+    AS 'MODULE_PATHNAME', 'pulse_values'
+    LANGUAGE C STABLE STRICT;
+
+CREATE VIEW abs_pulses_native AS
+    SELECT meters.id AS meter, v.ts, v.value, v.pulse FROM meters, LATERAL pulse_values(meters.id) AS v;
@@ -0,0 +1,333 @@
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+PG_MODULE_MAGIC;
+
+/* Meter values are numeric(9,4), calculated as integers of 1/10000 */
+#define VALUE_SCALE 10000
+
+#define FETCH_ROWS 10000
+
+struct reading {
+	TimestampTz ts;
+	int64 value;
+	bool isnull;
+	int64 upto; /* pulses with start <= ts */
+};
+
+/* pulses, including those counted in pulse_counts
+ * (evenly spaced from first to last, the same as pulseexport)
+ */
+struct event {
+	TimestampTz ts;
+	bool emit;
+	bool pulse_isnull;
+	Interval pulse;
+};
+
+struct meter {
+	bool valid;
+	int64 pulse;
+	int64 offset;
+	struct reading *readings;
+	size_t nreadings;
+	struct event *events;
+	size_t nevents;
+	size_t size;
+};
+
+PG_FUNCTION_INFO_V1(pulse_values);
+
+static void load_meter(struct meter *m, int32 meter) {
+	Oid types[1] = { INT4OID };
+	Datum values[1] = { Int32GetDatum(meter) };
+	bool pulse_isnull, offset_isnull;
+
+	if (SPI_execute_with_args("SELECT (pulse * " CppAsString2(VALUE_SCALE) ")::bigint, (\"offset\" * " CppAsString2(VALUE_SCALE) ")::bigint FROM meters WHERE id = $1",
+			1, types, values, NULL, true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "pulse_values: unable to read meter %d", meter);
+
+	m->valid = false;
+	if (SPI_processed == 1) {
+		HeapTuple tuple = SPI_tuptable->vals[0];
+		TupleDesc desc = SPI_tuptable->tupdesc;
+
+		m->pulse = DatumGetInt64(SPI_getbinval(tuple, desc, 1, &pulse_isnull));
+		m->offset = DatumGetInt64(SPI_getbinval(tuple, desc, 2, &offset_isnull));
+		m->valid = !pulse_isnull && !offset_isnull;
+
+		if (m->valid && m->pulse == 0)
+			ereport(ERROR, (errcode(ERRCODE_DIVISION_BY_ZERO), errmsg("division by zero")));
+	}
+	SPI_freetuptable(SPI_tuptable);
+}
+
+/* the readings either side of the range, and all of the readings in it */
+static void load_readings(struct meter *m, int32 meter, TimestampTz after, TimestampTz upto) {
+	Oid types[3] = { INT4OID, TIMESTAMPTZOID, TIMESTAMPTZOID };
+	Datum values[3] = { Int32GetDatum(meter), TimestampTzGetDatum(after), TimestampTzGetDatum(upto) };
+	size_t size = 0;
+	uint64 i;
+
+	if (SPI_execute_with_args("SELECT ts, (value * " CppAsString2(VALUE_SCALE) ")::bigint FROM readings WHERE meter = $1"
+			" AND ts >= COALESCE((SELECT max(ts) FROM readings WHERE meter = $1 AND ts <= $2), '-infinity')"
+			" AND ts <= COALESCE((SELECT min(ts) FROM readings WHERE meter = $1 AND ts >= $3), 'infinity') ORDER BY ts",
+			3, types, values, NULL, true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "pulse_values: unable to read readings for meter %d", meter);
+
+	m->nreadings = 0;
+	for (i = 0; i < SPI_processed; i++) {
+		HeapTuple tuple = SPI_tuptable->vals[i];
+		TupleDesc desc = SPI_tuptable->tupdesc;
+		struct reading *r;
+		bool isnull;
+
+		if (m->nreadings == size) {
+			size = size ? size * 2 : 64;
+			m->readings = m->readings ? repalloc(m->readings, size * sizeof(*m->readings)) : palloc(size * sizeof(*m->readings));
+		}
+
+		r = &m->readings[m->nreadings++];
+		r->ts = DatumGetTimestampTz(SPI_getbinval(tuple, desc, 1, &isnull));
+		r->value = DatumGetInt64(SPI_getbinval(tuple, desc, 2, &r->isnull));
+		r->upto = 0;
+	}
+	SPI_freetuptable(SPI_tuptable);
+}
+
+static struct event *add_event(struct meter *m, TimestampTz ts, bool emit) {
+	struct event *e;
+
+	if (m->nevents == m->size) {
+		m->size = m->size ? m->size * 2 : 4096;
+		m->events = m->events ? repalloc_huge(m->events, m->size * sizeof(*m->events)) : palloc(m->size * sizeof(*m->events));
+	}
+
+	e = &m->events[m->nevents++];
+	e->ts = ts;
+	e->emit = emit;
+	e->pulse_isnull = true;
+	return e;
+}
+
+static int compare_event(const void *a, const void *b) {
+	TimestampTz x = ((const struct event *)a)->ts;
+	TimestampTz y = ((const struct event *)b)->ts;
+
+	return (x > y) - (x < y);
+}
+
+static void load_events(struct meter *m, int32 meter, TimestampTz from, TimestampTz to) {
+	Oid types[3] = { INT4OID, TIMESTAMPTZOID, TIMESTAMPTZOID };
+	Datum values[3] = { Int32GetDatum(meter), TimestampTzGetDatum(from), TimestampTzGetDatum(to) };
+	bool counted = false;
+	Portal portal;
+	uint64 i;
+
+	m->nevents = 0;
+
+	portal = SPI_cursor_open_with_args(NULL, "SELECT start, stop - start FROM pulses WHERE meter = $1 AND start > $2 AND start <= $3 ORDER BY start",
+		3, types, values, NULL, true, 0);
+	do {
+		SPI_cursor_fetch(portal, true, FETCH_ROWS);
+		for (i = 0; i < SPI_processed; i++) {
+			HeapTuple tuple = SPI_tuptable->vals[i];
+			TupleDesc desc = SPI_tuptable->tupdesc;
+			struct event *e;
+			Datum pulse;
+			bool isnull;
+
+			e = add_event(m, DatumGetTimestampTz(SPI_getbinval(tuple, desc, 1, &isnull)), true);
+			pulse = SPI_getbinval(tuple, desc, 2, &e->pulse_isnull);
+			if (!e->pulse_isnull)
+				e->pulse = *DatumGetIntervalP(pulse);
+		}
+		SPI_freetuptable(SPI_tuptable);
+	} while (SPI_processed > 0);
+	SPI_cursor_close(portal);
+
+	portal = SPI_cursor_open_with_args(NULL, "SELECT first, last, count, ontime / count FROM pulse_counts WHERE meter = $1 AND count > 0 AND last > $2 AND first <= $3",
+		3, types, values, NULL, true, 0);
+	do {
+		SPI_cursor_fetch(portal, true, FETCH_ROWS);
+		for (i = 0; i < SPI_processed; i++) {
+			HeapTuple tuple = SPI_tuptable->vals[i];
+			TupleDesc desc = SPI_tuptable->tupdesc;
+			TimestampTz first, last;
+			int64 k, n;
+			Datum pulse;
+			bool isnull;
+
+			first = DatumGetTimestampTz(SPI_getbinval(tuple, desc, 1, &isnull));
+			last = DatumGetTimestampTz(SPI_getbinval(tuple, desc, 2, &isnull));
+			n = DatumGetInt64(SPI_getbinval(tuple, desc, 3, &isnull));
+			pulse = SPI_getbinval(tuple, desc, 4, &isnull);
+
+			for (k = 0; k < n; k++) {
+				TimestampTz ts = n > 1 ? first + (last - first) * k / (n - 1) : first;
+
+				if (ts > from && ts <= to) {
+					/* abs_pulses has one row for each count, at the last pulse */
+					struct event *e = add_event(m, ts, k == n - 1);
+
+					if (e->emit && !isnull) {
+						e->pulse = *DatumGetIntervalP(pulse);
+						e->pulse_isnull = false;
+					}
+				}
+			}
+			counted = true;
+		}
+		SPI_freetuptable(SPI_tuptable);
+	} while (SPI_processed > 0);
+	SPI_cursor_close(portal);
+
+	if (counted)
+		qsort(m->events, m->nevents, sizeof(*m->events), compare_event);
+}
+
+/* number of pulses with start <= ts */
+static int64 events_upto(const struct meter *m, TimestampTz ts) {
+	size_t lo = 0, hi = m->nevents;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (m->events[mid].ts <= ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int64 reading_floor(const struct meter *m, int64 value) {
+	return value - (value - m->offset) % m->pulse;
+}
+
+static Datum value_numeric(int64 value) {
+	uint64 abs = value < 0 ? -(uint64)value : (uint64)value;
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%s" UINT64_FORMAT ".%04u", value < 0 ? "-" : "",
+		abs / VALUE_SCALE, (unsigned int)(abs % VALUE_SCALE));
+	return DirectFunctionCall3(numeric_in, CStringGetDatum(buf), ObjectIdGetDatum(InvalidOid), Int32GetDatum(-1));
+}
+
+/* reading_calculate() without any queries: backward from the previous
+ * reading unless it's a reset, otherwise forward from the next reading
+ */
+static bool calculate(const struct meter *m, size_t *r, TimestampTz ts, int64 count, int64 *value) {
+	const struct reading *prev = NULL, *next = NULL;
+
+	while (*r < m->nreadings && m->readings[*r].ts <= ts)
+		(*r)++;
+
+	if (*r > 0)
+		prev = &m->readings[*r - 1];
+
+	if (prev != NULL && !prev->isnull) {
+		*value = reading_floor(m, prev->value) + (count - prev->upto) * m->pulse;
+		return true;
+	}
+
+	if (prev != NULL && prev->ts == ts)
+		next = prev;
+	else if (*r < m->nreadings)
+		next = &m->readings[*r];
+
+	if (next != NULL && !next->isnull) {
+		*value = reading_floor(m, next->value) - (next->upto - count) * m->pulse;
+		return true;
+	}
+
+	return false;
+}
+
+static void materialize(FunctionCallInfo fcinfo) {
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	MemoryContext old_context;
+	TupleDesc desc;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("set-valued function called in context that cannot accept a set")));
+	if (get_call_result_type(fcinfo, NULL, &desc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	old_context = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->setDesc = CreateTupleDescCopy(desc);
+	MemoryContextSwitchTo(old_context);
+}
+
+/* pulse_values(meter, after, upto) returns (ts, value, pulse) */
+Datum pulse_values(PG_FUNCTION_ARGS) {
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	int32 meter = PG_GETARG_INT32(0);
+	TimestampTz after = PG_GETARG_TIMESTAMPTZ(1);
+	TimestampTz upto = PG_GETARG_TIMESTAMPTZ(2);
+	struct meter m = { 0 };
+	MemoryContext row_context, old_context;
+	TimestampTz from, to;
+	size_t i, r = 0;
+
+	materialize(fcinfo);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "pulse_values: SPI_connect failed");
+
+	load_meter(&m, meter);
+	load_readings(&m, meter, after, upto);
+
+	/* only the pulses between the readings either side of the range are needed */
+	TIMESTAMP_NOBEGIN(from);
+	TIMESTAMP_NOEND(to);
+	if (m.nreadings > 0 && m.readings[0].ts <= after)
+		from = m.readings[0].ts;
+	if (m.nreadings > 0 && m.readings[m.nreadings - 1].ts >= upto)
+		to = m.readings[m.nreadings - 1].ts;
+
+	load_events(&m, meter, from, to);
+
+	for (i = 0; i < m.nreadings; i++)
+		m.readings[i].upto = events_upto(&m, m.readings[i].ts);
+
+	row_context = AllocSetContextCreate(CurrentMemoryContext, "pulse_values row", ALLOCSET_DEFAULT_SIZES);
+
+	for (i = 0; i < m.nevents; i++) {
+		const struct event *e = &m.events[i];
+		Datum values[3];
+		bool nulls[3] = { false, false, e->pulse_isnull };
+		int64 value;
+
+		if (!e->emit || e->ts <= after || e->ts > upto)
+			continue;
+
+		old_context = MemoryContextSwitchTo(row_context);
+		values[0] = TimestampTzGetDatum(e->ts);
+		if (m.valid && calculate(&m, &r, e->ts, events_upto(&m, e->ts), &value))
+			values[1] = value_numeric(value);
+		else
+			nulls[1] = true;
+		values[2] = e->pulse_isnull ? (Datum)0 : IntervalPGetDatum(&e->pulse);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+
+		MemoryContextSwitchTo(old_context);
+		MemoryContextReset(row_context);
+	}
+	MemoryContextDelete(row_context);
+
+	SPI_finish();
+	return (Datum)0;
+}
@@ -1,31 +1,86 @@
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <mqueue.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "pulsedb.h"
+#include "pulselog.h"
 #include "pulseq.h"
+#include "pulseshard.h"
+#include "pulsetrace.h"
 
 #ifdef SYSLOG
 # include <syslog.h>
 #endif
 
 #define PULSE_CACHE 3
+/* old and new generation of pulses with their commit messages */
+#define BACKUP_SIZE ((PULSE_CACHE + 1) * 2)
+
+/* Backup queue message, the pending off edge of a completed
+ * pulse is kept with the on edges written while it is pending
+ *
+ * the pulses are replaced by writing a new generation followed
+ * by a commit message before the previous one is removed, so
+ * that a partial replacement can always be discarded
+ */
+typedef struct {
+	pulse_t pulse;
+	uint64_t off; /* µs after the on edge, 0 if there is none */
+	uint32_t gen;
+	bool commit; /* the pulses of this generation are complete */
+} __attribute__((__packed__)) backup_t;
+
+/* FSM state of the leader of a pair, so that the other
+ * process can continue from exactly the same state
+ *
+ * the backup queue is still authoritative, this only
+ * avoids writing the on edge of a pulse again
+ */
+struct pair_state {
+	uint32_t seq; /* odd while it is being changed */
+	pid_t leader; /* set when the lock is acquired */
+	bool saving; /* the database may be changing */
+	int count;
+	pulse_t pulse[PULSE_CACHE];
+	bool process_on;
+	bool on_written;
+};
 
 char *mqueue_main;
 char *mqueue_backup;
-unsigned long int meter;
-mqd_t qmain, qbackup;
+char *mqueue_upgrade;
+char *mqueue_output = NULL;
+char *pair_name = NULL;
+char *count_name = NULL;
+mqd_t qmain, qbackup, qoutput;
+char *shard_file = NULL;
+struct shards shards;
+bool pair = false;
+struct pair_state *pair_state = NULL;
+int lock_fd = -1;
 bool process_on = true;
+bool on_written = true; /* the on edge may have been written */
+unsigned long hold_back = 0;
+int hold_timeout = -1;
 pulse_t pulse[PULSE_CACHE];
 int count = 0;
+uint32_t backup_gen = 0;
+int backup_msgs = 0; /* including commit messages */
+pulse_t pending_off; /* off edge of a completed pulse */
+bool off_pending = false;
 #ifndef NO_RESET
 bool reset_flag = false;
 #endif
@@ -33,24 +88,10 @@ bool reset_flag = false;
 char *ident;
 #endif
 
-void handle_signal(int sig);
-
-struct sigaction sa_ign = { /* handle signals, but store them for later */
-	.sa_handler = handle_signal,
-	.sa_flags = 0
-};
-struct sigaction sa_dfl = { /* use default signal handler */
-	.sa_handler = SIG_DFL,
-	.sa_flags = 0
-};
 sigset_t die_signals;
+int sfd = -1;
 int waiting_sig = 0;
 
-void handle_signal(int sig) {
-	if (waiting_sig == 0)
-		waiting_sig = sig;
-}
-
 static void setup_syslog(void) {
 #ifdef SYSLOG
 	int ret;
@@ -65,15 +106,79 @@ static void setup_syslog(void) {
 #endif
 }
 
-static void setup(int argc, char *argv[]) {
+static void usage(const char *name) {
+	printf("Usage: %s [-c conninfo [-s standby conninfo] | -S shard file] [-w hold back µs] [-i count interval] [-o output mqueue] [-p] <mqueue> <meter>\n", name);
+	exit(EXIT_FAILURE);
+}
+
+/* use the database (and standby) of the shard for this meter */
+static void setup_shard(const char *meter) {
+	const struct shard *shard;
 	int ret;
 
-	if (argc != 3) {
-		printf("Usage: %s <mqueue> <meter>\n", argv[0]);
+	ret = shard_load(shard_file, &shards);
+	cerror(shard_file, ret < 0);
+	if (ret > 0) {
+		fprintf(stderr, "%s:%d: Invalid shard\n", shard_file, ret);
 		exit(EXIT_FAILURE);
 	}
 
-	mqueue_main = argv[1];
+	shard = shard_find(&shards, strtoul(meter, NULL, 10));
+	if (shard == NULL) {
+		fprintf(stderr, "%s: No shard for meter %s\n", shard_file, meter);
+		exit(EXIT_FAILURE);
+	}
+
+	pulse_conninfo(shard->conninfo);
+	if (shard->standby != NULL)
+		pulse_standby(shard->standby);
+}
+
+static void setup(int argc, char *argv[]) {
+	bool conninfo = false;
+	int ret, opt;
+
+	while ((opt = getopt(argc, argv, "c:s:S:w:i:o:p")) != -1) {
+		switch (opt) {
+		case 'c':
+			pulse_conninfo(optarg);
+			conninfo = true;
+			break;
+
+		case 's':
+			pulse_standby(optarg);
+			conninfo = true;
+			break;
+
+		case 'S':
+			shard_file = optarg;
+			break;
+
+		case 'w':
+			hold_back = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'i':
+			count_interval(optarg);
+			break;
+
+		case 'o':
+			mqueue_output = optarg;
+			break;
+
+		case 'p':
+			pair = true;
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 2 || (conninfo && shard_file != NULL))
+		usage(argv[0]);
+
+	mqueue_main = argv[optind];
 
 	mqueue_backup = malloc((strlen(mqueue_main) + 2) * sizeof(char));
 	cerror("malloc", mqueue_backup == NULL);
@@ -81,7 +186,31 @@ static void setup(int argc, char *argv[]) {
 	ret = sprintf(mqueue_backup, "%s~", mqueue_main);
 	cerror("snprintf", ret < 0);
 
-	pulse_meter(argv[2]);
+	mqueue_upgrade = malloc((strlen(mqueue_backup) + strlen(BACKUP_UPGRADE) + 1) * sizeof(char));
+	cerror("malloc", mqueue_upgrade == NULL);
+
+	ret = sprintf(mqueue_upgrade, "%s" BACKUP_UPGRADE, mqueue_backup);
+	cerror("snprintf", ret < 0);
+
+	if (pair) {
+		pair_name = malloc((strlen(mqueue_main) + strlen(PAIR_STATE) + 1) * sizeof(char));
+		cerror("malloc", pair_name == NULL);
+
+		ret = sprintf(pair_name, "%s" PAIR_STATE, mqueue_main);
+		cerror("snprintf", ret < 0);
+	}
+
+	if (count_enabled()) {
+		count_name = malloc((strlen(mqueue_main) + strlen(COUNT_STATE) + 1) * sizeof(char));
+		cerror("malloc", count_name == NULL);
+
+		ret = sprintf(count_name, "%s" COUNT_STATE, mqueue_main);
+		cerror("snprintf", ret < 0);
+	}
+
+	if (shard_file != NULL)
+		setup_shard(argv[optind + 1]);
+	pulse_meter(argv[optind + 1]);
 
 	setup_syslog();
 }
@@ -96,85 +225,384 @@ static void signal_init(void) {
 	cerror("sigaddset SIGQUIT", sigaddset(&die_signals, SIGQUIT) != 0);
 	cerror("sigaddset SIGTERM", sigaddset(&die_signals, SIGTERM) != 0);
 
-	sa_ign.sa_mask = die_signals;
-	cerror("sigemptyset", sigemptyset(&sa_dfl.sa_mask) != 0);
+	/* signals are always blocked (held) so that updates to
+	 * the backup queue are never interrupted, they are read
+	 * from the signalfd while waiting for data instead
+	 */
+	cerror("sigprocmask SIG_BLOCK", sigprocmask(SIG_BLOCK, &die_signals, NULL) != 0);
+
+	sfd = signalfd(-1, &die_signals, SFD_NONBLOCK|SFD_CLOEXEC);
+	cerror("signalfd", sfd < 0);
+}
+
+static void pair_init(void) {
+	int fd, ret;
+
+	fd = shm_open(pair_name, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+	cerror(pair_name, fd < 0);
+
+	ret = ftruncate(fd, sizeof(*pair_state));
+	cerror("ftruncate", ret != 0);
+
+	pair_state = mmap(NULL, sizeof(*pair_state), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	cerror("mmap", pair_state == MAP_FAILED);
+
+	cerror("close", close(fd));
+}
+
+/* read all of the messages from a backup queue,
+ * which may have been created with a different size
+ */
+static int backup_drain(mqd_t q, long msgsize, backup_t *msgs) {
+	char *buf;
+	int n = 0;
+
+	buf = malloc(msgsize);
+	cerror("malloc", buf == NULL);
+
+	while (n < BACKUP_SIZE) {
+		int ret = mq_receive(q, buf, msgsize, 0);
+
+		if (ret < (int)sizeof(pulse_t)) {
+			cerror("mq_receive backup", ret >= 0 || errno != EAGAIN);
+			break;
+		}
+
+		memset(&msgs[n], 0, sizeof(msgs[n]));
+		memcpy(&msgs[n], buf, (size_t)ret < sizeof(msgs[n]) ? (size_t)ret : sizeof(msgs[n]));
+		n++;
+	}
+	free(buf);
+	return n;
+}
+
+static void backup_fill(mqd_t q, const backup_t *msgs, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		cerror("mq_send backup", mq_send(q, (const char *)&msgs[i], sizeof(msgs[i]), 0) != 0);
+}
+
+/* finish recreating the backup queue if the process was killed after
+ * the old queue was removed, the new queue may be missing some edges
+ * so they're copied again from the upgrade queue
+ */
+static void backup_recover(struct mq_attr *attr) {
+	backup_t msgs[BACKUP_SIZE];
+	struct mq_attr cur;
+	mqd_t q;
+	int n;
+
+	q = mq_open(mqueue_upgrade, O_RDWR|O_NONBLOCK);
+	if (q < 0) {
+		cerror(mqueue_upgrade, errno != ENOENT);
+		return;
+	}
+
+	cerror("mq_getattr", mq_getattr(qbackup, &cur) != 0);
+	if (cur.mq_msgsize == attr->mq_msgsize && cur.mq_maxmsg == attr->mq_maxmsg) {
+		_printf("recovering backup queue\n");
+		backup_drain(qbackup, cur.mq_msgsize, msgs);
+		n = backup_drain(q, attr->mq_msgsize, msgs);
+		backup_fill(qbackup, msgs, n);
+	} else {
+		/* the old queue is still complete */
+		_printf("discarding incomplete backup queue\n");
+	}
+
+	cerror(mqueue_upgrade, mq_close(q));
+	cerror(mqueue_upgrade, mq_unlink(mqueue_upgrade));
+}
+
+/* recreate a backup queue with a different message size or capacity,
+ * keeping the edges in another queue until the old one is replaced
+ */
+static void backup_upgrade(struct mq_attr *attr) {
+	backup_t msgs[BACKUP_SIZE];
+	struct mq_attr old;
+	mqd_t q;
+	int n;
+
+	cerror("mq_getattr", mq_getattr(qbackup, &old) != 0);
+	if (old.mq_msgsize == attr->mq_msgsize && old.mq_maxmsg == attr->mq_maxmsg)
+		return;
+
+	n = backup_drain(qbackup, old.mq_msgsize, msgs);
+
+	_printf("recreating backup queue\n");
+	q = mq_open(mqueue_upgrade, O_RDWR|O_NONBLOCK|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR, attr);
+	cerror(mqueue_upgrade, q < 0);
+	backup_fill(q, msgs, n);
+	cerror(mqueue_upgrade, mq_close(q));
+
+	cerror(mqueue_backup, mq_close(qbackup));
+	cerror(mqueue_backup, mq_unlink(mqueue_backup));
+
+	qbackup = mq_open(mqueue_backup, O_RDWR|O_NONBLOCK|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR, attr);
+	cerror(mqueue_backup, qbackup < 0);
+	backup_fill(qbackup, msgs, n);
+
+	cerror(mqueue_upgrade, mq_unlink(mqueue_upgrade));
 }
 
 static void init(void) {
 	struct mq_attr qmain_attr = {
 		.mq_flags = 0,
 		.mq_maxmsg = 4096,
-		.mq_msgsize = sizeof(pulse_t)
+		.mq_msgsize = sizeof(pulse_span_t)
 	};
 	struct mq_attr qbackup_attr = {
 		.mq_flags = 0,
-		.mq_maxmsg = PULSE_CACHE,
-		.mq_msgsize = sizeof(pulse_t)
+		.mq_maxmsg = BACKUP_SIZE,
+		.mq_msgsize = sizeof(backup_t)
 	};
 
 	umask(0);
 
-	qmain = mq_open(mqueue_main, O_RDONLY|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP, &qmain_attr);
+	/* before the backup queue is modified */
+	signal_init();
+
+	/* writable for the off edges of completed pulses */
+	qmain = mq_open(mqueue_main, O_RDWR|O_NONBLOCK|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP, &qmain_attr);
 	cerror(mqueue_main, qmain < 0);
 
 	qbackup = mq_open(mqueue_backup, O_RDWR|O_NONBLOCK|O_CREAT, S_IRUSR|S_IWUSR, &qbackup_attr);
 	cerror(mqueue_backup, qbackup < 0);
+	backup_recover(&qbackup_attr);
+	backup_upgrade(&qbackup_attr);
 
-	signal_init();
-}
+	if (mqueue_output != NULL) {
+		qoutput = mq_open(mqueue_output, O_WRONLY|O_NONBLOCK|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP, &qmain_attr);
+		cerror(mqueue_output, qoutput < 0);
+	}
 
-static void signal_hold(void) {
-	cerror("sigprocmask SIG_BLOCK", sigprocmask(SIG_BLOCK, &die_signals, NULL) != 0);
+	if (pair)
+		pair_init();
+
+	if (count_name != NULL)
+		count_state(count_name);
+
+	trace_open();
 }
 
-static void try_signal_hold(void) {
-	int ret = sigprocmask(SIG_BLOCK, &die_signals, NULL);
-	if (ret != 0) {
-		perror("sigprocmask SIG_BLOCK");
-		/* need to continue */
+/* wait for a signal, returns true if one has been received */
+static bool signal_wait(int timeout) {
+	struct pollfd fds = { .fd = sfd, .events = POLLIN };
+	struct signalfd_siginfo info;
+	int ret;
+
+	if (waiting_sig != 0)
+		return true;
+
+#ifdef SIM
+	/* waiting is virtual, but signals are still real */
+	if (timeout > 0) {
+		sim_sleep(timeout);
+		timeout = 0;
+	}
+#endif
+
+	ret = poll(&fds, 1, timeout);
+	cerror("poll", ret < 0 && errno != EINTR);
+	if (ret <= 0)
+		return false;
+
+	ret = read(sfd, &info, sizeof(info));
+	if (ret != sizeof(info)) {
+		cerror("read signalfd", errno != EAGAIN);
+		return false;
 	}
+
+	waiting_sig = info.ssi_signo;
+	return true;
 }
+
+/* the off edge of a completed pulse is only put back
+ * at the front of the main queue if pulsedb is exiting
+ */
+static void pending_requeue(void) {
+	if (!off_pending)
+		return;
+
+	_printf("requeue %lu.%06u %d to main queue\n", (unsigned long int)pending_off.tv.tv_sec, (unsigned int)pending_off.tv.tv_usec, pending_off.on);
+	if (mq_send(qmain, (const char *)&pending_off, sizeof(pending_off), 1) != 0)
+		perror("mq_send main");
+	off_pending = false;
+}
+
+/* resend the signal and let the default action happen */
 static void signal_dispatch(void) {
+	pending_requeue();
+	log_close();
+	cerror("kill", kill(getpid(), waiting_sig) != 0);
 	cerror("sigprocmask SIG_UNBLOCK", sigprocmask(SIG_UNBLOCK, &die_signals, NULL) != 0);
 }
 
-static void backup_pulse(void) {
-	int ret = mq_send(qbackup, (char *)&pulse[count], sizeof(pulse_t), 0);
+/* only the leader changes the state */
+static void pair_update(bool saving) {
+	if (pair_state == NULL)
+		return;
+
+	pair_state->seq++;
+	__sync_synchronize();
+
+	pair_state->saving = saving;
+	pair_state->count = count;
+	memcpy(pair_state->pulse, pulse, sizeof(pulse));
+	pair_state->process_on = process_on;
+	pair_state->on_written = on_written;
+
+	__sync_synchronize();
+	pair_state->seq++;
+}
+
+/* continue from the state of the previous leader if it
+ * stopped between writes and matches the backup queue
+ */
+static bool pair_adopt(int loaded) {
+	struct pair_state state;
+	uint32_t seq;
+	bool adopted;
+
+	if (pair_state == NULL)
+		return false;
+
+	seq = pair_state->seq;
+	__sync_synchronize();
+	state = *pair_state;
+	__sync_synchronize();
+
+	adopted = seq != 0 && !(seq & 1) && seq == pair_state->seq
+		&& !state.saving && state.count == loaded
+		&& !memcmp(state.pulse, pulse, loaded * sizeof(pulse_t));
+
+	/* the previous leader may have been killed while changing it */
+	if (pair_state->seq & 1)
+		pair_state->seq++;
+
+	if (!adopted)
+		return false;
+
+	_printf("continuing from the previous leader\n");
+	process_on = state.process_on;
+	on_written = state.on_written;
+	return true;
+}
+
+static void backup_send(const backup_t *msg) {
+	int ret = mq_send(qbackup, (const char *)msg, sizeof(*msg), 0);
 	cerror("mq_send backup", ret != 0);
-	_printf("wrote %d %lu.%06u %d to backup queue\n", count, (unsigned long int)pulse[count].tv.tv_sec, (unsigned int)pulse[count].tv.tv_usec, pulse[count].on);
+	backup_msgs++;
+}
+
+static void backup_write(const pulse_t *p, int n, uint32_t gen) {
+	backup_t msg = { .pulse = *p, .off = 0, .gen = gen, .commit = false };
+
+	if (off_pending && p->on && tv_to_ull(pending_off.tv) > tv_to_ull(p->tv))
+		msg.off = tv_to_ull(pending_off.tv) - tv_to_ull(p->tv);
+
+	backup_send(&msg);
+	SIM_POINT(backup_pulse);
+	_printf("wrote %d %lu.%06u %d to backup queue\n", n, (unsigned long int)msg.pulse.tv.tv_sec, (unsigned int)msg.pulse.tv.tv_usec, msg.pulse.on);
+}
+
+static void backup_pulse(void) {
+	backup_write(&pulse[count], count, backup_gen);
 }
 
 static void backup_clear(void) {
 	_printf("clearing backup queue\n");
 	while (count > 0) {
-		pulse_t tmp;
+		backup_t tmp;
 		int ret = mq_receive(qbackup, (char *)&tmp, sizeof(tmp), 0);
-		cerror("mq_receive backup", ret != sizeof(pulse_t));
-		count--;
+		cerror("mq_receive backup", ret != sizeof(tmp));
+		backup_msgs--;
+		if (!tmp.commit)
+			count--;
+		SIM_POINT(backup_clear);
 	}
 }
 
+/* replace everything in the backup queue with the first n pulses */
+static void backup_replace(int n) {
+	backup_t commit = { .off = 0, .gen = backup_gen + 1, .commit = true };
+	int i, old = backup_msgs;
+
+	_printf("replacing backup queue\n");
+	for (i = 0; i < n; i++)
+		backup_write(&pulse[i], i, backup_gen + 1);
+
+	memset(&commit.pulse, 0, sizeof(commit.pulse));
+	backup_send(&commit);
+	backup_gen++;
+	SIM_POINT(backup_commit);
+
+	while (old > 0) {
+		backup_t tmp;
+		int ret = mq_receive(qbackup, (char *)&tmp, sizeof(tmp), 0);
+		cerror("mq_receive backup", ret != sizeof(tmp));
+		backup_msgs--;
+		old--;
+		SIM_POINT(backup_clear);
+	}
+	count = n;
+}
+
 static void backup_load(void) {
-	int ret, i, loaded = 0;
+	unsigned long long last = 0, off = 0;
+	backup_t msgs[BACKUP_SIZE];
+	int ret, i, n = 0, loaded = 0;
+	bool adopted;
 
-	/* critical section:
-	 *
-	 * block (hold) all signals
-	 */
-	signal_hold();
+	/* critical section (signals are held) */
 
 	/* read from backup queue */
-	while (loaded < PULSE_CACHE) {
-		ret = mq_receive(qbackup, (char *)&pulse[loaded], sizeof(pulse_t), 0);
-		if (ret != sizeof(pulse_t)) {
-			cerror("mq_receive backup", errno != EAGAIN);
+	while (n < BACKUP_SIZE) {
+		ret = mq_receive(qbackup, (char *)&msgs[n], sizeof(msgs[n]), 0);
+		if (ret != sizeof(msgs[n])) {
+			cerror("mq_receive backup", ret >= 0 || errno != EAGAIN);
 			break;
-		} else {
-			_printf("read %d %lu.%06u %d from backup queue\n", loaded, (unsigned long int)pulse[loaded].tv.tv_sec, (unsigned int)pulse[loaded].tv.tv_usec, pulse[loaded].on);
-			loaded++;
 		}
+		n++;
+	}
+
+	/* use the last committed generation, any pulses
+	 * after it are from an incomplete replacement
+	 */
+	backup_gen = n > 0 ? msgs[0].gen : 0;
+	for (i = 0; i < n; i++)
+		if (msgs[i].commit)
+			backup_gen = msgs[i].gen;
+
+	for (i = 0; i < n && loaded < PULSE_CACHE; i++) {
+		if (msgs[i].commit || msgs[i].gen != backup_gen)
+			continue;
+
+		pulse[loaded] = msgs[i].pulse;
+		_printf("read %d %lu.%06u %d from backup queue\n", loaded, (unsigned long int)pulse[loaded].tv.tv_sec, (unsigned int)pulse[loaded].tv.tv_usec, pulse[loaded].on);
+
+		if (pulse[loaded].tv.tv_sec != 0)
+			last = tv_to_ull(pulse[loaded].tv);
+		if (msgs[i].off != 0)
+			off = tv_to_ull(pulse[loaded].tv) + msgs[i].off;
+		loaded++;
+	}
+	backup_msgs = 0;
+
+	SIM_POINT(backup_load);
+
+	/* the off edge is pending until it has been written after the other edges */
+	off_pending = (off > last);
+	if (off_pending) {
+		pending_off.tv.tv_sec = off / 1000000;
+		pending_off.tv.tv_usec = off % 1000000;
+		pending_off.on = false;
+		_printf("off edge %lu.%06u pending\n", (unsigned long int)pending_off.tv.tv_sec, (unsigned int)pending_off.tv.tv_usec);
 	}
 
+	adopted = pair_adopt(loaded);
+	if (!adopted)
+		on_written = true;
 #ifndef NO_RESET
 	reset_flag = false;
 #endif
@@ -232,12 +660,35 @@ static void backup_load(void) {
 	/* write to backup queue */
 	for (count = 0; count < loaded; count++)
 		backup_pulse();
+}
 
-	/* non-critical section:
-	 *
-	 * unblock all signals (receive pending signals immediately)
-	 */
-	signal_dispatch();
+/* pass completed pulses on to the next stage of analysis,
+ * a resumed pulse will be output again when it completes
+ *
+ * this never waits for a full queue, so that the output
+ * can't delay writing pulses to the database
+ */
+static void output_pulse(const pulse_t *on, const pulse_t *off) {
+	pulse_span_t span = {
+		.tv = { .tv_sec = 0, .tv_usec = 0 },
+		.on = false,
+		.duration = 0
+	};
+
+	if (mqueue_output == NULL)
+		return;
+
+	/* a reset is output as an empty span */
+	if (on != NULL) {
+		span.tv = on->tv;
+		span.on = true;
+		span.duration = tv_to_ull(off->tv) - tv_to_ull(on->tv);
+	}
+
+	if (mq_send(qoutput, (const char *)&span, sizeof(span), 0) != 0) {
+		cerror("mq_send output", errno != EAGAIN);
+		_printf("output queue full\n");
+	}
 }
 
 static void daemon(void) {
@@ -253,19 +704,36 @@ static void daemon(void) {
 #endif
 }
 
+/* in counting mode pulses are only written as
+ * part of the counts for the current interval
+ */
 static bool __pulse_on(const struct timeval *on, const struct timeval *off) {
 	(void)off;
-	return pulse_on(on);
+	return count_enabled() ? count_on(on) : pulse_on(on);
+}
+
+static bool __pulse_off(const struct timeval *on, const struct timeval *off) {
+	return count_enabled() ? count_off(on, off) : pulse_off(on, off);
+}
+
+static bool __pulse_on_off(const struct timeval *on, const struct timeval *off) {
+	return count_enabled() ? count_on_off(on, off) : pulse_on_off(on, off);
 }
 
 static bool __pulse_cancel(const struct timeval *on, const struct timeval *off) {
 	(void)off;
-	return pulse_cancel(on);
+	return count_enabled() ? count_cancel(on) : pulse_cancel(on);
 }
 
 static bool __pulse_resume(const struct timeval *on, const struct timeval *off) {
 	(void)off;
-	return pulse_resume(on);
+	return count_enabled() ? count_resume(on) : pulse_resume(on);
+}
+
+static bool __count_flush(const struct timeval *on, const struct timeval *off) {
+	(void)on;
+	(void)off;
+	return count_flush(false);
 }
 
 #ifndef NO_RESET
@@ -276,15 +744,93 @@ static bool __pulse_reset(const struct timeval *on, const struct timeval *off) {
 }
 #endif
 
+/* stop if the other process may have become the leader,
+ * it will continue from the backup queue
+ *
+ * if the connection was lost the lock is taken again, and
+ * nothing is written until a server is available
+ */
+static void pair_check(void) {
+	enum pulse_lock state;
+
+	if (!pair)
+		return;
+
+	state = pulse_lock_check();
+	lock_fd = pulse_lock_fd();
+	if (state == LOCK_LOST || pair_state->leader != getpid()) {
+		_printf("lost the lock\n");
+		pending_requeue();
+		exit(EXIT_FAILURE);
+	}
+}
+
 static void save(bool (*func)(const struct timeval *, const struct timeval *)) {
 	int backoff = 1;
+	uint16_t attempt = 0;
+	bool failover;
 
+	pair_update(true);
+	trace_event(TRACE_SAVE, pulse[0].tv, attempt);
+	SIM_POINT(save);
 	while (!func(&pulse[0].tv, &pulse[1].tv)) {
-		sleep(backoff);
+		trace_event(TRACE_SAVE_FAIL, pulse[0].tv, attempt);
+
+		/* retry immediately after switching to the standby (which
+		 * moves the lock of a pair), otherwise wait but allow the
+		 * process to be killed
+		 */
+		failover = pulse_failover();
+		pair_check();
+		if (!failover && signal_wait(backoff * 1000))
+			signal_dispatch();
+		trace_event(TRACE_SAVE, pulse[0].tv, ++attempt);
 
 		if (backoff < 256)
 			backoff <<= 1;
 	}
+	SIM_POINT(saved);
+}
+
+/* delay writing a new on edge until it has lasted for the hold
+ * back window, or until the edges already in the main queue
+ * (or the off edge of a completed pulse) have been read, so
+ * that noise is never written
+ */
+static bool on_hold(void) {
+	struct timeval tv;
+	struct mq_attr attr;
+	unsigned long long now, until;
+
+	if (on_written)
+		return false;
+
+	/* the off edge of a completed pulse is received next,
+	 * so the whole pulse can be written at once
+	 */
+	if (off_pending) {
+		hold_timeout = 0;
+		return true;
+	}
+
+	if (hold_back == 0)
+		return false;
+
+	cerror("gettimeofday", gettimeofday(&tv, NULL) != 0);
+	now = tv_to_ull(tv);
+	until = tv_to_ull(pulse[0].tv) + hold_back;
+	if (now < until) {
+		hold_timeout = (until - now + 999) / 1000;
+		return true;
+	}
+
+	cerror("mq_getattr", mq_getattr(qmain, &attr) != 0);
+	if (attr.mq_curmsgs > 0) {
+		hold_timeout = 0;
+		return true;
+	}
+
+	return false;
 }
 
 static void save_on(void) {
@@ -292,9 +838,15 @@ static void save_on(void) {
 	assert(pulse[0].on);
 
 	if (process_on) {
+		if (on_hold()) {
+			_printf("holding on pulse\n");
+			return;
+		}
+
 		_printf("process on pulse\n");
 		save(__pulse_on);
 		process_on = false;
+		on_written = true;
 	}
 }
 
@@ -308,13 +860,19 @@ static void save_on_off(void) {
 
 	if (process_on) {
 		if (ignore) {
-			_printf("cancelling short on+off pulse\n");
-			save(__pulse_cancel);
+			if (on_written) {
+				_printf("cancelling short on+off pulse\n");
+				save(__pulse_cancel);
+			} else {
+				_printf("discarding short on+off pulse\n");
+			}
 
 			backup_clear();
 		} else {
 			_printf("process on+off pulse\n");
-			save(pulse_on_off);
+			save(__pulse_on_off);
+			on_written = true;
+			output_pulse(&pulse[0], &pulse[1]);
 		}
 	} else {
 		if (ignore) {
@@ -324,7 +882,8 @@ static void save_on_off(void) {
 			backup_clear();
 		} else {
 			_printf("process off pulse\n");
-			save(pulse_off);
+			save(__pulse_off);
+			output_pulse(&pulse[0], &pulse[1]);
 		}
 	}
 }
@@ -340,17 +899,20 @@ static void save_on_off_on(void) {
 	ignore = (tv_to_ull(pulse[2].tv) - tv_to_ull(pulse[1].tv) < MIN_PULSE);
 
 	if (ignore) {
-		pulse_t keep;
-
 		if (process_on) {
 			ignore = (tv_to_ull(pulse[1].tv) - tv_to_ull(pulse[0].tv) < MIN_PULSE);
 
 			if (ignore) {
-				_printf("cancelling short on+off pulse\n");
-				save(__pulse_cancel);
+				if (on_written) {
+					_printf("cancelling short on+off pulse\n");
+					save(__pulse_cancel);
+				} else {
+					_printf("discarding short on+off pulse\n");
+				}
 
 				/* keep the third pulse and ignore the other two */
 				pulse[0] = pulse[2];
+				on_written = false;
 			} else {
 				_printf("fixing interrupted pulse\n");
 			}
@@ -358,30 +920,15 @@ static void save_on_off_on(void) {
 			_printf("resuming interrupted pulse\n");
 		}
 
-		save(__pulse_resume);
-
-		/* critical section:
-		*
-		* block (hold) all signals
-		*/
-		signal_hold();
+		/* nothing to resume if the pulse has not been written */
+		if (on_written)
+			save(__pulse_resume);
 
-		/* keep the first pulse */
-		keep = pulse[0];
+		/* critical section (signals are held) */
 
-		/* clear everything */
-		backup_clear();
-
-		/* restore the pulse */
-		pulse[0] = keep;
-		backup_pulse();
-		count = 1;
-
-		/* non-critical section:
-		*
-		* unblock all signals (receive pending signals immediately)
-		*/
-		signal_dispatch();
+		/* keep only the first pulse */
+		SIM_POINT(keep);
+		backup_replace(1);
 	} else {
 		if (process_on) {
 			_printf("check on+off+on pulse\n");
@@ -401,6 +948,7 @@ static void save_on_off_on(void) {
 		pulse[0] = pulse[2];
 		count = 1;
 		process_on = true;
+		on_written = false;
 	}
 
 	if (process_on) {
@@ -411,22 +959,14 @@ static void save_on_off_on(void) {
 
 #ifndef NO_RESET
 static void save_reset(void) {
-	int i, keep;
+	int i;
 	bool found = false;
 
 	save(__pulse_reset);
 	reset_flag = false;
+	output_pulse(NULL, NULL);
 
-	/* critical section:
-	 *
-	 * block (hold) all signals
-	 */
-	signal_hold();
-
-	/* clear everything */
-	keep = count;
-	backup_clear();
-	count = keep;
+	/* critical section (signals are held) */
 
 	/* remove the first reset */
 	for (i = 0; i < count; i++) {
@@ -447,16 +987,9 @@ static void save_reset(void) {
 		}
 	}
 
-	/* restore the pulses */
-	keep = count;
-	for (count = 0; count < keep; count++)
-		backup_pulse();
-
-	/* non-critical section:
-	*
-	* unblock all signals (receive pending signals immediately)
-	*/
-	signal_dispatch();
+	/* replace the pulses */
+	SIM_POINT(reset_clear);
+	backup_replace(count);
 
 	if (!reset_flag)
 		_printf("reset complete\n");
@@ -481,6 +1014,7 @@ static void handle_pulse(void) {
 
 			count++;
 			process_on = true;
+			on_written = false;
 		} else { /* discard unknown off pulse */ }
 	} else if (count == 1) {
 		/* on pulse waiting for off pulse */
@@ -505,67 +1039,120 @@ static void handle_pulse(void) {
 	}
 }
 
-static void signal_capture(void) {
-	cerror("sigaction SIGHUP", sigaction(SIGHUP, &sa_ign, NULL) != 0);
-	cerror("sigaction SIGINT", sigaction(SIGINT, &sa_ign, NULL) != 0);
-	cerror("sigaction SIGQUIT", sigaction(SIGQUIT, &sa_ign, NULL) != 0);
-	cerror("sigaction SIGTERM", sigaction(SIGTERM, &sa_ign, NULL) != 0);
-}
-
-static void signal_release(void) {
-	cerror("sigaction SIGHUP", sigaction(SIGHUP, &sa_dfl, NULL) != 0);
-	cerror("sigaction SIGINT", sigaction(SIGINT, &sa_dfl, NULL) != 0);
-	cerror("sigaction SIGQUIT", sigaction(SIGQUIT, &sa_dfl, NULL) != 0);
-	cerror("sigaction SIGTERM", sigaction(SIGTERM, &sa_dfl, NULL) != 0);
+/* handle the off edge of a completed pulse as soon as there
+ * is space for it in the backup queue, returns false if it
+ * has to wait until the FSM has processed the other pulses
+ */
+static bool receive_off(void) {
+	if (!off_pending || count >= PULSE_CACHE)
+		return false;
+
+	/* critical section (signals are held) */
+	pulse[count] = pending_off;
+	off_pending = false;
+	trace_event(TRACE_RECEIVE, pulse[count].tv, pulse[count].on);
+	_printf("read %d %lu.%06u %d from completed pulse\n", count, (unsigned long int)pulse[count].tv.tv_sec, (unsigned int)pulse[count].tv.tv_usec, pulse[count].on);
+	handle_pulse();
+	return true;
 }
 
 static void get_data(void) {
+	pulse_span_t span;
+	int timeout;
+	struct pollfd fds[3] = {
+		{ .fd = qmain, .events = POLLIN }, /* mqd_t is a file descriptor on Linux */
+		{ .fd = sfd, .events = POLLIN },
+		{ .fd = lock_fd, .events = POLLIN } /* ignored if negative */
+	};
 	int ret;
 
 	assert(count >= 0);
 	assert(count < PULSE_CACHE);
 
-	/* managed section:
-	*
-	* handle signals, saving them for later
-	*/
-	signal_capture();
-
-	/* although the signal handler will stop
-	* signals killing the process, this will
-	* return EINTR allowing it to be killed
-	* in this non-critical section
-	*/
-	ret = mq_receive(qmain, (char *)&pulse[count], sizeof(pulse_t), 0);
-	if (ret != sizeof(pulse_t)) {
-		/* non-critical section:
-		*
-		* exit, possibly with interrupted status
-		*/
-		if (errno == 0)
-			errno = EIO; /* message size mismatch */
-		xerror("mq_receive main");
-	} else {
-		/* critical section:
-		*
-		* signals are currently handled, but
-		* would cause mq_send to return EINTR
-		*
-		* block (hold) all signals
-		*/
-		try_signal_hold();
+	/* before waiting for anything else */
+	if (receive_off())
+		return;
+
+	/* wait for the hold back window of an on edge
+	 * or until the pulse counts need to be written
+	 */
+	timeout = hold_timeout;
+	if (count_enabled()) {
+		int flush = count_timeout();
+
+		if (flush >= 0 && (timeout < 0 || flush < timeout))
+			timeout = flush;
+	}
+
+#ifdef SIM
+	/* stop when everything has been processed */
+	if (timeout < 0) {
+		struct mq_attr attr;
 
-		_printf("read %d %lu.%06u %d from main queue\n", count, (unsigned long int)pulse[count].tv.tv_sec, (unsigned int)pulse[count].tv.tv_usec, pulse[count].on);
-		handle_pulse();
+		cerror("mq_getattr", mq_getattr(qmain, &attr) != 0);
+		if (attr.mq_curmsgs == 0)
+			sim_idle();
 	}
+#endif
+
+	do {
+		ret = poll(fds, 3, timeout);
+		cerror("poll", ret < 0 && errno != EINTR);
+		if (ret == 0) {
+			hold_timeout = -1;
+			return;
+		}
 
-	/* non-critical section:
-	*
-	* unblock all signals (receive pending signals immediately)
-	* resume use of default signal handlers
-	*/
-	signal_dispatch();
-	signal_release();
+		/* exit before reading anything else, the
+		 * message will remain in the main queue
+		 */
+		if ((fds[1].revents & POLLIN) && signal_wait(0))
+			return;
+
+		if (fds[2].revents) {
+			pair_check();
+			fds[2].fd = lock_fd;
+		}
+
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		ret = mq_receive(qmain, (char *)&span, sizeof(span), 0);
+		if (ret != sizeof(pulse_t) && ret != sizeof(pulse_span_t)) {
+			if (ret < 0 && errno == EAGAIN)
+				continue;
+
+			if (ret >= 0)
+				errno = EIO; /* message size mismatch */
+			xerror("mq_receive main");
+		}
+	} while (ret < 0);
+	hold_timeout = -1;
+
+	/* critical section (signals are held) */
+	pulse[count].tv = span.tv;
+	pulse[count].on = span.on;
+	trace_event(TRACE_RECEIVE, pulse[count].tv, pulse[count].on);
+	_printf("read %d %lu.%06u %d from main queue\n", count, (unsigned long int)pulse[count].tv.tv_sec, (unsigned int)pulse[count].tv.tv_usec, pulse[count].on);
+	SIM_POINT(receive);
+
+	/* a completed pulse is an on edge followed by an off edge,
+	 * which is written to the backup queue with the on edge
+	 */
+	if (ret == sizeof(pulse_span_t) && span.on && span.duration > 0) {
+		unsigned long long stop = tv_to_ull(span.tv) + span.duration;
+
+		pending_off.tv.tv_sec = stop / 1000000;
+		pending_off.tv.tv_usec = stop % 1000000;
+		pending_off.on = false;
+		off_pending = true;
+	}
+
+	handle_pulse();
+	if (off_pending) {
+		SIM_POINT(off_pending);
+		receive_off();
+	}
 }
 
 static void loop(void) {
@@ -573,6 +1160,7 @@ static void loop(void) {
 		_printf("main loop %d\n", count);
 		assert(count >= 0);
 		assert(count <= PULSE_CACHE);
+		pair_update(false);
 
 #ifndef NO_RESET
 		if (reset_flag) {
@@ -581,6 +1169,10 @@ static void loop(void) {
 		}
 #endif
 
+		/* a new interval is written by count_on() */
+		if (count_enabled() && count_timeout() == 0)
+			save(__count_flush);
+
 		switch (count) {
 		case 0: /* no data */
 			break;
@@ -601,9 +1193,61 @@ static void loop(void) {
 		get_data();
 	} while(waiting_sig == 0);
 
-	/* resend first signal captured by signal handler */
+	/* try once to write the current pulse counts */
+	if (count_enabled() && !count_flush(true))
+		_printf("unable to write pulse counts\n");
+
+	/* resend the signal received while waiting for data */
 	if (waiting_sig != 0)
-		cerror("kill", kill(getpid(), waiting_sig) != 0);
+		signal_dispatch();
+}
+
+/* wait until the other process of the pair has stopped,
+ * retrying (with a backoff) if the database is unavailable
+ */
+static void lead(void) {
+	int backoff = 1;
+
+	_printf("waiting for the lock\n");
+	for (;;) {
+		struct pollfd fds[2] = {
+			{ .fd = pulse_lock(), .events = POLLIN },
+			{ .fd = sfd, .events = POLLIN }
+		};
+		enum pulse_lock state = LOCK_LOST;
+		int ret;
+
+		lock_fd = fds[0].fd;
+		if (lock_fd >= 0)
+			state = pulse_lock_check();
+
+		while (state == LOCK_WAITING) {
+			ret = poll(fds, 2, -1);
+			cerror("poll", ret < 0 && errno != EINTR);
+
+			if ((fds[1].revents & POLLIN) && signal_wait(0))
+				signal_dispatch();
+
+			if (fds[0].revents)
+				state = pulse_lock_check();
+		}
+
+		if (state == LOCK_HELD)
+			break;
+
+		lock_fd = -1;
+		if (signal_wait(backoff * 1000))
+			signal_dispatch();
+
+		if (backoff < PAIR_RETRY)
+			backoff <<= 1;
+	}
+	_printf("leading\n");
+
+	/* a previous leader that lost its connection stops
+	 * instead of taking the lock again
+	 */
+	pair_state->leader = getpid();
 }
 
 static void cleanup_syslog(void) {
@@ -614,17 +1258,36 @@ static void cleanup_syslog(void) {
 }
 
 static void cleanup(void) {
+	trace_close();
 	cleanup_syslog();
+	cerror("close signalfd", close(sfd));
 	cerror(mqueue_main, mq_close(qmain));
 	cerror(mqueue_backup, mq_close(qbackup));
+	if (mqueue_output != NULL)
+		cerror(mqueue_output, mq_close(qoutput));
+	if (pair_state != NULL)
+		cerror("munmap", munmap(pair_state, sizeof(*pair_state)));
 	free(mqueue_backup);
+	free(mqueue_upgrade);
+	free(pair_name);
+	shard_free(&shards);
 }
 
 int main(int argc, char *argv[]) {
 	setup(argc, argv);
 	init();
-	backup_load();
+	if (!pair)
+		backup_load();
 	daemon();
+#ifdef SYSLOG
+	log_open(true);
+#else
+	log_open(false);
+#endif
+	if (pair) {
+		lead();
+		backup_load();
+	}
 	loop();
 	cleanup();
 	exit(EXIT_FAILURE);
@@ -3,11 +3,17 @@
 
 #define tv_to_ull(x) (unsigned long long)((unsigned long long)(x).tv_sec*1000000 + (unsigned long long)(x).tv_usec)
 
-/* Avoid false pulses caused by electricity noise at 50/60Hz
- * 1s / 50Hz + 10% = 22000µs
- * 1s / 60Hz + 10% = 18333µs
- */
-#define MIN_PULSE 22000
+/* Maximum time between attempts to acquire the lock of a pair (s) */
+#define PAIR_RETRY 16
+
+/* Write the current interval of pulse counts at least once a minute */
+#define COUNT_FLUSH 60
+
+/* Suffix of the shared memory object for the current interval */
+#define COUNT_STATE ".count"
+
+/* Suffix of the backup queue while it is being recreated */
+#define BACKUP_UPGRADE "~new"
 
 #ifdef FORK
 # ifndef SYSLOG
@@ -16,19 +22,71 @@
 #endif
 
 #ifdef VERBOSE
-# if SYSLOG
-#  define _printf(...) syslog(LOG_INFO, __VA_ARGS__)
-# else
-#  define _printf(...) printf(__VA_ARGS__)
-# endif
+# define _printf(...) log_printf(__VA_ARGS__)
 #else
 # define _printf(...) do { } while(0)
 #endif
 
+/* Fault injection for pulsedbsim (see pulsesim) */
+#ifdef SIM
+# define SIM_POINT(name) sim_point(#name)
+void sim_point(const char *name);
+void sim_sleep(int ms);
+void sim_idle(void);
+#else
+# define SIM_POINT(name) do { } while(0)
+#endif
+
 void pulse_meter(const char *value);
+void pulse_conninfo(const char *value);
+void pulse_standby(const char *value);
+bool pulse_failover(void);
 bool pulse_on(const struct timeval *on);
 bool pulse_off(const struct timeval *on, const struct timeval *off);
 bool pulse_on_off(const struct timeval *on, const struct timeval *off);
 bool pulse_cancel(const struct timeval *on);
 bool pulse_resume(const struct timeval *on);
 bool pulse_reset(void);
+
+/* Leader election between the two processes of a pair,
+ * pulse_lock() returns a file descriptor that becomes
+ * readable when pulse_lock_check() needs to be called
+ *
+ * once it has been held, pulse_lock_check() takes the lock
+ * again if the connection is lost (LOCK_WAITING until a
+ * server is available) and pulse_lock_fd() may change
+ */
+enum pulse_lock {
+	LOCK_WAITING,
+	LOCK_HELD,
+	LOCK_LOST
+};
+
+int pulse_lock(void);
+enum pulse_lock pulse_lock_check(void);
+int pulse_lock_fd(void);
+
+/* Pulses counted in a fixed interval (all times in µs) */
+struct pulse_count {
+	unsigned long long start;
+	unsigned long long stop;
+	unsigned long long count;
+	unsigned long long first;
+	unsigned long long last;
+	unsigned long long ontime;
+};
+
+void pulse_count_enable(void);
+bool pulse_count_read(struct pulse_count *c);
+bool pulse_count_write(const struct pulse_count *c);
+
+void count_interval(const char *value);
+void count_state(const char *name);
+bool count_enabled(void);
+bool count_on(const struct timeval *on);
+bool count_off(const struct timeval *on, const struct timeval *off);
+bool count_on_off(const struct timeval *on, const struct timeval *off);
+bool count_cancel(const struct timeval *on);
+bool count_resume(const struct timeval *on);
+bool count_flush(bool force);
+int count_timeout(void);
@@ -0,0 +1,261 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pulsedb.h"
+#include "pulselog.h"
+
+#ifdef SYSLOG
+# include <syslog.h>
+#endif
+
+/* Current interval in shared memory, written before a change is
+ * acknowledged so that pulses that have been removed from the
+ * backup queue but not yet written aren't lost if pulsedb is killed
+ *
+ * the copy that isn't current is changed, so it is never partial
+ */
+struct count_copy {
+	struct pulse_count bucket;
+	unsigned long long prev_last;
+	unsigned long long last_ontime;
+	bool dirty;
+};
+
+struct count_state {
+	uint32_t current;
+	struct count_copy copy[2];
+};
+
+static unsigned long long interval = 0;
+static struct count_state *state = NULL;
+static bool loaded = false;
+static bool dirty = false;
+static struct pulse_count bucket;
+static unsigned long long prev_last = 0; /* start of the pulse before the last one */
+static unsigned long long last_ontime = 0; /* on time of the last pulse */
+static unsigned long long flushed = 0;
+
+void count_interval(const char *value) {
+	char *end = NULL;
+	unsigned long secs;
+
+	errno = 0;
+	secs = strtoul(value, &end, 10);
+	cerror(value, errno != 0);
+
+	errno = EINVAL;
+	cerror(value, value[0] == '\0' || end[0] != '\0' || secs == 0);
+
+	interval = (unsigned long long)secs * 1000000;
+	pulse_count_enable();
+}
+
+bool count_enabled(void) {
+	return interval != 0;
+}
+
+void count_state(const char *name) {
+	int fd, ret;
+
+	fd = shm_open(name, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+	cerror(name, fd < 0);
+
+	ret = ftruncate(fd, sizeof(*state));
+	cerror("ftruncate", ret != 0);
+
+	state = mmap(NULL, sizeof(*state), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	cerror("mmap", state == MAP_FAILED);
+
+	cerror("close", close(fd));
+}
+
+static void count_save(void) {
+	uint32_t next;
+
+	if (state == NULL)
+		return;
+
+	next = !state->current;
+	state->copy[next].bucket = bucket;
+	state->copy[next].prev_last = prev_last;
+	state->copy[next].last_ontime = last_ontime;
+	state->copy[next].dirty = dirty;
+
+	__sync_synchronize();
+	state->current = next;
+}
+
+/* continue from the last state before a restart */
+static void count_restore(void) {
+	const struct count_copy *copy;
+
+	if (loaded || state == NULL)
+		return;
+
+	copy = &state->copy[state->current & 1];
+	if (copy->bucket.stop == 0)
+		return;
+
+	_printf("count interval %llu: %llu pulses%s\n", copy->bucket.start / 1000000, copy->bucket.count, copy->dirty ? " (not written)" : "");
+	bucket = copy->bucket;
+	prev_last = copy->prev_last;
+	last_ontime = copy->last_ontime;
+	dirty = copy->dirty;
+	loaded = true;
+}
+
+static unsigned long long now_us(void) {
+	struct timeval tv;
+
+	cerror("gettimeofday", gettimeofday(&tv, NULL) != 0);
+	return tv_to_ull(tv);
+}
+
+/* start counting in the interval containing ts,
+ * continuing from any existing count
+ */
+static bool count_start(unsigned long long ts) {
+	struct pulse_count next = {
+		.start = ts - ts % interval,
+		.stop = ts - ts % interval + interval
+	};
+
+	if (!pulse_count_read(&next))
+		return false;
+
+	_printf("count interval %llu: %llu pulses\n", next.start / 1000000, next.count);
+	bucket = next;
+	prev_last = 0;
+	last_ontime = 0;
+	loaded = true;
+	count_save();
+	return true;
+}
+
+bool count_on(const struct timeval *on) {
+	unsigned long long ts = tv_to_ull(*on);
+
+	count_restore();
+	if (!loaded || ts < bucket.start || ts >= bucket.stop) {
+		/* close the current interval */
+		if (loaded && dirty && !count_flush(true))
+			return false;
+
+		if (!count_start(ts))
+			return false;
+	}
+
+	/* already counted before a restart */
+	if (bucket.count > 0 && ts <= bucket.last)
+		return true;
+
+	if (bucket.count == 0)
+		bucket.first = ts;
+	prev_last = bucket.last;
+	bucket.last = ts;
+	bucket.count++;
+	last_ontime = 0;
+	dirty = true;
+	count_save();
+	return true;
+}
+
+bool count_off(const struct timeval *on, const struct timeval *off) {
+	unsigned long long ts = tv_to_ull(*on);
+
+	count_restore();
+	if (!loaded || bucket.count == 0 || ts != bucket.last)
+		return true;
+
+	bucket.ontime -= last_ontime;
+	last_ontime = tv_to_ull(*off) - ts;
+	bucket.ontime += last_ontime;
+	dirty = true;
+	count_save();
+	return true;
+}
+
+bool count_on_off(const struct timeval *on, const struct timeval *off) {
+	return count_on(on) && count_off(on, off);
+}
+
+bool count_cancel(const struct timeval *on) {
+	count_restore();
+	if (!loaded || bucket.count == 0 || tv_to_ull(*on) != bucket.last)
+		return true;
+
+	bucket.count--;
+	bucket.ontime -= last_ontime;
+	if (bucket.count == 0) {
+		bucket.first = 0;
+		bucket.last = 0;
+	} else if (prev_last != 0) {
+		bucket.last = prev_last;
+	} else {
+		/* unknown if the count was read from the database,
+		 * the start of the cancelled pulse is still valid
+		 */
+	}
+	prev_last = 0;
+	last_ontime = 0;
+	dirty = true;
+	count_save();
+	return true;
+}
+
+bool count_resume(const struct timeval *on) {
+	count_restore();
+	if (!loaded || bucket.count == 0 || tv_to_ull(*on) != bucket.last)
+		return true;
+
+	/* the on time is added again when the pulse stops */
+	bucket.ontime -= last_ontime;
+	last_ontime = 0;
+	dirty = true;
+	count_save();
+	return true;
+}
+
+/* write the current interval if it has changed and
+ * hasn't been written for COUNT_FLUSH seconds
+ */
+bool count_flush(bool force) {
+	unsigned long long now;
+
+	count_restore();
+	if (!dirty)
+		return true;
+
+	now = now_us();
+	if (!force && now - flushed < COUNT_FLUSH * 1000000ULL)
+		return true;
+
+	if (!pulse_count_write(&bucket))
+		return false;
+
+	dirty = false;
+	flushed = now;
+	count_save();
+	return true;
+}
+
+/* ms until the current interval needs to be written */
+int count_timeout(void) {
+	unsigned long long now, due;
+
+	count_restore();
+	if (!dirty)
+		return -1;
+
+	now = now_us();
+	due = flushed + COUNT_FLUSH * 1000000ULL;
+	return now >= due ? 0 : (int)((due - now + 999) / 1000);
+}
@@ -2,11 +2,15 @@
 #include <errno.h>
 #include <postgresql/libpq-fe.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "pulsedb.h"
 #include "pulsedb_postgres.h"
+#include "pulselog.h"
+#include "pulsetrace.h"
 
 #ifdef SYSLOG
 # include <syslog.h>
@@ -16,8 +20,39 @@
 # define TABLE "pulses"
 #endif
 
+#ifndef COUNT_TABLE
+# define COUNT_TABLE "pulse_counts"
+#endif
+
+/* prepared in a single round trip */
+#define STATEMENTS \
+	"PREPARE pulse_exists AS SELECT NULL FROM " TABLE " WHERE meter = $1 AND start = to_timestamp($2);" \
+	"PREPARE pulse_on AS INSERT INTO " TABLE " (meter, start) VALUES($1, to_timestamp($2));" \
+	"PREPARE pulse_off AS UPDATE " TABLE " SET stop = to_timestamp($3) WHERE meter = $1 AND start = to_timestamp($2);" \
+	"PREPARE pulse_on_off AS INSERT INTO " TABLE " (meter, start, stop) VALUES($1, to_timestamp($2), to_timestamp($3));" \
+	"PREPARE pulse_cancel AS DELETE FROM " TABLE " WHERE meter = $1 AND start = to_timestamp($2);" \
+	"PREPARE pulse_resume AS UPDATE " TABLE " SET stop = NULL WHERE meter = $1 AND start = to_timestamp($2);" \
+	"PREPARE pulse_reset_check AS SELECT NULL FROM (SELECT value FROM readings WHERE meter = $1 ORDER BY ts DESC LIMIT 1) last WHERE last.value IS NULL;" \
+	"PREPARE pulse_reset AS INSERT INTO readings (meter) VALUES($1);"
+
+/* only prepared in counting mode */
+#define COUNT_STATEMENTS \
+	"PREPARE pulse_count_read AS SELECT count, (extract(epoch FROM first) * 1000000)::bigint, (extract(epoch FROM last) * 1000000)::bigint, (extract(epoch FROM ontime) * 1000000)::bigint FROM " COUNT_TABLE " WHERE meter = $1 AND start = to_timestamp($2);" \
+	"PREPARE pulse_count_write AS INSERT INTO " COUNT_TABLE " (meter, start, stop, count, first, last, ontime) VALUES($1, to_timestamp($2), to_timestamp($3), $4, to_timestamp($5), to_timestamp($6), $7 * interval '1 microsecond')" \
+		" ON CONFLICT (meter, start) DO UPDATE SET stop = EXCLUDED.stop, count = EXCLUDED.count, first = EXCLUDED.first, last = EXCLUDED.last, ontime = EXCLUDED.ontime;"
+
 PGconn *conn = NULL;
+PGconn *standby = NULL;
+PGconn *lock = NULL;
+bool lock_held = false;
+bool lock_led = false; /* the lock has been held */
+const char *lock_conninfo = NULL; /* server of the lock */
+time_t standby_attempt = 0;
 const char *meter;
+const char *conninfo = "";
+const char *standby_conninfo = NULL;
+int partition_month = -1;
+bool counting = false;
 
 void pulse_meter(const char *value) {
 	char *end = NULL;
@@ -35,96 +70,322 @@ void pulse_meter(const char *value) {
 	meter = value;
 }
 
-static bool db_connect(void) {
-	PGresult *res = NULL;
+void pulse_conninfo(const char *value) {
+	conninfo = value;
+}
 
-	if (conn == NULL) {
-		conn = PQconnectdb("");
+void pulse_standby(const char *value) {
+	standby_conninfo = value;
+}
 
-		if (conn == NULL) {
-			return false;
-		} else {
-			res = PQprepare(conn, "pulse_exists", "SELECT NULL FROM " TABLE " WHERE meter = $1 AND start = to_timestamp($2)", 2, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
+void pulse_count_enable(void) {
+	counting = true;
+}
 
-			res = PQprepare(conn, "pulse_on", "INSERT INTO " TABLE " (meter, start) VALUES($1, to_timestamp($2))", 2, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
+/* connection parameters in the conninfo string take precedence,
+ * so it can also be used to override target_session_attrs
+ */
+static PGconn *db_open(const char *info, const char *attrs) {
+	const char *keywords[] = { "target_session_attrs", "dbname", NULL };
+	const char *values[] = { attrs, info, NULL };
 
-			res = PQprepare(conn, "pulse_off", "UPDATE " TABLE " SET stop = to_timestamp($3) WHERE meter = $1 AND start = to_timestamp($2)", 3, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
+	return PQconnectdbParams(keywords, values, 1);
+}
 
-			res = PQprepare(conn, "pulse_on_off", "INSERT INTO " TABLE " (meter, start, stop) VALUES($1, to_timestamp($2), to_timestamp($3))", 3, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
+static bool db_prepare(PGconn *db) {
+	PGresult *res = PQexec(db, counting ? STATEMENTS COUNT_STATEMENTS : STATEMENTS);
+	bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK);
 
-			res = PQprepare(conn, "pulse_cancel", "DELETE FROM " TABLE " WHERE meter = $1 AND start = to_timestamp($2)", 2, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
+	if (!ok)
+		_printf("db_prepare: %s", PQerrorMessage(db));
 
-			res = PQprepare(conn, "pulse_resume", "UPDATE " TABLE " SET stop = NULL WHERE meter = $1 AND start = to_timestamp($2)", 2, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
+	PQclear(res);
+	return ok;
+}
 
-			res = PQprepare(conn, "pulse_reset_check", "SELECT NULL FROM (SELECT value FROM readings WHERE meter = $1 ORDER BY ts DESC LIMIT 1) last WHERE last.value IS NULL", 1, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
+/* keep a connection open to the standby so that
+ * it can be used as soon as it has been promoted
+ */
+static void db_standby(void) {
+	time_t now;
+
+	if (standby_conninfo == NULL)
+		return;
+
+	if (standby != NULL && PQstatus(standby) == CONNECTION_OK)
+		return;
+
+	now = time(NULL);
+	if (standby_attempt != 0 && now - standby_attempt < STANDBY_RETRY)
+		return;
+	standby_attempt = now;
+
+	PQfinish(standby);
+	standby = db_open(standby_conninfo, "any");
+	if (standby != NULL && PQstatus(standby) != CONNECTION_OK) {
+		_printf("db_standby: %s", PQerrorMessage(standby));
+		PQfinish(standby);
+		standby = NULL;
+	}
+}
 
-			res = PQprepare(conn, "pulse_reset", "INSERT INTO readings (meter) VALUES($1)", 1, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
+static bool db_connect(void) {
+	/* a pair only writes to the server it has the lock on */
+	if (lock_led && lock == NULL)
+		return false;
+
+	if (conn == NULL) {
+		conn = db_open(lock_conninfo != NULL ? lock_conninfo : conninfo, "read-write");
 
-			res = NULL;
-		}
+		if (conn == NULL)
+			return false;
+
+		if (PQstatus(conn) != CONNECTION_OK || !db_prepare(conn))
+			goto fail;
 	}
 
 	if (PQstatus(conn) != CONNECTION_OK)
 		goto fail;
 
+	db_standby();
 	return true;
 
 fail:
 	_printf("db_connect: %s", PQerrorMessage(conn));
-	if (res != NULL)
-		PQclear(res);
 	PQfinish(conn);
 	conn = NULL;
 	return false;
 }
 
+/* prepared statements are discarded when the connection is closed */
 static void db_disconnect(void) {
 	if (conn != NULL) {
-		PGresult *res;
+		PQfinish(conn);
+		conn = NULL;
+	}
+}
 
-		res = PQexec(conn, "DEALLOCATE PREPARE pulse_exists");
-		PQclear(res);
+/* a pair of processes for the same meter use a session advisory lock
+ * on a separate connection, which is released by the server as soon as
+ * the connection of the leader is closed
+ *
+ * the lock is taken on whichever server is writable, and the leader
+ * only writes to that server
+ */
+static PGconn *lock_open(const char *info) {
+	PGconn *db = db_open(info, "read-write");
+
+	if (db != NULL && PQstatus(db) != CONNECTION_OK) {
+		_printf("lock_open: %s", PQerrorMessage(db));
+		PQfinish(db);
+		db = NULL;
+	}
+	return db;
+}
 
-		res = PQexec(conn, "DEALLOCATE PREPARE pulse_on");
-		PQclear(res);
+/* take the lock without waiting, replacing the current lock connection,
+ * returns LOCK_WAITING if the server is unavailable
+ */
+static enum pulse_lock lock_take(const char *info) {
+	const char *param[1] = { meter };
+	PGconn *db = lock_open(info);
+	PGresult *res;
+	bool held;
 
-		res = PQexec(conn, "DEALLOCATE PREPARE pulse_off");
-		PQclear(res);
+	if (db == NULL)
+		return LOCK_WAITING;
 
-		res = PQexec(conn, "DEALLOCATE PREPARE pulse_on_off");
-		PQclear(res);
+	res = PQexecParams(db, "SELECT pg_try_advisory_lock('" TABLE "'::regclass::oid::integer, $1::integer)", 1, NULL, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		_printf("lock_take: %s", PQerrorMessage(db));
 
-		res = PQexec(conn, "DEALLOCATE PREPARE pulse_cancel");
 		PQclear(res);
+		PQfinish(db);
+		return LOCK_WAITING;
+	}
+
+	held = !strcmp(PQgetvalue(res, 0, 0), "t");
+	PQclear(res);
+	if (!held) {
+		_printf("lock_take: held by the other process\n");
+		PQfinish(db);
+		return LOCK_LOST;
+	}
+
+	/* writes move to the same server */
+	if (info != lock_conninfo)
+		db_disconnect();
+
+	PQfinish(lock);
+	lock = db;
+	lock_held = true;
+	lock_conninfo = info;
+	return LOCK_HELD;
+}
+
+/* the lock connection of the leader has been lost, take it
+ * again unless the other process has it
+ */
+static enum pulse_lock lock_retake(void) {
+	const char *other = lock_conninfo == conninfo ? standby_conninfo : conninfo;
+	enum pulse_lock state = lock_take(lock_conninfo);
+
+	if (state == LOCK_WAITING && other != NULL)
+		state = lock_take(other);
+	return state;
+}
+
+bool pulse_failover(void) {
+	PGresult *res;
+	bool promoted;
+
+	if (conn != NULL || standby == NULL)
+		return false;
+
+	if (PQstatus(standby) != CONNECTION_OK) {
+		PQfinish(standby);
+		standby = NULL;
+		return false;
+	}
+
+	res = PQexec(standby, "SELECT NULL WHERE NOT pg_is_in_recovery()");
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		_printf("pulse_failover: %s", PQerrorMessage(standby));
 
-		res = PQexec(conn, "DEALLOCATE PREPARE pulse_resume");
 		PQclear(res);
+		PQfinish(standby);
+		standby = NULL;
+		return false;
+	} else {
+		promoted = (PQntuples(res) > 0);
 
-		res = PQexec(conn, "DEALLOCATE PREPARE pulse_reset_check");
 		PQclear(res);
+	}
+
+	if (!promoted)
+		return false;
+
+	/* a pair has to take the lock on the standby before writing to it */
+	if (lock_conninfo != NULL && lock_take(standby_conninfo) != LOCK_HELD)
+		return false;
+
+	/* statements that were prepared would already exist on retry */
+	if (!db_prepare(standby)) {
+		PQfinish(standby);
+		standby = NULL;
+		return false;
+	}
+
+	_printf("failover to standby\n");
+	conn = standby;
+	standby = NULL;
+	standby_attempt = 0;
+	return true;
+}
+
+int pulse_lock(void) {
+	const char *param[1] = { meter };
+
+	PQfinish(lock);
+	lock_held = false;
+
+	lock_conninfo = conninfo;
+	lock = lock_open(conninfo);
+	if (lock == NULL && standby_conninfo != NULL) {
+		lock_conninfo = standby_conninfo;
+		lock = lock_open(standby_conninfo);
+	}
+	if (lock == NULL)
+		return -1;
 
-		res = PQexec(conn, "DEALLOCATE PREPARE pulse_reset");
+	/* writes use the same server */
+	db_disconnect();
+
+	if (!PQsendQueryParams(lock, "SELECT pg_advisory_lock('" TABLE "'::regclass::oid::integer, $1::integer)", 1, NULL, param, NULL, NULL, 0))
+		goto fail;
+
+	/* be ready to write as soon as the lock is acquired */
+	db_connect();
+	return PQsocket(lock);
+
+fail:
+	_printf("pulse_lock: %s", PQerrorMessage(lock));
+	PQfinish(lock);
+	lock = NULL;
+	return -1;
+}
+
+int pulse_lock_fd(void) {
+	return lock != NULL ? PQsocket(lock) : -1;
+}
+
+enum pulse_lock pulse_lock_check(void) {
+	if (lock == NULL)
+		return lock_led ? lock_retake() : LOCK_LOST;
+
+	if (!PQconsumeInput(lock))
+		goto lost;
+
+	if (!lock_held) {
+		PGresult *res;
+
+		if (PQisBusy(lock))
+			return LOCK_WAITING;
+
+		res = PQgetResult(lock);
+		lock_held = (PQresultStatus(res) == PGRES_TUPLES_OK);
 		PQclear(res);
 
-		PQfinish(conn);
-		conn = NULL;
+		/* end of the query */
+		while ((res = PQgetResult(lock)) != NULL)
+			PQclear(res);
+
+		if (!lock_held)
+			goto lost;
+		lock_led = true;
 	}
+
+	if (PQstatus(lock) != CONNECTION_OK)
+		goto lost;
+
+	return LOCK_HELD;
+
+lost:
+	_printf("pulse_lock_check: %s", PQerrorMessage(lock));
+	PQfinish(lock);
+	lock = NULL;
+	lock_held = false;
+	return lock_led ? lock_retake() : LOCK_LOST;
+}
+
+/* make sure the partitions for this month and next month exist
+ * before pulses are inserted into them, this is not fatal because
+ * the pulses will be stored in the default partition
+ */
+static void db_partition(const struct timeval *on) {
+	PGresult *res;
+	char tmp[1][32];
+	const char *param[1] = { tmp[0] };
+	time_t secs = on->tv_sec;
+	struct tm tm;
+	int month;
+
+	if (gmtime_r(&secs, &tm) == NULL)
+		return;
+
+	month = tm.tm_year * 12 + tm.tm_mon;
+	if (month == partition_month)
+		return;
+
+	sprintf(tmp[0], "%lu.%06u", (unsigned long int)on->tv_sec, (unsigned int)on->tv_usec);
+
+	/* retried for the next pulse if it fails */
+	res = PQexecParams(conn, "SELECT partition_ensure('" TABLE "', to_timestamp($1))", 1, NULL, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		_printf("partition_ensure: %s", PQerrorMessage(conn));
+	else
+		partition_month = month;
+	PQclear(res);
 }
 
 bool pulse_on(const struct timeval *on) {
@@ -136,6 +397,8 @@ bool pulse_on(const struct timeval *on) {
 	if (!db_connect())
 		return false;
 
+	db_partition(on);
+
 	sprintf(tmp[0], "%lu.%06u", (unsigned long int)on->tv_sec, (unsigned int)on->tv_usec);
 
 	res = PQexecPrepared(conn, "pulse_exists", 2, param, NULL, NULL, 0);
@@ -151,8 +414,10 @@ bool pulse_on(const struct timeval *on) {
 		PQclear(res);
 	}
 
-	if (done)
+	if (done) {
+		trace_event(TRACE_COMMIT, *on, TRACE_OP_ON);
 		return true;
+	}
 
 	res = PQexecPrepared(conn, "pulse_on", 2, param, NULL, NULL, 0);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
@@ -163,6 +428,7 @@ bool pulse_on(const struct timeval *on) {
 		return false;
 	} else {
 		PQclear(res);
+		trace_event(TRACE_COMMIT, *on, TRACE_OP_ON);
 		return true;
 	}
 }
@@ -187,6 +453,7 @@ bool pulse_off(const struct timeval *on, const struct timeval *off) {
 		return false;
 	} else {
 		PQclear(res);
+		trace_event(TRACE_COMMIT, *on, TRACE_OP_OFF);
 		return true;
 	}
 }
@@ -200,6 +467,8 @@ bool pulse_on_off(const struct timeval *on, const struct timeval *off) {
 	if (!db_connect())
 		return false;
 
+	db_partition(on);
+
 	sprintf(tmp[0], "%lu.%06u", (unsigned long int)on->tv_sec, (unsigned int)on->tv_usec);
 	sprintf(tmp[1], "%lu.%06u", (unsigned long int)off->tv_sec, (unsigned int)off->tv_usec);
 
@@ -216,8 +485,10 @@ bool pulse_on_off(const struct timeval *on, const struct timeval *off) {
 		PQclear(res);
 	}
 
-	if (done)
+	if (done) {
+		trace_event(TRACE_COMMIT, *on, TRACE_OP_OFF);
 		return true;
+	}
 
 	res = PQexecPrepared(conn, "pulse_on_off", 3, param, NULL, NULL, 0);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
@@ -228,6 +499,7 @@ bool pulse_on_off(const struct timeval *on, const struct timeval *off) {
 		return false;
 	} else {
 		PQclear(res);
+		trace_event(TRACE_COMMIT, *on, TRACE_OP_ON_OFF);
 		return true;
 	}
 }
@@ -251,6 +523,7 @@ bool pulse_cancel(const struct timeval *on) {
 		return false;
 	} else {
 		PQclear(res);
+		trace_event(TRACE_COMMIT, *on, TRACE_OP_CANCEL);
 		return true;
 	}
 }
@@ -274,6 +547,7 @@ bool pulse_resume(const struct timeval *on) {
 		return false;
 	} else {
 		PQclear(res);
+		trace_event(TRACE_COMMIT, *on, TRACE_OP_RESUME);
 		return true;
 	}
 }
@@ -299,8 +573,10 @@ bool pulse_reset(void) {
 		PQclear(res);
 	}
 
-	if (done)
+	if (done) {
+		trace_event(TRACE_COMMIT, TRACE_NO_EDGE, TRACE_OP_RESET);
 		return true;
+	}
 
 	res = PQexecPrepared(conn, "pulse_reset", 1, param, NULL, NULL, 0);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
@@ -311,6 +587,80 @@ bool pulse_reset(void) {
 		return false;
 	} else {
 		PQclear(res);
+		trace_event(TRACE_COMMIT, TRACE_NO_EDGE, TRACE_OP_RESET);
+		return true;
+	}
+}
+
+static void us_to_str(char *buf, unsigned long long value) {
+	sprintf(buf, "%llu.%06u", value / 1000000, (unsigned int)(value % 1000000));
+}
+
+bool pulse_count_read(struct pulse_count *c) {
+	PGresult *res;
+	char tmp[1][32];
+	const char *param[2] = { meter, tmp[0] };
+
+	if (!db_connect())
+		return false;
+
+	us_to_str(tmp[0], c->start);
+
+	res = PQexecPrepared(conn, "pulse_count_read", 2, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		_printf("pulse_count_read: %s", PQerrorMessage(conn));
+
+		PQclear(res);
+		db_disconnect();
+		return false;
+	}
+
+	if (PQntuples(res) > 0) {
+		c->count = strtoull(PQgetvalue(res, 0, 0), NULL, 10);
+		c->first = PQgetisnull(res, 0, 1) ? 0 : strtoull(PQgetvalue(res, 0, 1), NULL, 10);
+		c->last = PQgetisnull(res, 0, 2) ? 0 : strtoull(PQgetvalue(res, 0, 2), NULL, 10);
+		c->ontime = strtoull(PQgetvalue(res, 0, 3), NULL, 10);
+	} else {
+		c->count = 0;
+		c->first = 0;
+		c->last = 0;
+		c->ontime = 0;
+	}
+
+	PQclear(res);
+	return true;
+}
+
+bool pulse_count_write(const struct pulse_count *c) {
+	PGresult *res;
+	char tmp[6][32];
+	const char *param[7] = { meter, tmp[0], tmp[1], tmp[2], tmp[3], tmp[4], tmp[5] };
+
+	if (!db_connect())
+		return false;
+
+	us_to_str(tmp[0], c->start);
+	us_to_str(tmp[1], c->stop);
+	sprintf(tmp[2], "%llu", c->count);
+	us_to_str(tmp[3], c->first);
+	us_to_str(tmp[4], c->last);
+	sprintf(tmp[5], "%llu", c->ontime);
+
+	if (c->count == 0) {
+		param[4] = NULL;
+		param[5] = NULL;
+	}
+
+	res = PQexecPrepared(conn, "pulse_count_write", 7, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		_printf("pulse_count_write: %s", PQerrorMessage(conn));
+
+		PQclear(res);
+		db_disconnect();
+		return false;
+	} else {
+		PQclear(res);
+		trace_event(TRACE_COMMIT, TRACE_NO_EDGE, TRACE_OP_COUNT);
 		return true;
 	}
 }
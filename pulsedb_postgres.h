@@ -1,3 +1,6 @@
+/* Don't try to reconnect to the standby more than once a minute */
+#define STANDBY_RETRY 60
+
 #if 0
 # ifdef VERBOSE
 #define PQprepare(conn, name, sql, num, x) (\
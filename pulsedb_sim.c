@@ -0,0 +1,339 @@
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pulsedb.h"
+#include "pulsedb_sim.h"
+#include "pulselog.h"
+
+/* Virtual time taken to restart pulsedb (ms) */
+#define SIM_RESTART 1000
+
+#define SIM_POINT_NAME(name) #name,
+static const char *point_names[SIM_POINT_MAX] = { SIM_POINTS };
+#undef SIM_POINT_NAME
+
+static const char *file = "pulsesim.db";
+static struct sim_header header;
+static struct sim_pulse pulses[SIM_ROWS];
+static struct sim_reading readings[SIM_ROWS];
+
+/* fault configured by PULSESIM_FAULT */
+static enum { FAULT_NONE, FAULT_KILL, FAULT_TERM, FAULT_LATENCY, FAULT_ERROR, FAULT_DOWN } fault = FAULT_NONE;
+static int fault_point = -1;
+static unsigned long fault_arg1 = 0;
+static unsigned long fault_arg2 = 0;
+
+static bool read_all(int fd, void *buf, size_t len) {
+	return read(fd, buf, len) == (ssize_t)len;
+}
+
+static void sim_load(void) {
+	int fd = open(file, O_RDONLY);
+
+	if (fd < 0) {
+		cerror(file, errno != ENOENT);
+
+		memset(&header, 0, sizeof(header));
+		header.magic = SIM_MAGIC;
+		return;
+	}
+
+	errno = EIO;
+	cerror(file, !read_all(fd, &header, sizeof(header)) || header.magic != SIM_MAGIC
+		|| header.pulses > SIM_ROWS || header.readings > SIM_ROWS
+		|| !read_all(fd, pulses, header.pulses * sizeof(*pulses))
+		|| !read_all(fd, readings, header.readings * sizeof(*readings)));
+	cerror(file, close(fd) != 0);
+
+	header.clock += SIM_RESTART;
+	header.drained = 0;
+}
+
+/* not synced because the simulation only
+ * needs to survive the process being killed
+ */
+static void sim_save(void) {
+	char *tmp = malloc(strlen(file) + 2);
+	int fd;
+
+	cerror("malloc", tmp == NULL);
+	sprintf(tmp, "%s~", file);
+
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+	cerror(tmp, fd < 0);
+	cerror(tmp, write(fd, &header, sizeof(header)) != sizeof(header));
+	cerror(tmp, write(fd, pulses, header.pulses * sizeof(*pulses)) != (ssize_t)(header.pulses * sizeof(*pulses)));
+	cerror(tmp, write(fd, readings, header.readings * sizeof(*readings)) != (ssize_t)(header.readings * sizeof(*readings)));
+	cerror(tmp, close(fd) != 0);
+	cerror(file, rename(tmp, file) != 0);
+	free(tmp);
+}
+
+/* kill:<point>:<hit>, term:<point>:<hit>, latency:<ms>, error:<every call>, down:<from call>:<ms> */
+static void sim_fault(const char *value) {
+	char name[32];
+	int i;
+
+	if (value == NULL || value[0] == '\0')
+		return;
+
+	errno = EINVAL;
+	if (sscanf(value, "kill:%31[a-z_]:%lu", name, &fault_arg1) == 2) {
+		fault = FAULT_KILL;
+	} else if (sscanf(value, "term:%31[a-z_]:%lu", name, &fault_arg1) == 2) {
+		fault = FAULT_TERM;
+	} else if (sscanf(value, "latency:%lu", &fault_arg1) == 1) {
+		fault = FAULT_LATENCY;
+		return;
+	} else if (sscanf(value, "error:%lu", &fault_arg1) == 1 && fault_arg1 > 0) {
+		fault = FAULT_ERROR;
+		return;
+	} else if (sscanf(value, "down:%lu:%lu", &fault_arg1, &fault_arg2) == 2) {
+		fault = FAULT_DOWN;
+		return;
+	} else {
+		xerror(value);
+	}
+
+	for (i = 0; i < SIM_POINT_MAX; i++)
+		if (!strcmp(point_names[i], name))
+			fault_point = i;
+	cerror(value, fault_point < 0);
+}
+
+void sim_point(const char *name) {
+	int i;
+
+	for (i = 0; i < SIM_POINT_MAX; i++) {
+		if (!strcmp(point_names[i], name)) {
+			header.hits[i]++;
+
+			if (i == fault_point && header.hits[i] == fault_arg1 && header.fault == 0) {
+				_printf("sim: %s at %s %u\n", fault == FAULT_KILL ? "kill" : "term", name, header.hits[i]);
+				header.fault = header.clock;
+				sim_save();
+
+				/* a signal to terminate is held until pulsedb waits for one */
+				if (fault == FAULT_KILL)
+					log_close();
+				raise(fault == FAULT_KILL ? SIGKILL : SIGTERM);
+			}
+			return;
+		}
+	}
+
+	errno = EINVAL;
+	xerror(name);
+}
+
+void sim_sleep(int ms) {
+	header.clock += ms;
+}
+
+void sim_idle(void) {
+	_printf("sim: idle at %llu\n", (unsigned long long)header.clock);
+	header.drained = header.clock;
+	sim_save();
+
+	/* exit normally */
+	raise(SIGTERM);
+}
+
+/* start a database call, returns false if it fails */
+static bool sim_call(void) {
+	bool ok = true;
+
+	header.calls++;
+	header.clock += fault == FAULT_LATENCY ? fault_arg1 : SIM_LATENCY;
+
+	if (fault == FAULT_ERROR && header.calls % fault_arg1 == 0)
+		ok = false;
+
+	if (fault == FAULT_DOWN && header.calls >= fault_arg1) {
+		if (header.fault == 0)
+			header.fault = header.clock;
+		if (header.clock < header.fault + fault_arg2)
+			ok = false;
+	}
+
+	if (!ok) {
+		if (header.fault == 0)
+			header.fault = header.clock;
+		header.failures++;
+		_printf("sim: call %llu failed\n", (unsigned long long)header.calls);
+		sim_save();
+	}
+	return ok;
+}
+
+/* finish a successful database call */
+static bool sim_commit(void) {
+	if (header.fault != 0 && header.recovered == 0)
+		header.recovered = header.clock;
+
+	sim_save();
+	SIM_POINT(commit);
+	return true;
+}
+
+static uint64_t tv_to_u64(const struct timeval *tv) {
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static struct sim_pulse *sim_find(const struct timeval *on) {
+	uint64_t start = tv_to_u64(on);
+	uint32_t i;
+
+	for (i = 0; i < header.pulses; i++)
+		if (pulses[i].start == start)
+			return &pulses[i];
+	return NULL;
+}
+
+static void sim_insert(const struct timeval *on, const struct timeval *off) {
+	errno = ENOSPC;
+	cerror(file, header.pulses == SIM_ROWS);
+
+	pulses[header.pulses].start = tv_to_u64(on);
+	pulses[header.pulses].stop = off != NULL ? tv_to_u64(off) : 0;
+	header.pulses++;
+}
+
+void pulse_meter(const char *value) {
+	char *end = NULL;
+
+	errno = EINVAL;
+	cerror("Meter value cannot be empty", value[0] == '\0');
+
+	errno = 0;
+	strtol(value, &end, 10);
+	cerror(value, errno != 0);
+
+	errno = EINVAL;
+	cerror(value, end[0] != '\0');
+
+	/* options have already been processed */
+	sim_fault(getenv("PULSESIM_FAULT"));
+	sim_load();
+}
+
+/* the database file */
+void pulse_conninfo(const char *value) {
+	file = value;
+}
+
+void pulse_standby(const char *value) {
+	(void)value;
+}
+
+void pulse_count_enable(void) {
+	errno = ENOTSUP;
+	xerror("Counting is not simulated");
+}
+
+int pulse_lock(void) {
+	errno = ENOTSUP;
+	xerror("Pairs are not simulated");
+}
+
+enum pulse_lock pulse_lock_check(void) {
+	return LOCK_LOST;
+}
+
+int pulse_lock_fd(void) {
+	return -1;
+}
+
+bool pulse_failover(void) {
+	return false;
+}
+
+bool pulse_on(const struct timeval *on) {
+	if (!sim_call())
+		return false;
+
+	if (sim_find(on) == NULL)
+		sim_insert(on, NULL);
+	return sim_commit();
+}
+
+bool pulse_off(const struct timeval *on, const struct timeval *off) {
+	struct sim_pulse *p;
+
+	if (!sim_call())
+		return false;
+
+	p = sim_find(on);
+	if (p != NULL)
+		p->stop = tv_to_u64(off);
+	return sim_commit();
+}
+
+bool pulse_on_off(const struct timeval *on, const struct timeval *off) {
+	struct sim_pulse *p;
+
+	if (!sim_call())
+		return false;
+
+	p = sim_find(on);
+	if (p != NULL)
+		p->stop = tv_to_u64(off);
+	else
+		sim_insert(on, off);
+	return sim_commit();
+}
+
+bool pulse_cancel(const struct timeval *on) {
+	struct sim_pulse *p;
+
+	if (!sim_call())
+		return false;
+
+	p = sim_find(on);
+	if (p != NULL)
+		*p = pulses[--header.pulses];
+	return sim_commit();
+}
+
+bool pulse_resume(const struct timeval *on) {
+	struct sim_pulse *p;
+
+	if (!sim_call())
+		return false;
+
+	p = sim_find(on);
+	if (p != NULL)
+		p->stop = 0;
+	return sim_commit();
+}
+
+/* all readings are NULL so there is only ever one */
+bool pulse_reset(void) {
+	if (!sim_call())
+		return false;
+
+	if (header.readings == 0) {
+		readings[0].clock = header.clock;
+		header.readings++;
+	}
+	return sim_commit();
+}
+
+bool pulse_count_read(struct pulse_count *c) {
+	(void)c;
+	return false;
+}
+
+bool pulse_count_write(const struct pulse_count *c) {
+	(void)c;
+	return false;
+}
@@ -0,0 +1,54 @@
+/* Simulated database used by pulsedbsim and checked by pulsesim
+ *
+ * The whole file is replaced after every change, so each
+ * operation is committed atomically like a transaction
+ */
+#define SIM_MAGIC 0x70756c73696d0002ULL
+
+/* Maximum number of rows in each table */
+#define SIM_ROWS 65536
+
+/* Virtual time taken by every database call (ms) */
+#define SIM_LATENCY 1
+
+/* Critical section boundaries where faults can be injected */
+#define SIM_POINTS \
+	SIM_POINT_NAME(receive) \
+	SIM_POINT_NAME(off_pending) \
+	SIM_POINT_NAME(backup_pulse) \
+	SIM_POINT_NAME(backup_clear) \
+	SIM_POINT_NAME(backup_commit) \
+	SIM_POINT_NAME(backup_load) \
+	SIM_POINT_NAME(save) \
+	SIM_POINT_NAME(saved) \
+	SIM_POINT_NAME(keep) \
+	SIM_POINT_NAME(reset_clear) \
+	SIM_POINT_NAME(commit)
+
+#define SIM_POINT_NAME(name) SIM_POINT_##name,
+enum sim_point { SIM_POINTS SIM_POINT_MAX };
+#undef SIM_POINT_NAME
+
+/* All times are virtual (ms) */
+struct sim_header {
+	uint64_t magic;
+	uint64_t clock;
+	uint64_t calls;
+	uint64_t failures;
+	uint64_t fault; /* 0 if no fault has happened yet */
+	uint64_t recovered; /* first successful change after the fault */
+	uint64_t drained; /* main queue empty */
+	uint32_t hits[SIM_POINT_MAX];
+	uint32_t pulses;
+	uint32_t readings;
+};
+
+struct sim_pulse {
+	uint64_t start; /* µs */
+	uint64_t stop; /* µs, 0 is NULL */
+};
+
+/* readings are only ever inserted by resets, so they are NULL */
+struct sim_reading {
+	uint64_t clock;
+};
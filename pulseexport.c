@@ -0,0 +1,769 @@
+#include <sys/time.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <postgresql/libpq-fe.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pulseexport.h"
+#include "pulsekern.h"
+#include "pulseshard.h"
+
+struct copy {
+	PGconn *conn;
+	char *buf;
+	int len;
+	int pos;
+};
+
+struct reading {
+	int64_t ts;
+	int64_t value;
+};
+
+struct meter {
+	unsigned long id;
+	int64_t pulse;
+	int64_t offset;
+	struct reading *readings;
+	size_t nreadings;
+	int64_t *starts; /* the pulses are stored as separate arrays for pulsekern */
+	int64_t *stops;
+	size_t npulses;
+};
+
+/* position in the readings and pulses, for times in increasing order */
+struct calc {
+	const struct meter *m;
+	size_t r;
+	size_t p;
+	size_t anchor;
+};
+
+unsigned long *meters = NULL;
+int nmeters = 0;
+int next_meter = 0;
+FILE **outputs;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+int jobs = 0;
+int64_t interval = 0;
+enum { HIST_NONE, HIST_DURATIONS, HIST_GAPS, HIST_PERIODS } histogram = HIST_NONE;
+bool binary = false;
+char *output = NULL;
+char *shard_file = NULL;
+struct shards shards;
+
+static void usage(const char *name) {
+	printf("Usage: %s [-j jobs] [-i interval | -H durations|gaps|periods] [-b] [-o output] [-S shard file] [meter...]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long parse_meter(const char *value) {
+	char *end = NULL;
+	unsigned long id;
+
+	errno = 0;
+	id = strtoul(value, &end, 10);
+	cerror(value, errno != 0);
+
+	errno = EINVAL;
+	cerror(value, value[0] == '\0' || end[0] != '\0');
+	return id;
+}
+
+static void setup(int argc, char *argv[]) {
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "j:i:H:bo:S:")) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+
+		case 'i':
+			interval = strtoll(optarg, NULL, 10) * 1000000;
+			if (interval <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'H':
+			if (!strcmp(optarg, "durations"))
+				histogram = HIST_DURATIONS;
+			else if (!strcmp(optarg, "gaps"))
+				histogram = HIST_GAPS;
+			else if (!strcmp(optarg, "periods"))
+				histogram = HIST_PERIODS;
+			else
+				usage(argv[0]);
+			break;
+
+		case 'b':
+			binary = true;
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'S':
+			shard_file = optarg;
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (interval && histogram != HIST_NONE)
+		usage(argv[0]);
+
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs <= 0)
+		jobs = 1;
+
+	nmeters = argc - optind;
+	if (nmeters > 0) {
+		meters = calloc(nmeters, sizeof(*meters));
+		cerror("calloc", meters == NULL);
+
+		for (i = 0; i < nmeters; i++)
+			meters[i] = parse_meter(argv[optind + i]);
+	}
+}
+
+static void db_error(PGconn *conn, const char *what) {
+	fprintf(stderr, "%s: %s", what, PQerrorMessage(conn));
+	exit(EXIT_FAILURE);
+}
+
+static PGconn *db_connect(const char *conninfo) {
+	PGconn *conn = PQconnectdb(conninfo);
+
+	if (conn == NULL || PQstatus(conn) != CONNECTION_OK)
+		db_error(conn, "db_connect");
+	return conn;
+}
+
+static void init_shards(void) {
+	int ret, i;
+
+	if (shard_file == NULL)
+		return;
+
+	ret = shard_load(shard_file, &shards);
+	cerror(shard_file, ret < 0);
+	if (ret > 0) {
+		fprintf(stderr, "%s:%d: Invalid shard\n", shard_file, ret);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < nmeters; i++) {
+		if (shard_find(&shards, meters[i]) == NULL) {
+			fprintf(stderr, "%s: No shard for meter %lu\n", shard_file, meters[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* index of the shard for a meter, there is
+ * only one (shards.n) without a shard file
+ */
+static size_t meter_shard(unsigned long id) {
+	if (shard_file == NULL)
+		return shards.n;
+	return shard_find(&shards, id) - shards.shard;
+}
+
+static const char *shard_conninfo(size_t shard) {
+	return shard < shards.n ? shards.shard[shard].conninfo : "";
+}
+
+static int compare_meters(const void *a, const void *b) {
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* the meters stored in a database */
+static void init_meters(const char *conninfo) {
+	PGconn *conn;
+	PGresult *res;
+	int i, n;
+
+	conn = db_connect(conninfo);
+	res = PQexec(conn, "SELECT id FROM meters ORDER BY id");
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		db_error(conn, "meters");
+
+	n = PQntuples(res);
+	meters = realloc(meters, (nmeters + n + 1) * sizeof(*meters));
+	cerror("realloc", meters == NULL);
+
+	for (i = 0; i < n; i++) {
+		unsigned long id = parse_meter(PQgetvalue(res, i, 0));
+		const struct shard *shard = shard_find(&shards, id);
+
+		/* the meters table may be the same in every shard */
+		if (shard_file == NULL || (shard != NULL && !strcmp(shard->conninfo, conninfo)))
+			meters[nmeters++] = id;
+	}
+
+	PQclear(res);
+	PQfinish(conn);
+}
+
+/* export all meters if none were specified */
+static void init(void) {
+	size_t i, j;
+
+	init_shards();
+
+	if (nmeters > 0)
+		return;
+
+	if (shard_file == NULL) {
+		init_meters("");
+		return;
+	}
+
+	/* query each database once */
+	for (i = 0; i < shards.n; i++) {
+		for (j = 0; j < i; j++)
+			if (!strcmp(shard_conninfo(i), shard_conninfo(j)))
+				break;
+
+		if (j == i)
+			init_meters(shard_conninfo(i));
+	}
+
+	qsort(meters, nmeters, sizeof(*meters), compare_meters);
+}
+
+static int64_t get_int(const char *buf, int len) {
+	const unsigned char *data = (const unsigned char *)buf;
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		value = (value << 8) | data[i];
+
+	if (len < 8 && (data[0] & 0x80))
+		value |= ~0ULL << (len * 8);
+	return (int64_t)value;
+}
+
+/* make at least n bytes of the binary copy data available */
+static bool copy_fill(struct copy *c, int n) {
+	while (c->len - c->pos < n) {
+		char *msg;
+		int ret = PQgetCopyData(c->conn, &msg, 0);
+
+		if (ret == -2)
+			db_error(c->conn, "PQgetCopyData");
+		if (ret < 0)
+			return false;
+
+		if (c->pos > 0) {
+			memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+			c->len -= c->pos;
+			c->pos = 0;
+		}
+
+		c->buf = realloc(c->buf, c->len + ret);
+		cerror("realloc", c->buf == NULL);
+		memcpy(c->buf + c->len, msg, ret);
+		c->len += ret;
+		PQfreemem(msg);
+	}
+	return true;
+}
+
+static void copy_begin(struct copy *c, PGconn *conn, const char *sql) {
+	static const char signature[11] = "PGCOPY\n\377\r\n\0";
+	PGresult *res = PQexec(conn, sql);
+	int ext;
+
+	if (PQresultStatus(res) != PGRES_COPY_OUT)
+		db_error(conn, sql);
+	PQclear(res);
+
+	c->conn = conn;
+	c->buf = NULL;
+	c->len = 0;
+	c->pos = 0;
+
+	if (!copy_fill(c, 19) || memcmp(c->buf, signature, sizeof(signature)))
+		db_error(conn, "invalid copy header");
+
+	ext = get_int(c->buf + 15, 4);
+	c->pos = 19;
+	if (!copy_fill(c, ext))
+		db_error(conn, "invalid copy header");
+	c->pos += ext;
+}
+
+/* read a row of n int8/timestamptz fields, NULLs are NULL_VALUE */
+static bool copy_row(struct copy *c, int64_t *values, int n) {
+	int i, fields;
+
+	if (!copy_fill(c, 2))
+		db_error(c->conn, "missing copy trailer");
+
+	fields = get_int(c->buf + c->pos, 2);
+	c->pos += 2;
+	if (fields == -1)
+		return false;
+	if (fields != n)
+		db_error(c->conn, "unexpected copy row");
+
+	for (i = 0; i < n; i++) {
+		int len;
+
+		if (!copy_fill(c, 4))
+			db_error(c->conn, "truncated copy row");
+		len = get_int(c->buf + c->pos, 4);
+		c->pos += 4;
+
+		if (len == -1) {
+			values[i] = NULL_VALUE;
+		} else if (len == 8 && copy_fill(c, 8)) {
+			values[i] = get_int(c->buf + c->pos, 8);
+			c->pos += 8;
+		} else {
+			db_error(c->conn, "unexpected copy field");
+		}
+	}
+	return true;
+}
+
+static void copy_end(struct copy *c) {
+	PGresult *res;
+	char *msg;
+
+	while (PQgetCopyData(c->conn, &msg, 0) > 0)
+		PQfreemem(msg);
+
+	while ((res = PQgetResult(c->conn)) != NULL) {
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			db_error(c->conn, "copy");
+		PQclear(res);
+	}
+
+	free(c->buf);
+}
+
+static void add_pulse(struct meter *m, size_t *size, int64_t start, int64_t stop) {
+	if (m->npulses == *size) {
+		*size = *size ? *size * 2 : 4096;
+		m->starts = realloc(m->starts, *size * sizeof(*m->starts));
+		cerror("realloc", m->starts == NULL);
+		m->stops = realloc(m->stops, *size * sizeof(*m->stops));
+		cerror("realloc", m->stops == NULL);
+	}
+
+	m->starts[m->npulses] = start;
+	m->stops[m->npulses] = stop;
+	m->npulses++;
+}
+
+/* merge the counted pulses, both are in order of start */
+static void merge_pulses(struct meter *m, const struct meter *counted) {
+	struct meter merged = { .npulses = 0 };
+	size_t size = m->npulses + counted->npulses;
+	size_t i = 0, j = 0;
+
+	merged.starts = malloc(size * sizeof(*merged.starts));
+	cerror("malloc", merged.starts == NULL);
+	merged.stops = malloc(size * sizeof(*merged.stops));
+	cerror("malloc", merged.stops == NULL);
+
+	while (i < m->npulses || j < counted->npulses) {
+		if (j == counted->npulses || (i < m->npulses && m->starts[i] <= counted->starts[j])) {
+			add_pulse(&merged, &size, m->starts[i], m->stops[i]);
+			i++;
+		} else {
+			add_pulse(&merged, &size, counted->starts[j], counted->stops[j]);
+			j++;
+		}
+	}
+
+	free(m->starts);
+	free(m->stops);
+	m->starts = merged.starts;
+	m->stops = merged.stops;
+	m->npulses = merged.npulses;
+}
+
+static void load(PGconn *conn, struct meter *m) {
+	const char *param[1];
+	struct copy c;
+	PGresult *res;
+	char tmp[32];
+	char sql[256];
+	int64_t row[4];
+	size_t size;
+	struct meter counted = { .npulses = 0 };
+
+	sprintf(tmp, "%lu", m->id);
+	param[0] = tmp;
+
+	res = PQexecParams(conn, "SELECT (pulse * " STR(VALUE_SCALE) ")::bigint, (\"offset\" * " STR(VALUE_SCALE) ")::bigint FROM meters WHERE id = $1", 1, NULL, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		db_error(conn, "meters");
+	if (PQntuples(res) == 1 && !PQgetisnull(res, 0, 0) && !PQgetisnull(res, 0, 1)) {
+		m->pulse = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+		m->offset = strtoll(PQgetvalue(res, 0, 1), NULL, 10);
+	} else {
+		m->pulse = 0;
+		m->offset = 0;
+	}
+	PQclear(res);
+
+	snprintf(sql, sizeof(sql), "COPY (SELECT ts, (value * " STR(VALUE_SCALE) ")::bigint FROM readings WHERE meter = %lu ORDER BY ts) TO STDOUT (FORMAT binary)", m->id);
+	copy_begin(&c, conn, sql);
+	for (m->nreadings = 0, size = 0; copy_row(&c, row, 2); m->nreadings++) {
+		if (m->nreadings == size) {
+			size = size ? size * 2 : 64;
+			m->readings = realloc(m->readings, size * sizeof(*m->readings));
+			cerror("realloc", m->readings == NULL);
+		}
+
+		m->readings[m->nreadings].ts = row[0] + PG_EPOCH;
+		m->readings[m->nreadings].value = row[1];
+	}
+	copy_end(&c);
+
+	snprintf(sql, sizeof(sql), "COPY (SELECT start, stop FROM pulses WHERE meter = %lu ORDER BY start) TO STDOUT (FORMAT binary)", m->id);
+	copy_begin(&c, conn, sql);
+	for (m->npulses = 0, size = 0; copy_row(&c, row, 2); )
+		add_pulse(m, &size, row[0] + PG_EPOCH, row[1] == NULL_VALUE ? NULL_VALUE : row[1] + PG_EPOCH);
+	copy_end(&c);
+
+	/* counted pulses are evenly spaced from first to last, the same as pulse_count_upto() */
+	snprintf(sql, sizeof(sql), "COPY (SELECT first, last, count, (extract(epoch FROM ontime) * 1000000)::bigint FROM pulse_counts WHERE meter = %lu AND count > 0 ORDER BY start) TO STDOUT (FORMAT binary)", m->id);
+	copy_begin(&c, conn, sql);
+	for (size = 0; copy_row(&c, row, 4); ) {
+		int64_t first = row[0] + PG_EPOCH, last = row[1] + PG_EPOCH;
+		int64_t k, n = row[2], ontime = row[3] / n;
+
+		for (k = 0; k < n; k++) {
+			int64_t start = n > 1 ? first + (last - first) * k / (n - 1) : first;
+
+			add_pulse(&counted, &size, start, start + ontime);
+		}
+	}
+	copy_end(&c);
+
+	if (counted.npulses > 0)
+		merge_pulses(m, &counted);
+	free(counted.starts);
+	free(counted.stops);
+}
+
+/* number of pulses with start <= ts */
+static size_t pulses_upto(const struct meter *m, int64_t ts) {
+	size_t lo = 0, hi = m->npulses;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (m->starts[mid] <= ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* same as reading_floor() */
+static int64_t reading_floor(const struct meter *m, int64_t value) {
+	return value - (value - m->offset) % m->pulse;
+}
+
+/* same as reading_calculate(), ts must not decrease between calls */
+static int64_t calc_value(struct calc *c, int64_t ts) {
+	const struct meter *m = c->m;
+	size_t r = c->r;
+
+	if (m->pulse <= 0)
+		return NULL_VALUE;
+
+	while (c->p < m->npulses && m->starts[c->p] <= ts)
+		c->p++;
+	while (c->r < m->nreadings && m->readings[c->r].ts <= ts)
+		c->r++;
+
+	if (c->r > 0 && m->readings[c->r - 1].value != NULL_VALUE) {
+		const struct reading *prev = &m->readings[c->r - 1];
+
+		if (c->r != r || c->anchor == SIZE_MAX)
+			c->anchor = pulses_upto(m, prev->ts);
+
+		return reading_floor(m, prev->value) + (int64_t)(c->p - c->anchor) * m->pulse;
+	} else if (c->r < m->nreadings && m->readings[c->r].value != NULL_VALUE) {
+		const struct reading *next = &m->readings[c->r];
+
+		if (c->r != r || c->anchor == SIZE_MAX)
+			c->anchor = pulses_upto(m, next->ts);
+
+		return reading_floor(m, next->value) - (int64_t)(c->anchor - c->p) * m->pulse;
+	} else {
+		return NULL_VALUE;
+	}
+}
+
+static void write_value(FILE *f, int64_t value) {
+	if (value == NULL_VALUE)
+		return;
+
+	if (value < 0) {
+		fputc('-', f);
+		value = -value;
+	}
+	fprintf(f, "%lld.%04lld", (long long)(value / VALUE_SCALE), (long long)(value % VALUE_SCALE));
+}
+
+static void write_record(FILE *f, const struct meter *m, int64_t ts, int64_t value, int64_t duration) {
+	if (binary) {
+		export_t rec = {
+			.meter = m->id,
+			.ts = ts,
+			.value = value,
+			.duration = duration
+		};
+
+		cerror("fwrite", fwrite(&rec, sizeof(rec), 1, f) != 1);
+	} else {
+		fprintf(f, "%lu,%lld.%06lld,", m->id, (long long)(ts / 1000000), (long long)(ts % 1000000));
+		write_value(f, value);
+		if (duration >= 0)
+			fprintf(f, ",%lld.%06lld\n", (long long)(duration / 1000000), (long long)(duration % 1000000));
+		else
+			fprintf(f, ",\n");
+	}
+}
+
+static void export_pulses(FILE *f, const struct meter *m) {
+	struct calc c = { .m = m, .anchor = SIZE_MAX };
+	size_t i;
+
+	for (i = 0; i < m->npulses; i++) {
+		write_record(f, m, m->starts[i], calc_value(&c, m->starts[i]),
+			m->stops[i] == NULL_VALUE ? -1 : m->stops[i] - m->starts[i]);
+	}
+}
+
+static int64_t interval_floor(int64_t ts) {
+	return ts - ((ts % interval) + interval) % interval;
+}
+
+/* usage between the start and end of each interval, same as meter_usage */
+static void export_intervals(FILE *f, const struct meter *m) {
+	struct calc c = { .m = m, .anchor = SIZE_MAX };
+	int64_t ts, end, value;
+
+	if (m->npulses == 0)
+		return;
+
+	ts = interval_floor(m->starts[0]);
+	end = interval_floor(m->starts[m->npulses - 1]) + interval;
+	value = calc_value(&c, ts);
+
+	while (ts < end) {
+		int64_t next = calc_value(&c, ts + interval);
+
+		write_record(f, m, ts, value == NULL_VALUE || next == NULL_VALUE ? NULL_VALUE : next - value, interval);
+		value = next;
+		ts += interval;
+	}
+}
+
+/* pulses at the end that have not finished are excluded,
+ * any others are counted below the first edge
+ */
+static void export_histogram(FILE *f, const struct meter *m) {
+	int64_t edges[HIST_EDGES];
+	uint64_t counts[HIST_EDGES + 1] = { 0 };
+	int64_t *values;
+	size_t nedges, nvalues, n = m->npulses;
+	size_t k;
+
+	while (n > 0 && m->stops[n - 1] == NULL_VALUE)
+		n--;
+	if (n == 0)
+		return;
+
+	values = malloc(n * sizeof(*values));
+	cerror("malloc", values == NULL);
+
+	switch (histogram) {
+	case HIST_DURATIONS:
+		nedges = kern_log_edges(HIST_MIN, HIST_MAX_DURATION, edges, HIST_EDGES);
+		kern_durations(m->starts, m->stops, n, values);
+		nvalues = n;
+		break;
+
+	case HIST_GAPS:
+		nedges = kern_log_edges(HIST_MIN, HIST_MAX_GAP, edges, HIST_EDGES);
+		kern_gaps(m->starts, m->stops, n, values);
+		nvalues = n - 1;
+		break;
+
+	case HIST_PERIODS:
+	default:
+		nedges = kern_log_edges(HIST_MIN, HIST_MAX_GAP, edges, HIST_EDGES);
+		kern_periods(m->starts, n, values);
+		nvalues = n - 1;
+		break;
+	}
+
+	kern_histogram(values, nvalues, edges, nedges, counts);
+	free(values);
+
+	for (k = 0; k <= nedges; k++) {
+		int64_t low = k > 0 ? edges[k - 1] : NULL_VALUE;
+		int64_t high = k < nedges ? edges[k] : NULL_VALUE;
+
+		if (counts[k] == 0)
+			continue;
+
+		if (binary) {
+			export_t rec = {
+				.meter = m->id,
+				.ts = low,
+				.value = counts[k],
+				.duration = low != NULL_VALUE && high != NULL_VALUE ? high - low : -1
+			};
+
+			cerror("fwrite", fwrite(&rec, sizeof(rec), 1, f) != 1);
+		} else {
+			fprintf(f, "%lu,", m->id);
+			if (low != NULL_VALUE)
+				fprintf(f, "%lld.%06lld", (long long)(low / 1000000), (long long)(low % 1000000));
+			fprintf(f, ",");
+			if (high != NULL_VALUE)
+				fprintf(f, "%lld.%06lld", (long long)(high / 1000000), (long long)(high % 1000000));
+			fprintf(f, ",%llu\n", (unsigned long long)counts[k]);
+		}
+	}
+}
+
+static void export_meter(PGconn *conn, int i) {
+	struct meter m = { .id = meters[i] };
+
+	outputs[i] = tmpfile();
+	cerror("tmpfile", outputs[i] == NULL);
+
+	load(conn, &m);
+	if (interval)
+		export_intervals(outputs[i], &m);
+	else if (histogram != HIST_NONE)
+		export_histogram(outputs[i], &m);
+	else
+		export_pulses(outputs[i], &m);
+
+	free(m.readings);
+	free(m.starts);
+	free(m.stops);
+}
+
+/* each worker connects to the shards as they are needed */
+static void *worker(void *arg) {
+	PGconn **conns = calloc(shards.n + 1, sizeof(*conns));
+	size_t shard;
+
+	(void)arg;
+	cerror("calloc", conns == NULL);
+
+	for (;;) {
+		int i;
+
+		cerror("pthread_mutex_lock", (errno = pthread_mutex_lock(&lock)) != 0);
+		i = next_meter++;
+		cerror("pthread_mutex_unlock", (errno = pthread_mutex_unlock(&lock)) != 0);
+
+		if (i >= nmeters)
+			break;
+
+		shard = meter_shard(meters[i]);
+		if (conns[shard] == NULL)
+			conns[shard] = db_connect(shard_conninfo(shard));
+
+		export_meter(conns[shard], i);
+	}
+
+	for (shard = 0; shard <= shards.n; shard++)
+		if (conns[shard] != NULL)
+			PQfinish(conns[shard]);
+	free(conns);
+	return NULL;
+}
+
+static void run(void) {
+	pthread_t *threads;
+	int i;
+
+	outputs = calloc(nmeters > 0 ? nmeters : 1, sizeof(*outputs));
+	cerror("calloc", outputs == NULL);
+
+	if (jobs > nmeters)
+		jobs = nmeters;
+
+	threads = calloc(jobs > 0 ? jobs : 1, sizeof(*threads));
+	cerror("calloc", threads == NULL);
+
+	for (i = 0; i < jobs; i++)
+		cerror("pthread_create", (errno = pthread_create(&threads[i], NULL, worker, NULL)) != 0);
+	for (i = 0; i < jobs; i++)
+		cerror("pthread_join", (errno = pthread_join(threads[i], NULL)) != 0);
+
+	free(threads);
+}
+
+/* write the output of each meter in order */
+static void finish(void) {
+	FILE *f = stdout;
+	char buf[65536];
+	int i;
+
+	if (output != NULL) {
+		f = fopen(output, "w");
+		cerror(output, f == NULL);
+	}
+
+	for (i = 0; i < nmeters; i++) {
+		size_t len;
+
+		rewind(outputs[i]);
+		while ((len = fread(buf, 1, sizeof(buf), outputs[i])) > 0)
+			cerror("fwrite", fwrite(buf, 1, len, f) != len);
+		cerror("fread", ferror(outputs[i]));
+		fclose(outputs[i]);
+	}
+
+	cerror(output != NULL ? output : "stdout", fflush(f) != 0);
+	if (output != NULL)
+		cerror(output, fclose(f) != 0);
+}
+
+static void cleanup(void) {
+	free(outputs);
+	free(meters);
+	shard_free(&shards);
+}
+
+int main(int argc, char *argv[]) {
+	setup(argc, argv);
+	init();
+	run();
+	finish();
+	cleanup();
+	exit(EXIT_SUCCESS);
+}
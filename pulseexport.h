@@ -0,0 +1,38 @@
+#define xerror(msg) do { perror(msg); exit(EXIT_FAILURE); } while(0)
+#define cerror(msg, expr) do { if (expr) xerror(msg); } while(0)
+
+#define _STR(x) #x
+#define STR(x) _STR(x)
+
+/* PostgreSQL timestamps are µs since 2000-01-01 */
+#define PG_EPOCH 946684800000000LL
+
+/* Meter values are numeric(9,4), exported as integers of 1/10000 */
+#define VALUE_SCALE 10000
+
+#define NULL_VALUE INT64_MIN
+
+/* Histogram edges (µs) are 1, 2 and 5 times each power of 10 */
+#define HIST_EDGES 64
+#define HIST_MIN 1000
+#define HIST_MAX_DURATION 3600000000LL
+#define HIST_MAX_GAP 604800000000LL
+
+/* Binary output record (native byte order)
+ *
+ * Pulses: ts is the start of the pulse and duration is
+ * the length of the pulse (-1 if it has not finished)
+ *
+ * Intervals: ts is the start of the interval and duration
+ * is the length of the interval, value is the usage
+ *
+ * Histograms: ts is the lower edge of the bucket and duration
+ * is the width of the bucket, value is the number of pulses
+ * (ts is NULL_VALUE or duration is -1 if it is unbounded)
+ */
+typedef struct {
+	uint32_t meter;
+	int64_t ts;
+	int64_t value;
+	int64_t duration;
+} __attribute__((__packed__)) export_t;
@@ -0,0 +1,469 @@
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pulsefwd.h"
+#include "pulsefwd_log.h"
+#include "pulsenet.h"
+#include "pulseq.h"
+
+#ifdef SYSLOG
+# include <syslog.h>
+#endif
+
+char *mqueue;
+char *log_file;
+char *host;
+char *port;
+char *remote;
+mqd_t q;
+int logfd;
+fwd_header_t header;
+uint64_t last;
+int sock = -1;
+bool keep = false;
+bool connected = false;
+bool in_flight = false;
+time_t sent_at;
+time_t retry_at = 0;
+int backoff = 1;
+uint8_t rbuf[NET_ACK_SIZE];
+size_t rlen = 0;
+sigset_t die_signals;
+int sfd;
+int waiting_sig = 0;
+#ifdef SYSLOG
+char *ident;
+#endif
+
+static void setup_syslog(void) {
+#ifdef SYSLOG
+	int ret;
+
+	ident = malloc((strlen("pulsefwd") + strlen(mqueue) + 1) * sizeof(char));
+	cerror("malloc", ident == NULL);
+
+	ret = sprintf(ident, "pulsefwd%s", mqueue);
+	cerror("snprintf", ret < 0);
+
+	openlog(ident, LOG_PID, LOG_DAEMON);
+#endif
+}
+
+static void setup(int argc, char *argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "k")) != -1) {
+		switch (opt) {
+		case 'k':
+			keep = true;
+			break;
+
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 5) {
+usage:
+		printf("Usage: %s [-k] <mqueue> <log file> <host> <port> <remote mqueue>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	mqueue = argv[optind];
+	log_file = argv[optind + 1];
+	host = argv[optind + 2];
+	port = argv[optind + 3];
+	remote = argv[optind + 4];
+
+	if (strlen(remote) > NET_NAME_MAX) {
+		errno = ENAMETOOLONG;
+		xerror(remote);
+	}
+
+	setup_syslog();
+}
+
+static void signal_init(void) {
+	cerror("sigemptyset", sigemptyset(&die_signals) != 0);
+	cerror("sigaddset SIGHUP", sigaddset(&die_signals, SIGHUP) != 0);
+	cerror("sigaddset SIGINT", sigaddset(&die_signals, SIGINT) != 0);
+	cerror("sigaddset SIGQUIT", sigaddset(&die_signals, SIGQUIT) != 0);
+	cerror("sigaddset SIGTERM", sigaddset(&die_signals, SIGTERM) != 0);
+
+	/* edges are never removed from the queue without being logged */
+	cerror("sigprocmask SIG_BLOCK", sigprocmask(SIG_BLOCK, &die_signals, NULL) != 0);
+
+	sfd = signalfd(-1, &die_signals, SFD_NONBLOCK|SFD_CLOEXEC);
+	cerror("signalfd", sfd < 0);
+
+	/* a closed connection is handled by write() */
+	cerror("signal SIGPIPE", signal(SIGPIPE, SIG_IGN) == SIG_ERR);
+}
+
+static void log_header(void) {
+	cerror(log_file, pwrite(logfd, &header, sizeof(header), 0) != sizeof(header));
+	cerror(log_file, fdatasync(logfd) != 0);
+}
+
+static void log_open(void) {
+	struct stat st;
+	uint64_t records;
+
+	logfd = open(log_file, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+	cerror(log_file, logfd < 0);
+	cerror(log_file, fstat(logfd, &st) != 0);
+
+	if (st.st_size < (off_t)sizeof(header)) {
+		header.magic = FWD_MAGIC;
+		header.size = sizeof(fwd_record_t);
+		header.first = 1;
+		header.acked = 0;
+		cerror(log_file, ftruncate(logfd, 0) != 0);
+		log_header();
+		st.st_size = sizeof(header);
+	} else {
+		cerror(log_file, pread(logfd, &header, sizeof(header), 0) != sizeof(header));
+
+		errno = EINVAL;
+		cerror(log_file, header.magic != FWD_MAGIC || header.size != sizeof(fwd_record_t));
+	}
+
+	/* discard a partially written record */
+	records = (st.st_size - sizeof(header)) / sizeof(fwd_record_t);
+	cerror(log_file, ftruncate(logfd, sizeof(header) + records * sizeof(fwd_record_t)) != 0);
+
+	/* the log was emptied but the header wasn't updated */
+	if (records == 0 && header.first != header.acked + 1) {
+		header.first = header.acked + 1;
+		log_header();
+	}
+
+	last = header.first + records - 1;
+	_printf("log %llu-%llu, acked %llu\n", (unsigned long long)header.first, (unsigned long long)last, (unsigned long long)header.acked);
+}
+
+static off_t log_offset(uint64_t seq) {
+	return sizeof(header) + (off_t)(seq - header.first) * sizeof(fwd_record_t);
+}
+
+/* records that have been acknowledged are removed
+ * when there are no more records to be sent, unless
+ * they're being kept as a record of every edge
+ */
+static void log_acked(uint64_t seq) {
+	if (seq > last)
+		seq = last;
+	if (seq <= header.acked)
+		return;
+
+	header.acked = seq;
+	log_header();
+
+	/* the records are only removed after the new acked has been
+	 * written, log_open() updates first if this is interrupted
+	 */
+	if (header.acked == last && !keep) {
+		cerror(log_file, ftruncate(logfd, sizeof(header)) != 0);
+		header.first = header.acked + 1;
+		log_header();
+	}
+}
+
+static void init(void) {
+	struct mq_attr q_attr = {
+		.mq_flags = 0,
+		.mq_maxmsg = 4096,
+		.mq_msgsize = sizeof(pulse_span_t)
+	};
+
+	umask(0);
+
+	q = mq_open(mqueue, O_RDONLY|O_NONBLOCK|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP, &q_attr);
+	cerror(mqueue, q < 0);
+
+	signal_init();
+	log_open();
+}
+
+/* move everything from the queue to the log */
+static void receive(void) {
+	fwd_record_t records[NET_BATCH_MAX];
+	unsigned int count;
+
+	do {
+		count = 0;
+		while (count < NET_BATCH_MAX) {
+			pulse_span_t span;
+			int ret = mq_receive(q, (char *)&span, sizeof(span), 0);
+
+			if (ret < 0) {
+				cerror("mq_receive", errno != EAGAIN);
+				break;
+			}
+
+			if (ret != sizeof(pulse_t) && ret != sizeof(pulse_span_t)) {
+				_printf("ignoring message of %d bytes\n", ret);
+				continue;
+			}
+
+			records[count].sec = span.tv.tv_sec;
+			records[count].usec = span.tv.tv_usec;
+			records[count].flags = (span.on ? NET_FLAG_ON : 0) | (ret == sizeof(pulse_span_t) ? NET_FLAG_SPAN : 0);
+			records[count].duration = ret == sizeof(pulse_span_t) ? span.duration : 0;
+			count++;
+		}
+
+		if (count > 0) {
+			ssize_t len = count * sizeof(fwd_record_t);
+
+			cerror(log_file, pwrite(logfd, records, len, log_offset(last + 1)) != len);
+			cerror(log_file, fdatasync(logfd) != 0);
+			last += count;
+			_printf("logged %u, last %llu\n", count, (unsigned long long)last);
+		}
+	} while (count == NET_BATCH_MAX);
+}
+
+static void disconnect(void) {
+	if (sock >= 0)
+		close(sock);
+
+	sock = -1;
+	connected = false;
+	in_flight = false;
+	rlen = 0;
+	retry_at = time(NULL) + backoff;
+	if (backoff < FWD_RETRY_MAX)
+		backoff <<= 1;
+}
+
+static void try_connect(void) {
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+	struct timeval timeout = { .tv_sec = FWD_TIMEOUT };
+	struct addrinfo *res, *ai;
+	uint8_t hello[NET_HELLO_SIZE + NET_NAME_MAX];
+	size_t len = strlen(remote);
+	int one = 1;
+	int ret;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret != 0) {
+		_printf("%s: %s\n", host, gai_strerror(ret));
+		disconnect();
+		return;
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock < 0)
+			continue;
+
+		/* also limits the time taken to connect */
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+
+	if (sock < 0) {
+		_printf("%s: unable to connect\n", host);
+		disconnect();
+		return;
+	}
+
+	hello[0] = NET_HELLO;
+	hello[1] = NET_VERSION;
+	hello[2] = len;
+	memcpy(&hello[NET_HELLO_SIZE], remote, len);
+
+	if (!net_write(sock, hello, NET_HELLO_SIZE + len)) {
+		disconnect();
+		return;
+	}
+
+	/* wait for the receiver's sequence number */
+	in_flight = true;
+	sent_at = time(NULL);
+}
+
+static void send_batch(void) {
+	uint8_t buf[NET_BATCH_SIZE + NET_BATCH_MAX * NET_EDGE_MAX];
+	fwd_record_t records[NET_BATCH_MAX];
+	struct net_edge edges[NET_BATCH_MAX];
+	unsigned int count, i;
+	size_t len;
+
+	if (!connected || in_flight || header.acked >= last)
+		return;
+
+	count = last - header.acked > NET_BATCH_MAX ? NET_BATCH_MAX : last - header.acked;
+	len = count * sizeof(fwd_record_t);
+	cerror(log_file, pread(logfd, records, len, log_offset(header.acked + 1)) != (ssize_t)len);
+
+	for (i = 0; i < count; i++) {
+		edges[i].tv.tv_sec = records[i].sec;
+		edges[i].tv.tv_usec = records[i].usec;
+		edges[i].on = (records[i].flags & NET_FLAG_ON) != 0;
+		edges[i].span = (records[i].flags & NET_FLAG_SPAN) != 0;
+		edges[i].duration = records[i].duration;
+	}
+
+	len = net_encode(&buf[NET_BATCH_SIZE], edges, count);
+	buf[0] = NET_BATCH;
+	net_put64(&buf[1], header.acked + 1);
+	net_put32(&buf[9], count);
+	net_put32(&buf[13], len);
+
+	if (!net_write(sock, buf, NET_BATCH_SIZE + len)) {
+		_printf("%s: write failed: %s\n", host, strerror(errno));
+		disconnect();
+		return;
+	}
+
+	_printf("sent %llu-%llu in %zu bytes\n", (unsigned long long)header.acked + 1, (unsigned long long)header.acked + count, len);
+	in_flight = true;
+	sent_at = time(NULL);
+}
+
+static void receive_ack(void) {
+	ssize_t ret = read(sock, &rbuf[rlen], sizeof(rbuf) - rlen);
+	uint64_t seq;
+
+	if (ret < 0 && errno == EINTR)
+		return;
+	if (ret <= 0) {
+		_printf("%s: connection closed\n", host);
+		disconnect();
+		return;
+	}
+
+	rlen += ret;
+	if (rlen < NET_ACK_SIZE)
+		return;
+	rlen = 0;
+
+	if (rbuf[0] != NET_ACK) {
+		_printf("%s: invalid message\n", host);
+		disconnect();
+		return;
+	}
+
+	seq = net_get64(&rbuf[1]);
+	if (!connected && seq < header.acked)
+		_printf("receiver has %llu but %llu was acknowledged\n", (unsigned long long)seq, (unsigned long long)header.acked);
+
+	_printf("acked %llu\n", (unsigned long long)seq);
+	log_acked(seq);
+
+	/* resend everything after the receiver's sequence number */
+	if (!connected && seq < header.acked && seq + 1 >= header.first)
+		header.acked = seq;
+
+	connected = true;
+	in_flight = false;
+	backoff = 1;
+}
+
+static bool signal_received(void) {
+	struct signalfd_siginfo info;
+
+	if (read(sfd, &info, sizeof(info)) != sizeof(info))
+		return false;
+
+	waiting_sig = info.ssi_signo;
+	return true;
+}
+
+static void loop(void) {
+	do {
+		struct pollfd fds[3] = {
+			{ .fd = q, .events = POLLIN }, /* mqd_t is a file descriptor on Linux */
+			{ .fd = sfd, .events = POLLIN },
+			{ .fd = sock, .events = POLLIN }
+		};
+		time_t now = time(NULL);
+		int timeout = -1;
+
+		if (sock < 0 && now >= retry_at) {
+			try_connect();
+			fds[2].fd = sock;
+		}
+
+		send_batch();
+
+		if (sock < 0)
+			timeout = (retry_at > now ? retry_at - now : 0) * 1000;
+		else if (in_flight)
+			timeout = (sent_at + FWD_TIMEOUT > now ? sent_at + FWD_TIMEOUT - now : 0) * 1000;
+
+		if (poll(fds, 3, timeout) < 0) {
+			cerror("poll", errno != EINTR);
+			continue;
+		}
+
+		if ((fds[1].revents & POLLIN) && signal_received())
+			break;
+
+		if (fds[0].revents & POLLIN)
+			receive();
+
+		if (sock >= 0 && (fds[2].revents & (POLLIN|POLLHUP|POLLERR)))
+			receive_ack();
+
+		if (sock >= 0 && in_flight && time(NULL) >= sent_at + FWD_TIMEOUT) {
+			_printf("%s: timeout\n", host);
+			disconnect();
+		}
+	} while (waiting_sig == 0);
+}
+
+static void cleanup(void) {
+	if (sock >= 0)
+		close(sock);
+	cerror(log_file, close(logfd));
+	cerror(mqueue, mq_close(q));
+#ifdef SYSLOG
+	closelog();
+	free(ident);
+#endif
+
+	/* resend the signal and let the default action happen */
+	if (waiting_sig != 0) {
+		cerror("kill", kill(getpid(), waiting_sig) != 0);
+		cerror("sigprocmask SIG_UNBLOCK", sigprocmask(SIG_UNBLOCK, &die_signals, NULL) != 0);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	setup(argc, argv);
+	init();
+	loop();
+	cleanup();
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,24 @@
+#define xerror(msg) do { perror(msg); exit(EXIT_FAILURE); } while(0)
+#define cerror(msg, expr) do { if (expr) xerror(msg); } while(0)
+
+/* Reconnect after 1s, doubling up to 64s */
+#define FWD_RETRY_MAX 64
+
+/* Reconnect if a batch hasn't been acknowledged after 30s */
+#define FWD_TIMEOUT 30
+
+#ifdef FORK
+# ifndef SYSLOG
+#  define SYSLOG
+# endif
+#endif
+
+#ifdef VERBOSE
+# ifdef SYSLOG
+#  define _printf(...) syslog(LOG_INFO, __VA_ARGS__)
+# else
+#  define _printf(...) printf(__VA_ARGS__)
+# endif
+#else
+# define _printf(...) do { } while(0)
+#endif
@@ -0,0 +1,22 @@
+/* Log file header */
+#define FWD_MAGIC 0x44574650
+
+/* The log contains every edge that has not been acknowledged
+ * (or every edge with pulsefwd -k), the sequence number of a
+ * record is its position plus first
+ *
+ * Flags are NET_FLAG_ON and NET_FLAG_SPAN
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t size;
+	uint64_t first;
+	uint64_t acked;
+} fwd_header_t;
+
+typedef struct {
+	int64_t sec;
+	uint32_t usec;
+	uint8_t flags;
+	uint64_t duration;
+} __attribute__((__packed__)) fwd_record_t;
@@ -0,0 +1,174 @@
+#!/usr/bin/env python2
+# coding=utf8
+
+from __future__ import division
+from __future__ import print_function
+import argparse
+import array
+import bisect
+import calendar
+import datetime
+import math
+import random
+import sys
+import time
+
+SLOT = 900 * 10**6
+HOUR = 3600 * 10**6
+DAY = 24 * HOUR
+
+class Meter:
+	def __init__(self, id, args):
+		self.id = id
+		self.rng = random.Random(args.seed * 1000003 + id)
+		self.pulse = args.pulse
+		self.offset = self.rng.randint(0, int(round(args.pulse * 10000)) - 1) / 10000
+		self.initial = int(self.rng.randint(1000, 9000) / args.pulse)
+		self.scale = self.rng.uniform(0.5, 1.5)
+		self.interval = int(args.pulse * HOUR / (args.rate * self.rng.uniform(0.8, 1.2)))
+		self.start = args.start
+		self.end = args.end
+		self.years = args.years
+		self.resets = args.resets
+		self.readings = args.readings
+		self.pulses = array.array('l')
+		self.durations = array.array('l')
+		self.gaps = []
+
+	# Fraction of the slot that the boiler is running
+	def demand(self, ts):
+		t = time.gmtime(ts // 10**6)
+		hour = t.tm_hour + t.tm_min / 60
+		season = 0.55 + 0.45 * math.cos(2 * math.pi * (t.tm_yday - 15) / 365.25)
+
+		if t.tm_wday >= 5:
+			heating = 7 <= hour < 11 or 16 <= hour < 23
+		else:
+			heating = 6 <= hour < 9 or 17 <= hour < 22
+
+		f = (0.5 if heating else 0.02) * season * self.scale * self.rng.uniform(0.6, 1.4)
+
+		# hot water
+		if 6 <= hour < 23 and self.rng.random() < 0.05:
+			f += self.rng.uniform(0.1, 0.3)
+		return min(f, 1.0)
+
+	def simulate(self):
+		rng = self.rng
+		carry = rng.randint(0, self.interval)
+		ts = self.start
+
+		while ts < self.end:
+			run = int(self.demand(ts) * SLOT)
+			if run > 0:
+				at = ts + rng.randint(0, SLOT - run) + carry
+				stop = ts + SLOT
+				while at < stop and at < self.end and run > 0:
+					self.pulses.append(at)
+					self.durations.append(int(self.interval * rng.uniform(0.25, 0.45)))
+					at += self.interval
+					run -= self.interval
+				carry = max(0, -run)
+			ts += SLOT
+
+		# the device was disconnected, pulses were missed and a reset was recorded
+		for i in range(0, int(self.resets * self.years)):
+			start = rng.randint(self.start + DAY, self.end - 15 * DAY)
+			self.gaps.append((start, start + rng.randint(HOUR, 2 * DAY)))
+		self.gaps.sort()
+
+	def value(self, ts):
+		n = bisect.bisect_right(self.pulses, ts)
+		return round(self.offset + (self.initial + n + self.rng.uniform(0, 0.99)) * self.pulse, 4)
+
+	def reading_rows(self):
+		rng = self.rng
+		rows = [(self.start, self.value(self.start))]
+
+		for i in range(0, int(self.readings * self.years)):
+			ts = rng.randint(self.start + HOUR, self.end - HOUR)
+			rows.append((ts, self.value(ts)))
+
+		# a manual reading is taken after every reset
+		for (start, stop) in self.gaps:
+			ts = stop + rng.randint(HOUR, 14 * DAY)
+			rows.append((stop, None))
+			rows.append((ts, self.value(ts)))
+
+		rows.sort()
+		return rows
+
+	def missed(self, ts):
+		i = bisect.bisect_right(self.gaps, (ts, ts)) - 1
+		return i >= 0 and ts < self.gaps[i][1]
+
+def tsf(ts):
+	return time.strftime("%Y-%m-%d %H:%M:%S", time.gmtime(ts // 10**6)) + ".{0:06d}+00".format(ts % 10**6)
+
+def months(start, end):
+	t = time.gmtime(start // 10**6)
+	(year, month) = (t.tm_year, t.tm_mon)
+	while calendar.timegm((year, month, 1, 0, 0, 0)) * 10**6 < end:
+		yield "{0:04d}-{1:02d}-01 00:00:00+00".format(year, month)
+		(year, month) = (year + month // 12, month % 12 + 1)
+
+def generate(args, out):
+	meters = [Meter(id, args) for id in range(args.id, args.id + args.meters)]
+
+	print("BEGIN;", file=out)
+	print("COPY meters (id, name, pulse, \"offset\") FROM stdin;", file=out)
+	for meter in meters:
+		print("{0}\tgen{0}\t{1:.4f}\t{2:.4f}".format(meter.id, meter.pulse, meter.offset), file=out)
+	print("\\.", file=out)
+	print("SELECT setval('meters_id_seq', (SELECT max(id) FROM meters));", file=out)
+
+	for month in months(args.start, args.end):
+		print("SELECT partition_create('pulses', '{0}');".format(month), file=out)
+
+	for meter in meters:
+		meter.simulate()
+
+		print("COPY readings (meter, ts, value) FROM stdin;", file=out)
+		for (ts, value) in meter.reading_rows():
+			print("{0}\t{1}\t{2}".format(meter.id, tsf(ts), "\\N" if value is None else "{0:.4f}".format(value)), file=out)
+		print("\\.", file=out)
+
+		print("COPY pulses (meter, start, stop) FROM stdin;", file=out)
+		for (ts, duration) in zip(meter.pulses, meter.durations):
+			if not meter.missed(ts):
+				print("{0}\t{1}\t{2}".format(meter.id, tsf(ts), tsf(ts + duration)), file=out)
+		print("\\.", file=out)
+
+		print("{0}: {1} pulses, {2} resets".format(meter.id, len(meter.pulses), len(meter.gaps)), file=sys.stderr)
+		meter.pulses = meter.durations = None
+
+	print("COMMIT;", file=out)
+	print("ANALYZE;", file=out)
+
+if __name__ == "__main__":
+	EXIT_SUCCESS, EXIT_FAILURE = range(0, 2)
+
+	parser = argparse.ArgumentParser(description='Generate meters, readings and pulses for benchmarking (SQL for psql)')
+	parser.add_argument('-m', '--meters', type=int, default=1, help='Number of meters (default: %(default)s)')
+	parser.add_argument('-y', '--years', type=float, default=3, help='Years of pulses per meter (default: %(default)s)')
+	parser.add_argument('-e', '--end', help='End date, YYYY-MM-DD (default: today)')
+	parser.add_argument('-i', '--id', type=int, default=1, help='First meter id (default: %(default)s)')
+	parser.add_argument('-p', '--pulse', type=float, default=0.01, help='Pulse interval in m³ (default: %(default)s)')
+	parser.add_argument('-f', '--rate', type=float, default=2.0, help='Maximum flow rate in m³/h (default: %(default)s)')
+	parser.add_argument('-r', '--resets', type=float, default=2, help='Resets per year (default: %(default)s)')
+	parser.add_argument('-R', '--readings', type=float, default=4, help='Manual readings per year (default: %(default)s)')
+	parser.add_argument('-s', '--seed', type=int, default=0, help='Random seed (default: %(default)s)')
+	parser.add_argument('output', nargs='?', help='Output file (default: stdout)')
+	args = parser.parse_args()
+
+	end = datetime.datetime.strptime(args.end, "%Y-%m-%d") if args.end else datetime.datetime.utcnow()
+	args.end = calendar.timegm(end.date().timetuple()) * 10**6
+	args.start = args.end - int(args.years * 365.25) * DAY
+
+	if args.output is None:
+		generate(args, sys.stdout)
+	else:
+		with open(args.output, "w") as f:
+			generate(args, f)
+
+	sys.exit(EXIT_SUCCESS)
@@ -0,0 +1,619 @@
+#include <sys/time.h>
+#include <sys/types.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <postgresql/libpq-fe.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pulsefwd_log.h"
+#include "pulseimport.h"
+#include "pulsenet.h"
+#include "pulseq.h"
+#include "pulsepair.h"
+#include "pulseshard.h"
+
+#define SQL_TS(value) "(to_timestamp(0) + " value "::bigint * interval '1 microsecond')"
+
+struct edge {
+	int64_t ts;
+	bool on;
+};
+
+struct meter {
+	unsigned long id;
+	struct edge *edges;
+	size_t nedges;
+	size_t size;
+	int64_t *starts;
+	int64_t *stops; /* NULL_STOP if the pulse has not finished */
+	size_t npulses;
+	size_t psize;
+	unsigned long long merged;
+	unsigned long long skipped; /* before the pulses were compacted */
+};
+
+#define NULL_STOP INT64_MIN
+
+const char *conninfo = NULL;
+char *shard_file = NULL;
+struct shards shards;
+const char *table = "pulses";
+bool binary = false;
+bool log_input = false;
+unsigned long log_meter;
+bool dry_run = false;
+int jobs = 0;
+char **files;
+int nfiles;
+
+struct meter *meters = NULL;
+int nmeters = 0;
+int next_meter = 0;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage(const char *name) {
+	printf("Usage: %s [-c conninfo | -S shard file] [-T table] [-j jobs] [-b | -l meter] [-n] <file>...\n", name);
+	exit(EXIT_FAILURE);
+}
+
+static bool parse_id(const char *value, unsigned long *id) {
+	char *end = NULL;
+
+	if (!isdigit((unsigned char)value[0]))
+		return false;
+
+	errno = 0;
+	*id = strtoul(value, &end, 10);
+	return errno == 0 && end[0] == '\0';
+}
+
+static void setup(int argc, char *argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:S:T:j:bl:n")) != -1) {
+		switch (opt) {
+		case 'c':
+			conninfo = optarg;
+			break;
+
+		case 'S':
+			shard_file = optarg;
+			break;
+
+		case 'T':
+			table = optarg;
+			break;
+
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+
+		case 'b':
+			binary = true;
+			break;
+
+		case 'l':
+			if (!parse_id(optarg, &log_meter))
+				usage(argv[0]);
+			log_input = true;
+			break;
+
+		case 'n':
+			dry_run = true;
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc == optind || (conninfo != NULL && shard_file != NULL) || (binary && log_input))
+		usage(argv[0]);
+
+	if (jobs <= 0)
+		jobs = 1;
+
+	files = &argv[optind];
+	nfiles = argc - optind;
+}
+
+static void init_shards(void) {
+	int ret;
+
+	if (shard_file == NULL)
+		return;
+
+	ret = shard_load(shard_file, &shards);
+	cerror(shard_file, ret < 0);
+	if (ret > 0) {
+		fprintf(stderr, "%s:%d: Invalid shard\n", shard_file, ret);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* meters are usually grouped together in the input */
+static struct meter *find_meter(unsigned long id) {
+	static int last = 0;
+	int i;
+
+	if (last < nmeters && meters[last].id == id)
+		return &meters[last];
+
+	for (i = 0; i < nmeters; i++)
+		if (meters[i].id == id)
+			return &meters[last = i];
+
+	if (shard_file != NULL && shard_find(&shards, id) == NULL) {
+		fprintf(stderr, "%s: No shard for meter %lu\n", shard_file, id);
+		exit(EXIT_FAILURE);
+	}
+
+	meters = realloc(meters, (nmeters + 1) * sizeof(*meters));
+	cerror("realloc", meters == NULL);
+
+	memset(&meters[nmeters], 0, sizeof(*meters));
+	meters[nmeters].id = id;
+	last = nmeters;
+	return &meters[nmeters++];
+}
+
+static void add_edge(struct meter *m, int64_t ts, bool on) {
+	if (m->nedges == m->size) {
+		m->size = m->size ? m->size * 2 : 4096;
+		m->edges = realloc(m->edges, m->size * sizeof(*m->edges));
+		cerror("realloc", m->edges == NULL);
+	}
+
+	m->edges[m->nedges].ts = ts;
+	m->edges[m->nedges].on = on;
+	m->nedges++;
+}
+
+/* a duration of -1 is a pulse that has not finished */
+static void add_span(struct meter *m, int64_t ts, int64_t duration) {
+	add_edge(m, ts, true);
+	if (duration >= 0)
+		add_edge(m, ts + duration, false);
+}
+
+/* seconds[.µs] */
+static bool parse_time(const char *value, int64_t *ts) {
+	char *end = NULL;
+	long long secs;
+	int64_t usecs = 0;
+	int digits = 0;
+
+	if (!isdigit((unsigned char)value[0]))
+		return false;
+
+	errno = 0;
+	secs = strtoll(value, &end, 10);
+	if (errno != 0)
+		return false;
+
+	if (end[0] == '.') {
+		for (end++; isdigit((unsigned char)end[0]); end++, digits++)
+			if (digits < 6)
+				usecs = usecs * 10 + (end[0] - '0');
+
+		for (; digits < 6; digits++)
+			usecs *= 10;
+	}
+
+	*ts = (int64_t)secs * 1000000 + usecs;
+	return end[0] == '\0';
+}
+
+static bool parse_line(char *line) {
+	char *field[4];
+	int64_t ts, duration = -1;
+	unsigned long id;
+	int n = 0;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	if (line[0] == '\0' || line[0] == '#')
+		return true;
+
+	field[n++] = line;
+	while (n < 4 && (line = strchr(line, ',')) != NULL) {
+		*line++ = '\0';
+		field[n++] = line;
+	}
+
+	if ((n != 3 && n != 4) || strchr(field[n - 1], ',') != NULL)
+		return false;
+
+	if (!parse_id(field[0], &id) || !parse_time(field[1], &ts))
+		return false;
+
+	if (n == 3) {
+		bool on;
+
+		if (!strcmp(field[2], "on") || !strcmp(field[2], "1"))
+			on = true;
+		else if (!strcmp(field[2], "off") || !strcmp(field[2], "0"))
+			on = false;
+		else
+			return false;
+
+		add_edge(find_meter(id), ts, on);
+	} else {
+		if (field[3][0] != '\0' && !parse_time(field[3], &duration))
+			return false;
+
+		add_span(find_meter(id), ts, duration);
+	}
+	return true;
+}
+
+static void read_csv(const char *file, FILE *f) {
+	char buf[IMPORT_LINE];
+	unsigned long line = 0;
+
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		line++;
+		if (!parse_line(buf)) {
+			fprintf(stderr, "%s:%lu: Invalid record\n", file, line);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void read_binary(FILE *f) {
+	import_t rec;
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1)
+		add_span(find_meter(rec.meter), rec.ts, rec.duration);
+}
+
+/* spans have already been paired by pulsefwd, pairing
+ * them again gives the same pulses
+ */
+static void read_log(const char *file, FILE *f) {
+	struct meter *m = find_meter(log_meter);
+	fwd_header_t header;
+	fwd_record_t record;
+
+	cerror(file, fread(&header, sizeof(header), 1, f) != 1);
+
+	errno = EINVAL;
+	cerror(file, header.magic != FWD_MAGIC || header.size != sizeof(fwd_record_t));
+
+	while (fread(&record, sizeof(record), 1, f) == 1) {
+		int64_t ts = record.sec * 1000000 + record.usec;
+
+		if (record.flags & NET_FLAG_SPAN)
+			add_span(m, ts, record.duration);
+		else
+			add_edge(m, ts, (record.flags & NET_FLAG_ON) != 0);
+	}
+}
+
+static void init(void) {
+	int i;
+
+	init_shards();
+
+	for (i = 0; i < nfiles; i++) {
+		FILE *f = strcmp(files[i], "-") ? fopen(files[i], "r") : stdin;
+
+		cerror(files[i], f == NULL);
+
+		if (binary)
+			read_binary(f);
+		else if (log_input)
+			read_log(files[i], f);
+		else
+			read_csv(files[i], f);
+
+		cerror(files[i], ferror(f));
+		if (f != stdin)
+			fclose(f);
+	}
+}
+
+static int compare_edges(const void *a, const void *b) {
+	const struct edge *x = a;
+	const struct edge *y = b;
+
+	if (x->ts != y->ts)
+		return (x->ts > y->ts) - (x->ts < y->ts);
+
+	/* the end of a pulse before the start of the next one */
+	return x->on - y->on;
+}
+
+static void add_pulse(void *ctx, const pulse_span_t *span) {
+	struct meter *m = ctx;
+
+	if (m->npulses == m->psize) {
+		m->psize = m->psize ? m->psize * 2 : 4096;
+		m->starts = realloc(m->starts, m->psize * sizeof(*m->starts));
+		cerror("realloc", m->starts == NULL);
+		m->stops = realloc(m->stops, m->psize * sizeof(*m->stops));
+		cerror("realloc", m->stops == NULL);
+	}
+
+	m->starts[m->npulses] = (int64_t)span->tv.tv_sec * 1000000 + span->tv.tv_usec;
+	m->stops[m->npulses] = span->duration == 0 ? NULL_STOP : m->starts[m->npulses] + (int64_t)span->duration;
+	m->npulses++;
+}
+
+static struct timeval to_tv(int64_t ts) {
+	struct timeval tv = { .tv_sec = ts / 1000000, .tv_usec = ts % 1000000 };
+
+	return tv;
+}
+
+/* the same rules as pulsedb, a pulse that has stopped at the
+ * end of the input is complete and one that hasn't is unfinished
+ */
+static void pair_edges(struct meter *m) {
+	struct pulse_pair pair;
+	size_t i;
+
+	for (i = 1; i < m->nedges; i++) {
+		if (compare_edges(&m->edges[i - 1], &m->edges[i]) > 0) {
+			qsort(m->edges, m->nedges, sizeof(*m->edges), compare_edges);
+			break;
+		}
+	}
+
+	pulse_pair_init(&pair, false, add_pulse, m);
+	for (i = 0; i < m->nedges; i++)
+		pulse_pair_edge(&pair, to_tv(m->edges[i].ts), m->edges[i].on);
+
+	if (m->nedges > 0)
+		pulse_pair_time(&pair, to_tv(m->edges[m->nedges - 1].ts + MIN_PULSE));
+
+	if (pair.active) {
+		pulse_span_t span = { .tv = pair.start, .on = true, .duration = 0 };
+
+		add_pulse(m, &span);
+	}
+
+	free(m->edges);
+	m->edges = NULL;
+}
+
+static void db_error(PGconn *conn, const char *what) {
+	fprintf(stderr, "%s: %s", what, PQerrorMessage(conn));
+	exit(EXIT_FAILURE);
+}
+
+static const char *meter_conninfo(unsigned long id) {
+	if (shard_file != NULL)
+		return shard_find(&shards, id)->conninfo;
+	return conninfo != NULL ? conninfo : "";
+}
+
+static PGconn *db_connect(const char *info) {
+	PGconn *conn = PQconnectdb(info);
+
+	if (conn == NULL || PQstatus(conn) != CONNECTION_OK)
+		db_error(conn, "db_connect");
+	return conn;
+}
+
+static void db_exec(PGconn *conn, const char *sql, ExecStatusType status) {
+	PGresult *res = PQexec(conn, sql);
+
+	if (PQresultStatus(res) != status)
+		db_error(conn, sql);
+	PQclear(res);
+}
+
+/* make sure the partitions for every month exist before pulses are
+ * merged into them, this is not fatal because the pulses will be
+ * stored in the default partition
+ */
+static void db_partitions(PGconn *conn, const char *table_sql, const struct meter *m) {
+	PGresult *res;
+	char tmp[2][32];
+	const char *param[3] = { table_sql, tmp[0], tmp[1] };
+
+	sprintf(tmp[0], "%lld", (long long)m->starts[0]);
+	sprintf(tmp[1], "%lld", (long long)m->starts[m->npulses - 1]);
+
+	res = PQexecParams(conn, "SELECT partition_create($1::regclass, m) FROM generate_series("
+		"date_trunc('month', " SQL_TS("$2") " AT TIME ZONE 'UTC') AT TIME ZONE 'UTC', " SQL_TS("$3") ", interval '1 month') AS m",
+		3, NULL, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		fprintf(stderr, "partition_create: %s", PQerrorMessage(conn));
+	PQclear(res);
+}
+
+static void copy_flush(PGconn *conn, char *buf, int *len) {
+	if (*len > 0 && PQputCopyData(conn, buf, *len) != 1)
+		db_error(conn, "PQputCopyData");
+	*len = 0;
+}
+
+/* pulses before this (µs) have been compacted into counts by
+ * pulses_compact(), the meter is locked until the end of the
+ * transaction so that it can't change
+ */
+static int64_t db_compacted(PGconn *conn, const struct meter *m) {
+	char tmp[32];
+	const char *param[2] = { tmp, table };
+	PGresult *res;
+	int64_t ts = INT64_MIN;
+
+	sprintf(tmp, "%lu", m->id);
+	res = PQexecParams(conn, "SELECT (extract(epoch FROM compacted) * 1000000)::bigint FROM meters"
+		" WHERE id = $1::integer AND $2::regclass = 'pulses'::regclass FOR SHARE", 2, NULL, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		db_error(conn, "compacted");
+	if (PQntuples(res) > 0 && !PQgetisnull(res, 0, 0))
+		ts = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+	PQclear(res);
+	return ts;
+}
+
+/* copy pulses into a staging table and merge them, existing pulses
+ * are kept unless they have not finished and the import has a stop
+ *
+ * pulses before the compacted ones are skipped, they'd be counted twice
+ */
+static void db_merge(PGconn *conn, const char *table_sql, struct meter *m, size_t from, size_t to) {
+	char buf[IMPORT_COPY_BUF];
+	char sql[512], tmp[2][32];
+	const char *param[2] = { tmp[0], tmp[1] };
+	PGresult *res;
+	int64_t compacted;
+	int len = 0;
+	size_t i;
+
+	/* the import can be repeated if it's interrupted by a crash */
+	db_exec(conn, "BEGIN", PGRES_COMMAND_OK);
+	db_exec(conn, "SET LOCAL synchronous_commit TO off", PGRES_COMMAND_OK);
+
+	compacted = db_compacted(conn, m);
+	for (i = from; i < to; i++)
+		if (m->starts[i] < compacted)
+			m->skipped++;
+
+	db_exec(conn, "CREATE TEMPORARY TABLE import_pulses (start bigint NOT NULL, stop bigint) ON COMMIT DROP", PGRES_COMMAND_OK);
+	db_exec(conn, "COPY import_pulses FROM STDIN", PGRES_COPY_IN);
+
+	for (i = from; i < to; i++) {
+		if (len + 64 > (int)sizeof(buf))
+			copy_flush(conn, buf, &len);
+
+		if (m->stops[i] == NULL_STOP)
+			len += sprintf(buf + len, "%lld\t\\N\n", (long long)m->starts[i]);
+		else
+			len += sprintf(buf + len, "%lld\t%lld\n", (long long)m->starts[i], (long long)m->stops[i]);
+	}
+	copy_flush(conn, buf, &len);
+
+	if (PQputCopyEnd(conn, NULL) != 1)
+		db_error(conn, "PQputCopyEnd");
+	while ((res = PQgetResult(conn)) != NULL) {
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			db_error(conn, "copy");
+		PQclear(res);
+	}
+
+	snprintf(sql, sizeof(sql), "INSERT INTO %s AS p (meter, start, stop)"
+		" SELECT $1::integer, " SQL_TS("start") ", " SQL_TS("stop") " FROM import_pulses WHERE start >= $2::bigint"
+		" ON CONFLICT (meter, start) DO UPDATE SET stop = EXCLUDED.stop WHERE p.stop IS NULL AND EXCLUDED.stop IS NOT NULL", table_sql);
+
+	sprintf(tmp[0], "%lu", m->id);
+	sprintf(tmp[1], "%lld", (long long)compacted);
+	res = PQexecParams(conn, sql, 2, NULL, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		db_error(conn, "merge");
+	m->merged += strtoull(PQcmdTuples(res), NULL, 10);
+	PQclear(res);
+
+	db_exec(conn, "COMMIT", PGRES_COMMAND_OK);
+}
+
+static void import_meter(PGconn *conn, struct meter *m) {
+	char *table_sql;
+	size_t i;
+
+	pair_edges(m);
+	if (dry_run || m->npulses == 0)
+		return;
+
+	table_sql = PQescapeIdentifier(conn, table, strlen(table));
+	if (table_sql == NULL)
+		db_error(conn, "PQescapeIdentifier");
+
+	db_partitions(conn, table_sql, m);
+	for (i = 0; i < m->npulses; i += IMPORT_BATCH)
+		db_merge(conn, table_sql, m, i, i + IMPORT_BATCH < m->npulses ? i + IMPORT_BATCH : m->npulses);
+
+	PQfreemem(table_sql);
+}
+
+/* each worker connects to the databases as they are needed */
+static void *worker(void *arg) {
+	PGconn **conns = calloc(shards.n + 1, sizeof(*conns));
+	size_t shard;
+
+	(void)arg;
+	cerror("calloc", conns == NULL);
+
+	for (;;) {
+		int i;
+
+		cerror("pthread_mutex_lock", (errno = pthread_mutex_lock(&lock)) != 0);
+		i = next_meter++;
+		cerror("pthread_mutex_unlock", (errno = pthread_mutex_unlock(&lock)) != 0);
+
+		if (i >= nmeters)
+			break;
+
+		shard = shard_file != NULL ? (size_t)(shard_find(&shards, meters[i].id) - shards.shard) : shards.n;
+		if (!dry_run && conns[shard] == NULL)
+			conns[shard] = db_connect(meter_conninfo(meters[i].id));
+
+		import_meter(conns[shard], &meters[i]);
+	}
+
+	for (shard = 0; shard <= shards.n; shard++)
+		if (conns[shard] != NULL)
+			PQfinish(conns[shard]);
+	free(conns);
+	return NULL;
+}
+
+static void run(void) {
+	pthread_t *threads;
+	int i;
+
+	if (jobs > nmeters)
+		jobs = nmeters;
+
+	threads = calloc(jobs > 0 ? jobs : 1, sizeof(*threads));
+	cerror("calloc", threads == NULL);
+
+	for (i = 0; i < jobs; i++)
+		cerror("pthread_create", (errno = pthread_create(&threads[i], NULL, worker, NULL)) != 0);
+	for (i = 0; i < jobs; i++)
+		cerror("pthread_join", (errno = pthread_join(threads[i], NULL)) != 0);
+
+	free(threads);
+}
+
+static void report(void) {
+	int i;
+
+	for (i = 0; i < nmeters; i++) {
+		printf("meter %lu: %zu edges, %zu pulses", meters[i].id, meters[i].nedges, meters[i].npulses);
+		if (!dry_run)
+			printf(", %llu merged", meters[i].merged);
+		if (meters[i].skipped > 0)
+			printf(", %llu skipped (compacted)", meters[i].skipped);
+		printf("\n");
+	}
+}
+
+static void cleanup(void) {
+	int i;
+
+	for (i = 0; i < nmeters; i++) {
+		free(meters[i].starts);
+		free(meters[i].stops);
+	}
+	free(meters);
+	shard_free(&shards);
+}
+
+int main(int argc, char *argv[]) {
+	setup(argc, argv);
+	init();
+	run();
+	report();
+	cleanup();
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,33 @@
+#define xerror(msg) do { perror(msg); exit(EXIT_FAILURE); } while(0)
+#define cerror(msg, expr) do { if (expr) xerror(msg); } while(0)
+
+/* Pulses merged in each transaction, so that live
+ * writers are never waiting on the import for long
+ */
+#define IMPORT_BATCH 100000
+
+/* Size of the buffer for sending copy data */
+#define IMPORT_COPY_BUF 65536
+
+/* Maximum length of a CSV line */
+#define IMPORT_LINE 256
+
+/* Input formats
+ *
+ * CSV edges:   meter,time,on|off|1|0
+ * CSV pulses:  meter,start,value,duration (pulseexport, the value
+ *              is ignored and the duration is empty if unfinished)
+ * Binary (-b): export_t pulses (pulseexport -b)
+ * Log (-l):    pulsefwd log of one meter
+ *
+ * Times are seconds[.µs]. Everything is converted to edges
+ * and paired in the same way as pulsedb (pulsepair).
+ */
+
+/* Binary input record, the same as export_t (native byte order) */
+typedef struct {
+	uint32_t meter;
+	int64_t ts;
+	int64_t value;
+	int64_t duration;
+} __attribute__((__packed__)) import_t;
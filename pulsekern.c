@@ -0,0 +1,262 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pulsekern.h"
+
+#ifdef KERN_VECTOR
+typedef int64_t vint __attribute__((vector_size(KERN_LANES * sizeof(int64_t))));
+typedef double vdouble __attribute__((vector_size(KERN_LANES * sizeof(double))));
+
+/* macros rather than functions so that vectors wider than the
+ * target's registers are never passed by value (which has no
+ * stable ABI), arrays don't need to be aligned
+ */
+#define load(p) ({ vint __l; memcpy(&__l, (p), sizeof(__l)); __l; })
+#define store(p, v) do { vint __s = (v); memcpy((p), &__s, sizeof(__s)); } while(0)
+#define splat(x) ((vint){ (x), (x), (x), (x) })
+
+/* comparisons are -1 for true and 0 for false */
+#define any(m) ({ vint __m = (m); (__m[0] | __m[1] | __m[2] | __m[3]) != 0; })
+#endif
+
+void kern_durations_scalar(const int64_t *start, const int64_t *stop, size_t n, int64_t *out) {
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = stop[i] - start[i];
+}
+
+void kern_durations(const int64_t *start, const int64_t *stop, size_t n, int64_t *out) {
+	size_t i = 0;
+
+#ifdef KERN_VECTOR
+	for (; i + KERN_LANES <= n; i += KERN_LANES)
+		store(&out[i], load(&stop[i]) - load(&start[i]));
+#endif
+	kern_durations_scalar(&start[i], &stop[i], n - i, &out[i]);
+}
+
+void kern_gaps_scalar(const int64_t *start, const int64_t *stop, size_t n, int64_t *out) {
+	size_t i;
+
+	for (i = 0; i + 1 < n; i++)
+		out[i] = start[i + 1] - stop[i];
+}
+
+void kern_gaps(const int64_t *start, const int64_t *stop, size_t n, int64_t *out) {
+	size_t i = 0;
+
+#ifdef KERN_VECTOR
+	for (; i + KERN_LANES < n; i += KERN_LANES)
+		store(&out[i], load(&start[i + 1]) - load(&stop[i]));
+#endif
+	if (i < n)
+		kern_gaps_scalar(&start[i], &stop[i], n - i, &out[i]);
+}
+
+void kern_periods_scalar(const int64_t *start, size_t n, int64_t *out) {
+	size_t i;
+
+	for (i = 0; i + 1 < n; i++)
+		out[i] = start[i + 1] - start[i];
+}
+
+void kern_periods(const int64_t *start, size_t n, int64_t *out) {
+	size_t i = 0;
+
+#ifdef KERN_VECTOR
+	for (; i + KERN_LANES < n; i += KERN_LANES)
+		store(&out[i], load(&start[i + 1]) - load(&start[i]));
+#endif
+	if (i < n)
+		kern_periods_scalar(&start[i], n - i, &out[i]);
+}
+
+void kern_rates_scalar(const int64_t *period, size_t n, double scale, double *out) {
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = period[i] > 0 ? scale / period[i] : 0;
+}
+
+void kern_rates(const int64_t *period, size_t n, double scale, double *out) {
+	size_t i = 0;
+
+#ifdef KERN_VECTOR
+	vdouble s = { scale, scale, scale, scale };
+
+	for (; i + KERN_LANES <= n; i += KERN_LANES) {
+		vint p = load(&period[i]);
+		vdouble r = s / __builtin_convertvector(p, vdouble);
+
+		/* clear the bits of results that divided by zero or a negative */
+		r = (vdouble)((vint)r & (p > 0));
+		memcpy(&out[i], &r, sizeof(r));
+	}
+#endif
+	kern_rates_scalar(&period[i], n - i, scale, &out[i]);
+}
+
+/* number of edges <= value */
+static size_t histogram_bucket(int64_t value, const int64_t *edges, size_t nedges) {
+	size_t lo = 0, hi = nedges;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (edges[mid] <= value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void kern_histogram_scalar(const int64_t *values, size_t n, const int64_t *edges, size_t nedges, uint64_t *counts) {
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		counts[histogram_bucket(values[i], edges, nedges)]++;
+}
+
+/* compares every value against every edge, which is faster
+ * than searching when there are only a few dozen edges
+ */
+void kern_histogram(const int64_t *values, size_t n, const int64_t *edges, size_t nedges, uint64_t *counts) {
+	size_t i = 0;
+
+#ifdef KERN_VECTOR
+	for (; i + KERN_LANES <= n; i += KERN_LANES) {
+		vint v = load(&values[i]);
+		vint b = splat(0);
+		size_t k;
+
+		for (k = 0; k < nedges; k++)
+			b -= v >= splat(edges[k]);
+
+		counts[b[0]]++;
+		counts[b[1]]++;
+		counts[b[2]]++;
+		counts[b[3]]++;
+	}
+#endif
+	kern_histogram_scalar(&values[i], n - i, edges, nedges, counts);
+}
+
+/* index of the first sorted value >= bound, starting from i */
+static size_t buckets_next_scalar(const int64_t *values, size_t n, size_t i, int64_t bound) {
+	while (i < n && values[i] < bound)
+		i++;
+	return i;
+}
+
+size_t kern_buckets_scalar(const int64_t *values, size_t n, int64_t origin, int64_t width, uint64_t *counts, size_t nbuckets) {
+	size_t i, k, before;
+
+	i = before = buckets_next_scalar(values, n, 0, origin);
+	for (k = 0; k < nbuckets && i < n; k++) {
+		size_t j = buckets_next_scalar(values, n, i, origin + (int64_t)(k + 1) * width);
+
+		counts[k] += j - i;
+		i = j;
+	}
+	return before;
+}
+
+#ifdef KERN_VECTOR
+/* skip whole vectors that are below the bound, then count
+ * the values in the last one (they're sorted)
+ */
+static size_t buckets_next(const int64_t *values, size_t n, size_t i, int64_t bound) {
+	vint b;
+
+	/* empty buckets are common for short intervals */
+	if (i < n && values[i] >= bound)
+		return i;
+
+	b = splat(bound);
+
+	while (i + KERN_LANES <= n) {
+		vint m = load(&values[i]) < b;
+
+		/* each value below the bound is -1 */
+		if (m[KERN_LANES - 1] == 0)
+			return i - (m[0] + m[1] + m[2]);
+		i += KERN_LANES;
+	}
+	return buckets_next_scalar(values, n, i, bound);
+}
+#endif
+
+size_t kern_buckets(const int64_t *values, size_t n, int64_t origin, int64_t width, uint64_t *counts, size_t nbuckets) {
+#ifdef KERN_VECTOR
+	size_t i, k, before;
+
+	i = before = buckets_next(values, n, 0, origin);
+	for (k = 0; k < nbuckets && i < n; k++) {
+		size_t j = buckets_next(values, n, i, origin + (int64_t)(k + 1) * width);
+
+		counts[k] += j - i;
+		i = j;
+	}
+	return before;
+#else
+	return kern_buckets_scalar(values, n, origin, width, counts, nbuckets);
+#endif
+}
+
+size_t kern_find_scalar(const int64_t *values, size_t n, int64_t min, size_t *idx, size_t max) {
+	size_t i, found = 0;
+
+	for (i = 0; i < n && found < max; i++)
+		if (values[i] >= min)
+			idx[found++] = i;
+	return found;
+}
+
+/* most values are expected to be below the minimum */
+size_t kern_find(const int64_t *values, size_t n, int64_t min, size_t *idx, size_t max) {
+	size_t i = 0, found = 0;
+
+#ifdef KERN_VECTOR
+	vint m = splat(min);
+
+	for (; i + KERN_LANES <= n && found < max; i += KERN_LANES) {
+		size_t j;
+
+		if (!any(load(&values[i]) >= m))
+			continue;
+
+		for (j = i; j < i + KERN_LANES && found < max; j++)
+			if (values[j] >= min)
+				idx[found++] = j;
+	}
+#endif
+	for (; i < n && found < max; i++)
+		if (values[i] >= min)
+			idx[found++] = i;
+	return found;
+}
+
+size_t kern_log_edges(int64_t min, int64_t max, int64_t *edges, size_t size) {
+	static const int steps[3] = { 1, 2, 5 };
+	int64_t scale;
+	size_t n = 0;
+
+	for (scale = 1; scale <= max && n < size; scale *= 10) {
+		int i;
+
+		for (i = 0; i < 3 && n < size; i++) {
+			int64_t edge = scale * steps[i];
+
+			if (edge >= min && edge <= max)
+				edges[n++] = edge;
+		}
+
+		if (scale > INT64_MAX / 10)
+			break;
+	}
+	return n;
+}
@@ -0,0 +1,58 @@
+/* Batch kernels over pulses stored as separate contiguous
+ * arrays of start and stop times (µs, in order of start)
+ *
+ * GCC vector extensions are used when the target has SIMD
+ * instructions that can compare 64-bit integers (e.g. build
+ * with -march=native on x86-64 with AVX2, or any aarch64),
+ * otherwise they're slower than the scalar versions
+ * (build with -DKERN_SCALAR to disable them)
+ *
+ * The _scalar versions give the same results one element
+ * at a time, for comparison
+ */
+#if defined(__GNUC__) && !defined(KERN_SCALAR) && (defined(__AVX2__) || defined(__aarch64__))
+# define KERN_VECTOR
+#endif
+
+/* Number of values processed at once */
+#define KERN_LANES 4
+
+/* out[i] = stop[i] - start[i] */
+void kern_durations(const int64_t *start, const int64_t *stop, size_t n, int64_t *out);
+void kern_durations_scalar(const int64_t *start, const int64_t *stop, size_t n, int64_t *out);
+
+/* out[i] = start[i + 1] - stop[i] (n - 1 values), the idle time between pulses */
+void kern_gaps(const int64_t *start, const int64_t *stop, size_t n, int64_t *out);
+void kern_gaps_scalar(const int64_t *start, const int64_t *stop, size_t n, int64_t *out);
+
+/* out[i] = start[i + 1] - start[i] (n - 1 values), the period of each pulse */
+void kern_periods(const int64_t *start, size_t n, int64_t *out);
+void kern_periods_scalar(const int64_t *start, size_t n, int64_t *out);
+
+/* out[i] = scale / period[i] (0 if the period is not positive),
+ * e.g. with a scale of the pulse size * 3600000000 for usage per hour
+ */
+void kern_rates(const int64_t *period, size_t n, double scale, double *out);
+void kern_rates_scalar(const int64_t *period, size_t n, double scale, double *out);
+
+/* counts[k] += number of values with edges[k - 1] <= value < edges[k],
+ * for edges in increasing order and nedges + 1 counts (the first and
+ * last are values below and above the edges)
+ */
+void kern_histogram(const int64_t *values, size_t n, const int64_t *edges, size_t nedges, uint64_t *counts);
+void kern_histogram_scalar(const int64_t *values, size_t n, const int64_t *edges, size_t nedges, uint64_t *counts);
+
+/* counts[k] += number of sorted values with origin + k * width <= value < origin + (k + 1) * width,
+ * returns the number of values before the first bucket
+ */
+size_t kern_buckets(const int64_t *values, size_t n, int64_t origin, int64_t width, uint64_t *counts, size_t nbuckets);
+size_t kern_buckets_scalar(const int64_t *values, size_t n, int64_t origin, int64_t width, uint64_t *counts, size_t nbuckets);
+
+/* indices of up to max values >= min, returns the number found */
+size_t kern_find(const int64_t *values, size_t n, int64_t min, size_t *idx, size_t max);
+size_t kern_find_scalar(const int64_t *values, size_t n, int64_t min, size_t *idx, size_t max);
+
+/* edges of 1, 2 and 5 times each power of 10 from min to max
+ * (for histograms), returns the number of edges
+ */
+size_t kern_log_edges(int64_t min, int64_t max, int64_t *edges, size_t size);
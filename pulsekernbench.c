@@ -0,0 +1,293 @@
+#include <sys/time.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pulsefwd_log.h"
+#include "pulsekern.h"
+#include "pulsekernbench.h"
+#include "pulsenet.h"
+#include "pulseq.h"
+#include "pulsepair.h"
+
+size_t npulses = KBENCH_PULSES;
+int runs = KBENCH_RUNS;
+char *log_file = NULL;
+
+int64_t *starts;
+int64_t *stops;
+size_t n = 0;
+size_t size = 0;
+
+/* results of [0] scalar and [1] vector kernels */
+int64_t *values[2];
+double *rates[2];
+size_t *found[2];
+size_t nfound[2];
+uint64_t *counts[2];
+size_t ncounts;
+size_t before[2];
+int64_t edges[KBENCH_EDGES];
+size_t nedges;
+
+static void usage(const char *name) {
+	printf("Usage: %s [-n pulses] [-r runs] [-l pulsefwd log]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+static void setup(int argc, char *argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:l:")) != -1) {
+		switch (opt) {
+		case 'n':
+			npulses = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'r':
+			runs = atoi(optarg);
+			break;
+
+		case 'l':
+			log_file = optarg;
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc != optind || npulses < 2 || runs < 1)
+		usage(argv[0]);
+}
+
+static void add_pulse(int64_t start, int64_t stop) {
+	if (n == size) {
+		size = size ? size * 2 : 4096;
+		starts = realloc(starts, size * sizeof(*starts));
+		cerror("realloc", starts == NULL);
+		stops = realloc(stops, size * sizeof(*stops));
+		cerror("realloc", stops == NULL);
+	}
+
+	starts[n] = start;
+	stops[n] = stop;
+	n++;
+}
+
+/* the same every time, so that runs can be compared */
+static void generate(void) {
+	uint64_t x = 88172645463325252ULL;
+	int64_t t = 1500000000LL * 1000000;
+	size_t i;
+
+	for (i = 0; i < npulses; i++) {
+		int64_t duration;
+
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+
+		/* mostly continuous flow with some long idle periods */
+		t += (x % 100 < 2) ? (int64_t)(x >> 20) % 86400000000LL : 5000000 + (int64_t)(x >> 32) % 300000000;
+		duration = MIN_PULSE + (int64_t)(x >> 40) % 3000000;
+		add_pulse(t, t + duration);
+		t += duration;
+	}
+}
+
+static void add_local(void *ctx, const pulse_span_t *span) {
+	int64_t start = (int64_t)span->tv.tv_sec * 1000000 + span->tv.tv_usec;
+
+	(void)ctx;
+
+	/* ignore hints, the pulse is added when it completes */
+	if (span->duration == 0)
+		return;
+
+	if (n > 0 && start <= starts[n - 1])
+		return;
+
+	add_pulse(start, start + span->duration);
+}
+
+/* read edges from a pulsefwd log, pairing them in the same way as pulsedb */
+static void load_log(void) {
+	struct pulse_pair pair;
+	struct timeval now;
+	fwd_header_t header;
+	fwd_record_t record;
+	FILE *f = fopen(log_file, "r");
+
+	cerror(log_file, f == NULL);
+	cerror(log_file, fread(&header, sizeof(header), 1, f) != 1);
+
+	errno = EINVAL;
+	cerror(log_file, header.magic != FWD_MAGIC || header.size != sizeof(fwd_record_t));
+
+	pulse_pair_init(&pair, false, add_local, NULL);
+	while (fread(&record, sizeof(record), 1, f) == 1) {
+		struct timeval tv = { .tv_sec = record.sec, .tv_usec = record.usec };
+
+		if (record.flags & NET_FLAG_SPAN) {
+			pulse_span_t span = { .tv = tv, .on = true, .duration = record.duration };
+
+			add_local(NULL, &span);
+		} else {
+			pulse_pair_edge(&pair, tv, (record.flags & NET_FLAG_ON) != 0);
+		}
+	}
+	cerror(log_file, ferror(f));
+	fclose(f);
+
+	gettimeofday(&now, NULL);
+	pulse_pair_time(&pair, now);
+
+	errno = ENODATA;
+	cerror(log_file, n < 2);
+}
+
+static void init(void) {
+	int i;
+
+	if (log_file != NULL)
+		load_log();
+	else
+		generate();
+
+	nedges = kern_log_edges(KBENCH_EDGE_MIN, KBENCH_EDGE_MAX, edges, KBENCH_EDGES);
+	ncounts = (stops[n - 1] - starts[0]) / KBENCH_WIDTH + 1;
+
+	for (i = 0; i < 2; i++) {
+		values[i] = malloc(n * sizeof(*values[i]));
+		cerror("malloc", values[i] == NULL);
+		rates[i] = malloc(n * sizeof(*rates[i]));
+		cerror("malloc", rates[i] == NULL);
+		found[i] = malloc(n * sizeof(*found[i]));
+		cerror("malloc", found[i] == NULL);
+		counts[i] = malloc((ncounts > KBENCH_EDGES ? ncounts : KBENCH_EDGES + 1) * sizeof(*counts[i]));
+		cerror("malloc", counts[i] == NULL);
+	}
+}
+
+static void run_durations(int v) {
+	(v ? kern_durations : kern_durations_scalar)(starts, stops, n, values[v]);
+}
+
+static void run_gaps(int v) {
+	(v ? kern_gaps : kern_gaps_scalar)(starts, stops, n, values[v]);
+}
+
+static void run_periods(int v) {
+	(v ? kern_periods : kern_periods_scalar)(starts, n, values[v]);
+}
+
+/* uses the periods from the previous kernel */
+static void run_rates(int v) {
+	(v ? kern_rates : kern_rates_scalar)(values[v], n - 1, 0.01 * 3600000000.0, rates[v]);
+}
+
+static void run_histogram(int v) {
+	memset(counts[v], 0, (nedges + 1) * sizeof(*counts[v]));
+	(v ? kern_histogram : kern_histogram_scalar)(values[v], n - 1, edges, nedges, counts[v]);
+}
+
+static void run_buckets(int v) {
+	memset(counts[v], 0, ncounts * sizeof(*counts[v]));
+	before[v] = (v ? kern_buckets : kern_buckets_scalar)(starts, n, starts[0], KBENCH_WIDTH, counts[v], ncounts);
+}
+
+/* uses the gaps */
+static void run_find(int v) {
+	nfound[v] = (v ? kern_find : kern_find_scalar)(values[v], n - 1, KBENCH_GAP, found[v], n);
+}
+
+static double now(void) {
+	struct timespec ts;
+
+	cerror("clock_gettime", clock_gettime(CLOCK_MONOTONIC, &ts) != 0);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double fastest(void (*run)(int), int v) {
+	double best = 0;
+	int i;
+
+	for (i = 0; i < runs; i++) {
+		double start = now(), elapsed;
+
+		run(v);
+		elapsed = now() - start;
+		if (i == 0 || elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+static void bench(const char *name, void (*run)(int), size_t bytes, const void *a, const void *b, size_t len) {
+	double scalar = fastest(run, 0);
+	double vector = fastest(run, 1);
+	bool same = !memcmp(a, b, len);
+
+	printf("%-10s %10.3f %10.3f %10.0f %10.0f %7.2fx  %s\n", name,
+		scalar * 1e9 / n, vector * 1e9 / n, bytes / scalar / 1e6, bytes / vector / 1e6,
+		scalar / vector, same ? "ok" : "DIFFERENT");
+
+	if (!same)
+		exit(EXIT_FAILURE);
+}
+
+/* compare the same kernel implemented one value at a time and with vectors,
+ * the bandwidth is the size of the arrays read and written
+ */
+static void run(void) {
+	size_t i64 = n * sizeof(int64_t);
+
+	printf("%zu pulses (%s), %zu histogram edges, %zu hourly buckets\n", n, log_file != NULL ? log_file : "generated", nedges, ncounts);
+#ifdef KERN_VECTOR
+	printf("%d lane vectors\n", KERN_LANES);
+#else
+	printf("vectors disabled, the kernels are all scalar\n");
+#endif
+	printf("%-10s %10s %10s %10s %10s %8s\n", "kernel", "scalar ns", "vector ns", "scalar MB/s", "vector MB/s", "speedup");
+
+	bench("durations", run_durations, 3 * i64, values[0], values[1], i64);
+	bench("gaps", run_gaps, 3 * i64, values[0], values[1], i64 - sizeof(int64_t));
+	bench("find", run_find, i64, found[0], found[1], nfound[0] * sizeof(size_t));
+	bench("periods", run_periods, 2 * i64, values[0], values[1], i64 - sizeof(int64_t));
+	bench("histogram", run_histogram, i64, counts[0], counts[1], (nedges + 1) * sizeof(uint64_t));
+	bench("rates", run_rates, 2 * i64, rates[0], rates[1], (n - 1) * sizeof(double));
+	bench("buckets", run_buckets, i64, counts[0], counts[1], ncounts * sizeof(uint64_t));
+
+	if (nfound[0] != nfound[1] || before[0] != before[1]) {
+		printf("results are DIFFERENT\n");
+		exit(EXIT_FAILURE);
+	}
+	printf("%zu gaps of at least %llds\n", nfound[1], KBENCH_GAP / 1000000);
+}
+
+static void cleanup(void) {
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		free(values[i]);
+		free(rates[i]);
+		free(found[i]);
+		free(counts[i]);
+	}
+	free(starts);
+	free(stops);
+}
+
+int main(int argc, char *argv[]) {
+	setup(argc, argv);
+	init();
+	run();
+	cleanup();
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,19 @@
+#define xerror(msg) do { perror(msg); exit(EXIT_FAILURE); } while(0)
+#define cerror(msg, expr) do { if (expr) xerror(msg); } while(0)
+
+/* Number of generated pulses (about 10 years of a busy meter) */
+#define KBENCH_PULSES 10000000
+
+/* Each kernel is run this many times and the fastest is reported */
+#define KBENCH_RUNS 5
+
+/* Histogram edges (µs) */
+#define KBENCH_EDGES 64
+#define KBENCH_EDGE_MIN 1000
+#define KBENCH_EDGE_MAX 604800000000LL
+
+/* Buckets are hours */
+#define KBENCH_WIDTH 3600000000LL
+
+/* Gaps found are at least 1 hour */
+#define KBENCH_GAP 3600000000LL
@@ -0,0 +1,324 @@
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <mqueue.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pulseleak.h"
+#include "pulseq.h"
+
+#ifdef SYSLOG
+# include <syslog.h>
+#endif
+
+unsigned long long idle = LEAK_IDLE * 1000000ULL;
+unsigned long long period = LEAK_PERIOD * 1000000ULL;
+unsigned long long window = LEAK_WINDOW * 1000000ULL;
+struct meter *meters;
+struct pollfd *fds;
+int meters_count;
+
+static unsigned long long parse_secs(const char *value) {
+	char *end = NULL;
+	unsigned long secs;
+
+	errno = 0;
+	secs = strtoul(value, &end, 10);
+	cerror(value, errno != 0);
+
+	errno = EINVAL;
+	cerror(value, value[0] == '\0' || end[0] != '\0' || secs == 0);
+
+	return (unsigned long long)secs * 1000000;
+}
+
+static void setup(int argc, char *argv[]) {
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "g:p:w:")) != -1) {
+		switch (opt) {
+		case 'g':
+			idle = parse_secs(optarg);
+			break;
+
+		case 'p':
+			period = parse_secs(optarg);
+			break;
+
+		case 'w':
+			window = parse_secs(optarg);
+			break;
+
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind < 1) {
+usage:
+		printf("Usage: %s [-g idle gap s] [-p alert period s] [-w window s] <mqueue> [mqueue...]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	meters_count = argc - optind;
+	meters = calloc(meters_count, sizeof(*meters));
+	cerror("calloc", meters == NULL);
+
+	fds = calloc(meters_count, sizeof(*fds));
+	cerror("calloc", fds == NULL);
+
+	for (i = 0; i < meters_count; i++)
+		meters[i].name = argv[optind + i];
+
+#ifdef SYSLOG
+	openlog("pulseleak", LOG_PID, LOG_DAEMON);
+#endif
+}
+
+static void init(void) {
+	struct mq_attr q_attr = {
+		.mq_flags = 0,
+		.mq_maxmsg = 4096,
+		.mq_msgsize = sizeof(pulse_span_t)
+	};
+	int i;
+
+	umask(0);
+
+	/* alerts are read by another process */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	for (i = 0; i < meters_count; i++) {
+		meters[i].q = mq_open(meters[i].name, O_RDONLY|O_NONBLOCK|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP, &q_attr);
+		cerror(meters[i].name, meters[i].q < 0);
+	}
+}
+
+static unsigned long long now_us(void) {
+	struct timeval tv;
+
+	cerror("gettimeofday", gettimeofday(&tv, NULL) != 0);
+	return tv_to_ull(tv);
+}
+
+/* remove gaps that ended before the window */
+static void gap_expire(struct meter *m, unsigned long long now) {
+	while (m->gap_count > 0 && m->gaps[m->gap_first].end + window <= now) {
+		m->gap_first = (m->gap_first + 1) % LEAK_GAPS;
+		m->gap_count--;
+	}
+}
+
+/* a gap can never be the longest in the window once there
+ * is a longer one that ended after it, so the lengths are
+ * always decreasing and the first is the longest
+ */
+static void gap_add(struct meter *m, unsigned long long end, unsigned long long len) {
+	while (m->gap_count > 0 && m->gaps[(m->gap_first + m->gap_count - 1) % LEAK_GAPS].len <= len)
+		m->gap_count--;
+
+	/* lose the oldest gap */
+	if (m->gap_count == LEAK_GAPS) {
+		m->gap_first = (m->gap_first + 1) % LEAK_GAPS;
+		m->gap_count--;
+	}
+
+	m->gaps[(m->gap_first + m->gap_count) % LEAK_GAPS].end = end;
+	m->gaps[(m->gap_first + m->gap_count) % LEAK_GAPS].len = len;
+	m->gap_count++;
+}
+
+/* longest gap in the window, including the current one */
+static unsigned long long gap_max(struct meter *m, unsigned long long now) {
+	unsigned long long len = 0;
+
+	gap_expire(m, now);
+	if (m->gap_count > 0)
+		len = m->gaps[m->gap_first].len;
+	if (now > m->last_stop && now - m->last_stop > len)
+		len = now - m->last_stop;
+	return len;
+}
+
+static void event(struct meter *m, const char *msg, unsigned long long now) {
+	unsigned long long gap = gap_max(m, now);
+	unsigned long long run = m->last_stop - m->run_start;
+	double rate = m->max_period > 0 ? 3600000000.0 / m->max_period : 0;
+
+	printf("%s %s %llu.%06u run %llu.%06u longest idle %llu.%06u in %llu rate %.2f\n",
+		m->name, msg, m->run_start / 1000000, (unsigned int)(m->run_start % 1000000),
+		run / 1000000, (unsigned int)(run % 1000000), gap / 1000000, (unsigned int)(gap % 1000000),
+		window / 1000000, rate);
+#ifdef SYSLOG
+	syslog(LOG_WARNING, "%s: %s, flow for %llus since %llu, longest idle %llus in %llus, at least %.2f pulses/hour",
+		m->name, msg, run / 1000000, m->run_start / 1000000, gap / 1000000, window / 1000000, rate);
+#endif
+}
+
+/* flow has stopped, so the run has ended */
+static void run_stop(struct meter *m, unsigned long long now) {
+	if (m->run_start == 0)
+		return;
+
+	if (m->alerted)
+		event(m, "clear", now);
+
+	m->run_start = 0;
+	m->max_period = 0;
+	m->alerted = false;
+}
+
+static void run_check(struct meter *m) {
+	if (m->run_start == 0 || m->alerted)
+		return;
+
+	if (m->last_stop - m->run_start >= period) {
+		m->alerted = true;
+		event(m, "leak", m->last_stop);
+	}
+}
+
+static void handle_reset(struct meter *m) {
+	_printf("%s: reset\n", m->name);
+
+	/* pulses may have been missed */
+	run_stop(m, now_us());
+	m->known = false;
+	m->gap_count = 0;
+}
+
+static void handle_pulse(struct meter *m, unsigned long long start, unsigned long long stop) {
+	if (!m->known) {
+		m->known = true;
+		m->last_start = start;
+		m->last_stop = stop;
+		m->run_start = start;
+		m->max_period = 0;
+		return;
+	}
+
+	if (start < m->last_start) {
+		_printf("%s: ignoring old pulse %llu\n", m->name, start);
+		return;
+	}
+
+	if (start == m->last_start) {
+		/* a resumed pulse has completed again */
+		if (stop <= m->last_stop)
+			return;
+	} else {
+		/* time between the pulses */
+		gap_add(m, start, start > m->last_stop ? start - m->last_stop : 0);
+
+		if (start - m->last_stop >= idle)
+			run_stop(m, start);
+
+		if (m->run_start == 0) {
+			m->run_start = start;
+		} else if (start - m->last_start > m->max_period) {
+			m->max_period = start - m->last_start;
+		}
+	}
+
+	/* length of the pulse */
+	gap_add(m, stop, stop - start);
+
+	m->last_start = start;
+	m->last_stop = stop;
+
+	if (stop - start >= idle)
+		run_stop(m, stop);
+
+	run_check(m);
+}
+
+static void read_queue(struct meter *m) {
+	pulse_span_t span;
+	ssize_t ret;
+
+	while (1) {
+		ret = mq_receive(m->q, (char *)&span, sizeof(span), 0);
+		if (ret < 0) {
+			cerror(m->name, errno != EAGAIN && errno != EINTR);
+			return;
+		}
+
+		if (ret != sizeof(pulse_span_t)) {
+			_printf("%s: ignoring edge\n", m->name);
+			continue;
+		}
+
+		if (span.tv.tv_sec == 0) {
+			handle_reset(m);
+		} else if (span.on && span.duration > 0) {
+			unsigned long long start = tv_to_ull(span.tv);
+
+			handle_pulse(m, start, start + span.duration);
+		}
+	}
+}
+
+/* end runs that have been idle for too long and
+ * return the time until the next one needs checking
+ */
+static int check_idle(void) {
+	unsigned long long now = now_us();
+	unsigned long long next = 0;
+	int i;
+
+	for (i = 0; i < meters_count; i++) {
+		struct meter *m = &meters[i];
+		unsigned long long until;
+
+		if (m->run_start == 0)
+			continue;
+
+		until = m->last_stop + idle;
+		if (now >= until) {
+			run_stop(m, now);
+		} else if (next == 0 || until - now < next) {
+			next = until - now;
+		}
+	}
+
+	if (next == 0)
+		return -1;
+	if (next / 1000 >= INT_MAX)
+		return INT_MAX;
+	return (next + 999) / 1000;
+}
+
+static void loop(void) {
+	int i;
+
+	for (i = 0; i < meters_count; i++) {
+		fds[i].fd = meters[i].q; /* mqd_t is a file descriptor on Linux */
+		fds[i].events = POLLIN;
+	}
+
+	while (1) {
+		if (poll(fds, meters_count, check_idle()) < 0) {
+			cerror("poll", errno != EINTR);
+			continue;
+		}
+
+		for (i = 0; i < meters_count; i++)
+			if (fds[i].revents & POLLIN)
+				read_queue(&meters[i]);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	setup(argc, argv);
+	init();
+	loop();
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,52 @@
+#define xerror(msg) do { perror(msg); exit(EXIT_FAILURE); } while(0)
+#define cerror(msg, expr) do { if (expr) xerror(msg); } while(0)
+
+#define tv_to_ull(x) (unsigned long long)((unsigned long long)(x).tv_sec*1000000 + (unsigned long long)(x).tv_usec)
+
+/* Flow has stopped if there are no edges for 1 hour */
+#define LEAK_IDLE 3600
+
+/* Alert when flow has not stopped for 24 hours */
+#define LEAK_PERIOD 86400
+
+/* Report the longest idle gap in the last 24 hours */
+#define LEAK_WINDOW 86400
+
+/* Idle gaps kept for the window (only decreasing lengths are kept) */
+#define LEAK_GAPS 1024
+
+#ifdef FORK
+# ifndef SYSLOG
+#  define SYSLOG
+# endif
+#endif
+
+#ifdef VERBOSE
+# ifdef SYSLOG
+#  define _printf(...) syslog(LOG_INFO, __VA_ARGS__)
+# else
+#  define _printf(...) printf(__VA_ARGS__)
+# endif
+#else
+# define _printf(...) do { } while(0)
+#endif
+
+/* A period without any edges (all times in µs) */
+struct gap {
+	unsigned long long end;
+	unsigned long long len;
+};
+
+struct meter {
+	char *name;
+	mqd_t q;
+	bool known;
+	unsigned long long last_start;
+	unsigned long long last_stop;
+	unsigned long long run_start; /* 0 if flow has stopped */
+	unsigned long long max_period; /* longest time between pulses in the run */
+	bool alerted;
+	struct gap gaps[LEAK_GAPS]; /* ring, sorted by end with decreasing len */
+	unsigned int gap_first;
+	unsigned int gap_count;
+};
@@ -6,6 +6,7 @@ from __future__ import print_function
 import datetime
 import pg
 import pgdb
+import re
 import select
 import sys
 import syslog
@@ -61,7 +62,8 @@ class DB:
 	class Reconnect(Exception):
 		pass
 
-	def __init__(self):
+	def __init__(self, conninfo=None):
+		self.conninfo = conninfo
 		self.db = None
 
 	def abort(self, e=None):
@@ -78,7 +80,11 @@ class DB:
 		try:
 			if self.db is None:
 				print("Connecting to DB...")
-				self.db = pgdb.connect()
+				if self.conninfo is None:
+					self.db = pgdb.connect()
+				else:
+					# libpq expands a database name that is a conninfo string
+					self.db = pgdb.connect(database=self.conninfo)
 				self.listen()
 				self.commit()
 		except pg.DatabaseError, e:
@@ -149,7 +155,7 @@ class DB:
 			self.abort(e)
 			raise self.Reconnect
 
-	def wait(self, timeout=0):
+	def wait(self, timeout=0, wakeup=None):
 		if not self.connect():
 			raise self.Reconnect
 		try:
@@ -162,10 +168,14 @@ class DB:
 			while notify is None:
 				if self.db._cnx.fileno() < 0:
 					raise self.Reconnect
-				(r, w, x) = select.select([self.db._cnx], [], [self.db._cnx], timeout)
+				files = [self.db._cnx] if wakeup is None else [self.db._cnx, wakeup]
+				(r, w, x) = select.select(files, [], [self.db._cnx], timeout)
 				if len(r) == 0 and len(w) == 0 and len(x) == 0:
 					print("Timeout")
 					return
+				if wakeup in r:
+					print("Woken up")
+					return
 				notify = self.db._cnx.getnotify()
 			print("Notified")
 		except self.Reconnect:
@@ -175,6 +185,65 @@ class DB:
 			self.abort(e)
 			raise self.Reconnect
 
+class Shards:
+	"""Database of each meter, from a shard file in the same format as pulsedb -S"""
+
+	class NoSuchShard(Exception):
+		pass
+
+	METERS = re.compile(r"^(?:%([0-9]+)=)?([0-9]+)(?:-([0-9]+))?$")
+
+	def __init__(self, filename):
+		self.shards = []
+		self.dbs = {}
+
+		with open(filename) as f:
+			for (line, data) in enumerate(f, 1):
+				data = data.strip()
+				if not data or data.startswith("#"):
+					continue
+
+				try:
+					(meters, conninfo) = data.split(None, 1)
+				except ValueError:
+					raise ValueError("{0}:{1}: Invalid shard".format(filename, line))
+				(conninfo, _, standby) = [x.strip() for x in conninfo.partition("|")]
+
+				if meters == "*":
+					(modulus, low, high) = (0, 0, None)
+				else:
+					match = self.METERS.match(meters)
+					if match is None:
+						raise ValueError("{0}:{1}: Invalid shard".format(filename, line))
+					modulus = int(match.group(1) or 0)
+					low = int(match.group(2))
+					high = int(match.group(3) or low)
+					if high < low or (match.group(1) is not None and (modulus == 0 or high >= modulus)):
+						raise ValueError("{0}:{1}: Invalid shard".format(filename, line))
+
+				if not conninfo or ("|" in data and not standby):
+					raise ValueError("{0}:{1}: Invalid shard".format(filename, line))
+
+				self.shards.append((modulus, low, high, conninfo, standby or None))
+
+	def find(self, meter):
+		"""Returns the conninfo and standby conninfo (or None) of the first shard for the meter"""
+
+		meter = int(meter)
+		for (modulus, low, high, conninfo, standby) in self.shards:
+			value = meter % modulus if modulus else meter
+			if value >= low and (high is None or value <= high):
+				return (conninfo, standby)
+		raise self.NoSuchShard(meter)
+
+	def db(self, meter):
+		"""Returns a DB for the meter, shared with the other meters in the same database"""
+
+		(conninfo, standby) = self.find(meter)
+		if conninfo not in self.dbs:
+			self.dbs[conninfo] = DB(conninfo)
+		return self.dbs[conninfo]
+
 class Log:
 	def __init__(self, name):
 		syslog.openlog(name)
@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "pulselog.h"
+
+#ifdef VERBOSE
+static char log_ring[LOG_RING][LOG_LINE];
+static unsigned long log_head = 0; /* written by log_printf() */
+static unsigned long log_tail = 0; /* written by log_thread() */
+static unsigned long log_dropped = 0;
+static bool log_syslog;
+static bool log_running = false;
+static bool log_stop = false;
+static sem_t log_ready;
+static pthread_t log_tid;
+
+static void log_write(const char *msg) {
+	if (log_syslog)
+		syslog(LOG_INFO, "%s", msg);
+	else
+		fputs(msg, stdout);
+}
+
+static void log_drain(void) {
+	static unsigned long reported = 0;
+	unsigned long tail = log_tail;
+	unsigned long head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+	unsigned long dropped;
+
+	while (tail != head) {
+		log_write(log_ring[tail % LOG_RING]);
+		tail++;
+
+		/* make space available as soon as possible */
+		__atomic_store_n(&log_tail, tail, __ATOMIC_RELEASE);
+	}
+
+	dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+	if (dropped != reported) {
+		char msg[64];
+
+		snprintf(msg, sizeof(msg), "dropped %lu log messages\n", dropped - reported);
+		log_write(msg);
+		reported = dropped;
+	}
+
+	if (!log_syslog)
+		fflush(stdout);
+}
+
+static void *log_thread(void *arg) {
+	(void)arg;
+
+	do {
+		while (sem_wait(&log_ready) != 0)
+			if (errno != EINTR)
+				return NULL;
+
+		log_drain();
+	} while (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE));
+
+	return NULL;
+}
+
+/* errors only result in messages being kept until the ring buffer is full */
+void log_open(bool use_syslog) {
+	struct sched_param param = { .sched_priority = 0 };
+	pthread_attr_t attr;
+	sigset_t all, old;
+
+	if (log_running)
+		return;
+
+	log_syslog = use_syslog;
+	if (sem_init(&log_ready, 0, 0) != 0) {
+		perror("sem_init");
+		return;
+	}
+
+	/* the caller may have a real-time scheduling policy */
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setschedparam(&attr, &param);
+
+	/* signals must interrupt the caller, not the log thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	errno = pthread_create(&log_tid, &attr, log_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (errno != 0) {
+		perror("pthread_create");
+		sem_destroy(&log_ready);
+		return;
+	}
+
+	log_running = true;
+	atexit(log_close);
+
+	/* messages logged before starting */
+	sem_post(&log_ready);
+}
+
+void log_printf(const char *format, ...) {
+	unsigned long head = log_head;
+	va_list ap;
+
+	if (head - __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) >= LOG_RING) {
+		__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	va_start(ap, format);
+	vsnprintf(log_ring[head % LOG_RING], LOG_LINE, format, ap);
+	va_end(ap);
+
+	__atomic_store_n(&log_head, head + 1, __ATOMIC_RELEASE);
+
+	/* only makes a system call if the log thread is waiting */
+	if (log_running)
+		sem_post(&log_ready);
+}
+
+/* write everything that has been logged */
+void log_close(void) {
+	if (!log_running)
+		return;
+
+	__atomic_store_n(&log_stop, true, __ATOMIC_RELEASE);
+	sem_post(&log_ready);
+	pthread_join(log_tid, NULL);
+	sem_destroy(&log_ready);
+	log_running = false;
+
+	log_drain();
+}
+#endif
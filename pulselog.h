@@ -0,0 +1,22 @@
+/* Asynchronous logging, enabled with -DVERBOSE
+ *
+ * Messages are formatted into a ring buffer by the (single) logging
+ * thread and written to stdout or syslog by a background thread at
+ * normal priority, so a slow terminal, pipe or syslog daemon never
+ * delays the caller. Messages are dropped if the ring buffer is full
+ * and the number dropped is logged when there is space again.
+ *
+ * Messages logged before log_open() are kept until it is called,
+ * it must be called after forking.
+ */
+#define LOG_RING 1024
+#define LOG_LINE 256
+
+#ifdef VERBOSE
+void log_open(bool use_syslog);
+void log_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void log_close(void);
+#else
+# define log_open(use_syslog) do { (void)(use_syslog); } while(0)
+# define log_close() do { } while(0)
+#endif
@@ -3,58 +3,188 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <linux/serial.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <mqueue.h>
 #include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "pulsemon.h"
+#include "pulselog.h"
+#include "pulsemon_sched.h"
 #include "pulseq.h"
+#include "pulsepair.h"
+#include "pulsetrace.h"
+
+struct hist {
+	const char *name;
+	unsigned long count;
+	unsigned long long min, max, total;
+	unsigned long bucket[HIST_BUCKETS];
+};
 
 char *device;
 char *mqueue;
+char *cpus = NULL;
+int policy = SCHED_FIFO;
+int priority = -1;
+unsigned long dl_runtime, dl_deadline, dl_period;
+char *stats_file = NULL;
+bool synthesise = false;
+bool coalesce = false;
+bool hint = false;
+struct pulse_pair pair;
 int fd;
 mqd_t q;
+bool icount = true;
+long icount_balance = 0;
+unsigned long missed_edges = 0;
+struct timeval woken_tv;
+struct hist wakeup_hist = { .name = "wakeup latency" };
+struct hist jitter_hist = { .name = "check jitter" };
+volatile sig_atomic_t stats_requested = 0;
+
+static void handle_signal(int sig) {
+	(void)sig;
+	stats_requested = 1;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [-a cpus] [-s fifo|rr|other|deadline] [-p priority] [-d runtime,deadline,period] [-H stats file] [-S] [-C [-O]] <device> <mqueue>\n", name);
+	exit(EXIT_FAILURE);
+}
 
 static void setup(int argc, char *argv[]) {
-	if (argc != 3) {
-		printf("Usage: %s <device> <mqueue>\n", argv[0]);
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:s:p:d:H:SCO")) != -1) {
+		switch (opt) {
+		case 'a':
+			cpus = optarg;
+			break;
+
+		case 's':
+			policy = pulse_sched_parse(optarg);
+			if (policy < 0)
+				usage(argv[0]);
+			break;
+
+		case 'p':
+			priority = atoi(optarg);
+			break;
+
+		case 'd':
+			if (sscanf(optarg, "%lu,%lu,%lu", &dl_runtime, &dl_deadline, &dl_period) != 3)
+				usage(argv[0]);
+			break;
+
+		case 'H':
+			stats_file = optarg;
+			break;
+
+		case 'S':
+			synthesise = true;
+			break;
+
+		case 'C':
+			coalesce = true;
+			break;
+
+		case 'O':
+			coalesce = true;
+			hint = true;
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	if (policy == SCHED_DEADLINE && dl_runtime == 0)
+		usage(argv[0]);
+
+	/* the kernel rejects deadline tasks with an affinity narrower
+	 * than their root domain, use an exclusive cpuset instead
+	 */
+	if (policy == SCHED_DEADLINE && cpus != NULL) {
+		fprintf(stderr, "Deadline scheduling can't be used with a CPU affinity (-a), use a cpuset instead\n");
 		exit(EXIT_FAILURE);
 	}
 
-	device = argv[1];
-	mqueue = argv[2];
+	device = argv[optind];
+	mqueue = argv[optind + 1];
 }
 
 static void init_root(void) {
-	if (geteuid() == 0) {
-		struct sched_param schedp;
+	if (cpus != NULL)
+		pulse_sched_affinity(cpus);
 
+	if (geteuid() == 0) {
 		cerror("Failed to lock memory pages", mlockall(MCL_CURRENT | MCL_FUTURE));
-		cerror("Failed to get max scheduler priority", (schedp.sched_priority = sched_get_priority_max(SCHED_FIFO)) < 0);
-		schedp.sched_priority -= 20;
-		cerror("Failed to set scheduler policy", sched_setscheduler(0, SCHED_FIFO, &schedp));
+
+		if (policy == SCHED_DEADLINE) {
+			pulse_sched_deadline(dl_runtime, dl_deadline, dl_period);
+		} else {
+			if (priority < 0 && (policy == SCHED_FIFO || policy == SCHED_RR)) {
+				cerror("Failed to get max scheduler priority", (priority = sched_get_priority_max(policy)) < 0);
+				priority -= 20;
+			} else if (priority < 0) {
+				priority = 0;
+			}
+			pulse_sched_policy(policy, priority);
+		}
+
 		cerror("Failed to drop SGID permissions", setregid(getgid(), getgid()));
 		cerror("Failed to drop SUID permissions", setreuid(getuid(), getuid()));
 	}
 }
 
+static void init_signals(void) {
+	struct sigaction sa = {
+		.sa_handler = handle_signal,
+		.sa_flags = 0 /* interrupt TIOCMIWAIT */
+	};
+
+	cerror("sigemptyset", sigemptyset(&sa.sa_mask) != 0);
+	cerror("sigaction SIGUSR1", sigaction(SIGUSR1, &sa, NULL) != 0);
+}
+
+static void report_span(void *ctx, const pulse_span_t *span) {
+	(void)ctx;
+
+	_printf("%lu.%06u: %d +%lluus\n", (unsigned long int)span->tv.tv_sec, (unsigned int)span->tv.tv_usec, span->on, (unsigned long long)span->duration);
+	if (mq_send(q, (const char *)span, sizeof(*span), 0) != 0 && errno != EAGAIN)
+		perror(mqueue);
+}
+
 static void init(void) {
 	struct mq_attr q_attr = {
 		.mq_flags = 0,
 		.mq_maxmsg = 4096,
-		.mq_msgsize = sizeof(pulse_t)
+		.mq_msgsize = sizeof(pulse_span_t)
 	};
+	struct serial_icounter_struct icounter;
 #if (SERIO_OUT|SERIO_OFF) != 0
 	int state;
 #endif
 
+	/* before changing the scheduling policy of this thread */
+	log_open(false);
+
 	init_root();
+	init_signals();
+	trace_open();
 
 	fd = open(device, O_RDONLY|O_NONBLOCK);
 	cerror(device, fd < 0);
@@ -70,8 +200,22 @@ static void init(void) {
 	cerror("Failed to set serial IO status", ioctl(fd, TIOCMSET, &state) != 0);
 #endif
 
+	if (ioctl(fd, TIOCGICOUNT, &icounter) != 0) {
+		perror("Failed to get serial interrupt counters, missed edges will not be detected");
+		icount = false;
+	}
+
 	q = mq_open(mqueue, O_WRONLY|O_NONBLOCK|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP, &q_attr);
 	cerror(mqueue, q < 0);
+
+	/* an existing queue keeps its message size */
+	cerror(mqueue, mq_getattr(q, &q_attr) != 0);
+	if (coalesce && q_attr.mq_msgsize < (long)sizeof(pulse_span_t)) {
+		fprintf(stderr, "%s: Message size %ld is too small for completed pulses (-C), remove the queue\n", mqueue, q_attr.mq_msgsize);
+		exit(EXIT_FAILURE);
+	}
+
+	pulse_pair_init(&pair, hint, report_span, NULL);
 }
 
 static void daemon(void) {
@@ -87,57 +231,234 @@ static void daemon(void) {
 #endif
 }
 
-static void report(bool on) {
+static void report(struct timeval tv, bool on) {
 	pulse_t pulse;
 
-	gettimeofday(&pulse.tv, NULL);
+	pulse.tv = tv;
 	pulse.on = on;
 
+	trace_event(TRACE_EDGE, pulse.tv, pulse.on);
+	if (coalesce) {
+		/* send completed pulses instead of edges */
+		pulse_pair_edge(&pair, tv, on);
+		return;
+	}
+
 	_printf("%lu.%06u: %d\n", (unsigned long int)pulse.tv.tv_sec, (unsigned int)pulse.tv.tv_usec, pulse.on);
 	mq_send(q, (const char *)&pulse, sizeof(pulse), 0);
 }
 
+static bool line_on(int state) {
+#if INVERT
+	return state == 0;
+#else
+	return state != 0;
+#endif
+}
+
+/* compare the number of transitions counted by the driver
+ * with the number of transitions seen since the last check
+ *
+ * a transition that occurs between reading the counters and
+ * the status will be counted next time, so the difference
+ * is kept until there are enough for a whole pulse
+ */
+static void reconcile(unsigned int transitions, bool changed, bool on, struct timeval from, struct timeval to) {
+	unsigned long long start, window;
+	int edges, i;
+
+	icount_balance += (long)transitions - (changed ? 1 : 0);
+	if (icount_balance < 2)
+		return;
+
+	/* the missed edges always occur in pairs, before any seen transition */
+	edges = icount_balance & ~1L;
+	icount_balance -= edges;
+	missed_edges += edges;
+	trace_event(TRACE_MISSED, TRACE_NO_EDGE, edges);
+
+	if (!synthesise) {
+		_printf("missed %d edges\n", edges);
+		return;
+	}
+
+	/* spread them evenly since the previous check or wakeup */
+	start = tv_to_ull(from);
+	window = tv_to_ull(to) - start;
+	for (i = 0; i < edges; i++) {
+		unsigned long long ts = start + window * (i + 1) / (edges + 1);
+		struct timeval tv = { .tv_sec = ts / 1000000, .tv_usec = ts % 1000000 };
+
+		report(tv, i % 2 == 0 ? !on : on);
+	}
+}
+
 static bool check(void) {
 	static bool first = true;
 	static int last;
+	static unsigned int last_icount;
+	static struct timeval last_tv;
+	struct serial_icounter_struct icounter;
+	struct timeval tv;
 	bool changed = false;
 	int state;
 
+	/* the first check after waiting for a transition only
+	 * covers the time since the wait returned
+	 */
+	if (tv_to_ull(woken_tv) > tv_to_ull(last_tv))
+		last_tv = woken_tv;
+
+	if (icount)
+		cerror("Failed to get serial interrupt counters", ioctl(fd, TIOCGICOUNT, &icounter) != 0);
 	cerror("Failed to get serial IO status", ioctl(fd, TIOCMGET, &state) != 0);
+	gettimeofday(&tv, NULL);
 	state &= SERIO_IN;
 
 	if (first) {
 		first = false;
 	} else {
-		if (last != state) {
-			changed = true;
-#if INVERT
-			report(state == 0);
-#else
-			report(state != 0);
-#endif
-		}
+		changed = (last != state);
+
+		if (icount)
+			reconcile((unsigned int)icounter.SERIO_ICOUNT - last_icount, changed, line_on(last), last_tv, tv);
+
+		if (changed)
+			report(tv, line_on(state));
+		else if (coalesce)
+			pulse_pair_time(&pair, tv);
 	}
 
 	last = state;
+	if (icount)
+		last_icount = icounter.SERIO_ICOUNT;
+	last_tv = tv;
+	trace_event(TRACE_CHECK, TRACE_NO_EDGE, changed);
 	return changed;
 }
 
 static bool wait(void) {
 	bool ok = ioctl(fd, TIOCMIWAIT, SERIO_IN) == 0;
+	gettimeofday(&woken_tv, NULL);
+	trace_event(TRACE_WAKEUP, TRACE_NO_EDGE, 0);
+	if (!ok && errno == EINTR)
+		return true;
 	if (!ok)
 		perror("Failed to wait for serial IO status");
 	return ok;
 }
 
+static unsigned long long ts_to_ull(const struct timespec *ts) {
+	return (unsigned long long)ts->tv_sec * 1000000 + (unsigned long long)ts->tv_nsec / 1000;
+}
+
+static void hist_add(struct hist *h, unsigned long long value) {
+	int i = 0;
+
+	while (i < HIST_BUCKETS - 1 && value >= (1ULL << i))
+		i++;
+
+	if (h->count == 0 || value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+	h->total += value;
+	h->count++;
+	h->bucket[i]++;
+}
+
+static void hist_print(FILE *f, const struct hist *h) {
+	int i;
+
+	fprintf(f, "%s (µs): count %lu min %llu avg %llu max %llu\n", h->name, h->count,
+		h->min, h->count ? h->total / h->count : 0, h->max);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (h->bucket[i] == 0)
+			continue;
+
+		if (i == 0)
+			fprintf(f, "  %10u-%-10u %lu\n", 0, 1, h->bucket[i]);
+		else if (i == HIST_BUCKETS - 1)
+			fprintf(f, "  %10llu+%-10s %lu\n", 1ULL << (i - 1), "", h->bucket[i]);
+		else
+			fprintf(f, "  %10llu-%-10llu %lu\n", 1ULL << (i - 1), 1ULL << i, h->bucket[i]);
+	}
+}
+
+static void stats(void) {
+	FILE *f = stdout;
+
+	if (!stats_requested)
+		return;
+	stats_requested = 0;
+
+	if (stats_file != NULL) {
+		f = fopen(stats_file, "w");
+		if (f == NULL) {
+			perror(stats_file);
+			return;
+		}
+	}
+
+	hist_print(f, &wakeup_hist);
+	hist_print(f, &jitter_hist);
+	if (icount)
+		fprintf(f, "missed edges: %lu (%s)\n", missed_edges, synthesise ? "synthesised" : "flagged");
+	else
+		fprintf(f, "missed edges: unknown\n");
+
+	if (f == stdout)
+		fflush(f);
+	else if (fclose(f) != 0)
+		perror(stats_file);
+}
+
+/* sleep until the next check is due, measuring how late
+ * the process is woken up and the interval between checks
+ */
+static void check_sleep(struct timespec *next, unsigned long long *last) {
+	struct timespec now;
+	unsigned long long target, woken;
+
+	next->tv_nsec += CHECK_INTERVAL * 1000;
+	while (next->tv_nsec >= 1000000000) {
+		next->tv_nsec -= 1000000000;
+		next->tv_sec++;
+	}
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) == EINTR)
+		stats();
+
+	cerror("clock_gettime", clock_gettime(CLOCK_MONOTONIC, &now) != 0);
+	target = ts_to_ull(next);
+	woken = ts_to_ull(&now);
+
+	hist_add(&wakeup_hist, woken - target);
+	hist_add(&jitter_hist, woken - *last > CHECK_INTERVAL
+		? woken - *last - CHECK_INTERVAL : CHECK_INTERVAL - (woken - *last));
+	*last = woken;
+}
+
 static void loop(void) {
 	do {
-		while (check())
-			usleep(CHECK_INTERVAL);
+		struct timespec next;
+		unsigned long long last;
+
+		stats();
+
+		cerror("clock_gettime", clock_gettime(CLOCK_MONOTONIC, &next) != 0);
+		last = ts_to_ull(&next);
+
+		/* keep checking until the current pulse
+		 * has been reported when coalescing
+		 */
+		while (check() || (coalesce && pulse_pair_pending(&pair)))
+			check_sleep(&next, &last);
 	} while (wait());
 }
 
 static void cleanup(void) {
+	trace_close();
 	cerror(device, close(fd));
 	cerror(mqueue, mq_close(q));
 }
@@ -9,12 +9,20 @@
 #define SERIO_OFF (0)
 #define SERIO_IN  (TIOCM_DSR)
 
+/* Driver transition counter for SERIO_IN (TIOCGICOUNT) */
+#define SERIO_ICOUNT dsr
+
 #define xerror(msg) do { perror(msg); exit(EXIT_FAILURE); } while(0)
 #define cerror(msg, expr) do { if (expr) xerror(msg); } while(0)
 
+#define tv_to_ull(x) (unsigned long long)((unsigned long long)(x).tv_sec*1000000 + (unsigned long long)(x).tv_usec)
+
 /* Check the status 5000µs later */
 #define CHECK_INTERVAL 5000
 
+/* Latency histograms have power of 2 buckets from 1µs to 2^22µs */
+#define HIST_BUCKETS 24
+
 #define INVERT 1
 
 #ifdef FORK
@@ -22,7 +30,7 @@
 #endif
 
 #ifdef VERBOSE
-# define _printf(...) printf(__VA_ARGS__)
+# define _printf(...) log_printf(__VA_ARGS__)
 #else
 # define _printf(...) do { } while(0)
 #endif
@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pulsemon.h"
+#include "pulsemon_sched.h"
+
+/* glibc has no wrapper for sched_setattr() */
+struct pulse_sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+int pulse_sched_parse(const char *value) {
+	if (!strcmp(value, "fifo"))
+		return SCHED_FIFO;
+	if (!strcmp(value, "rr"))
+		return SCHED_RR;
+	if (!strcmp(value, "other"))
+		return SCHED_OTHER;
+	if (!strcmp(value, "deadline"))
+		return SCHED_DEADLINE;
+	return -1;
+}
+
+/* cpus: comma separated list of CPUs or ranges, e.g. "1,3-4" */
+void pulse_sched_affinity(const char *cpus) {
+	const char *pos = cpus;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	do {
+		char *end;
+		long first, last;
+
+		errno = 0;
+		first = last = strtol(pos, &end, 10);
+		if (errno == 0 && end != pos && *end == '-') {
+			pos = end + 1;
+			last = strtol(pos, &end, 10);
+		}
+
+		if (errno != 0 || end == pos || (*end != ',' && *end != '\0') || first < 0 || last < first || last >= CPU_SETSIZE) {
+			errno = EINVAL;
+			xerror(cpus);
+		}
+
+		for (; first <= last; first++)
+			CPU_SET(first, &set);
+
+		pos = end + 1;
+	} while (pos[-1] != '\0');
+
+	cerror("Failed to set CPU affinity", sched_setaffinity(0, sizeof(set), &set));
+}
+
+void pulse_sched_policy(int policy, int priority) {
+	struct sched_param schedp = { .sched_priority = priority };
+
+	cerror("Failed to set scheduler policy", sched_setscheduler(0, policy, &schedp));
+}
+
+/* runtime, deadline and period in µs */
+void pulse_sched_deadline(unsigned long runtime, unsigned long deadline, unsigned long period) {
+	struct pulse_sched_attr attr = {
+		.size = sizeof(attr),
+		.sched_policy = SCHED_DEADLINE,
+		.sched_runtime = (uint64_t)runtime * 1000,
+		.sched_deadline = (uint64_t)deadline * 1000,
+		.sched_period = (uint64_t)period * 1000
+	};
+
+	cerror("Failed to set deadline scheduler policy", syscall(SYS_sched_setattr, 0, &attr, 0));
+}
@@ -0,0 +1,8 @@
+#ifndef SCHED_DEADLINE
+# define SCHED_DEADLINE 6
+#endif
+
+int pulse_sched_parse(const char *value);
+void pulse_sched_affinity(const char *cpus);
+void pulse_sched_policy(int policy, int priority);
+void pulse_sched_deadline(unsigned long runtime, unsigned long deadline, unsigned long period);
@@ -0,0 +1,129 @@
+#include <sys/time.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "pulsenet.h"
+
+void net_put32(uint8_t *buf, uint32_t value) {
+	int i;
+
+	for (i = 3; i >= 0; i--, value >>= 8)
+		buf[i] = value & 0xFF;
+}
+
+void net_put64(uint8_t *buf, uint64_t value) {
+	int i;
+
+	for (i = 7; i >= 0; i--, value >>= 8)
+		buf[i] = value & 0xFF;
+}
+
+uint32_t net_get32(const uint8_t *buf) {
+	uint32_t value = 0;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		value = (value << 8) | buf[i];
+	return value;
+}
+
+uint64_t net_get64(const uint8_t *buf) {
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		value = (value << 8) | buf[i];
+	return value;
+}
+
+static size_t put_varint(uint8_t *buf, uint64_t value) {
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		buf[len++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	buf[len++] = value;
+	return len;
+}
+
+static bool get_varint(const uint8_t *buf, size_t len, size_t *pos, uint64_t *value) {
+	int shift;
+
+	*value = 0;
+	for (shift = 0; shift < 64 && *pos < len; shift += 7) {
+		uint8_t byte = buf[(*pos)++];
+
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static uint64_t edge_us(const struct net_edge *edge) {
+	return (uint64_t)edge->tv.tv_sec * 1000000 + edge->tv.tv_usec;
+}
+
+size_t net_encode(uint8_t *buf, const struct net_edge *edges, unsigned int count) {
+	uint64_t prev = 0;
+	size_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		uint64_t ts = edge_us(&edges[i]);
+		int64_t delta = (int64_t)(ts - prev);
+
+		/* zigzag so that resets (time 0) are small too */
+		len += put_varint(&buf[len], ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+		len += put_varint(&buf[len], (edges[i].on ? NET_FLAG_ON : 0) | (edges[i].span ? NET_FLAG_SPAN : 0));
+		if (edges[i].span)
+			len += put_varint(&buf[len], edges[i].duration);
+		prev = ts;
+	}
+	return len;
+}
+
+bool net_decode(const uint8_t *buf, size_t len, struct net_edge *edges, unsigned int count) {
+	uint64_t prev = 0;
+	size_t pos = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		uint64_t zigzag, flags, ts;
+
+		if (!get_varint(buf, len, &pos, &zigzag) || !get_varint(buf, len, &pos, &flags))
+			return false;
+
+		ts = prev + (uint64_t)((int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1));
+		edges[i].tv.tv_sec = ts / 1000000;
+		edges[i].tv.tv_usec = ts % 1000000;
+		edges[i].on = (flags & NET_FLAG_ON) != 0;
+		edges[i].span = (flags & NET_FLAG_SPAN) != 0;
+		edges[i].duration = 0;
+		if (edges[i].span && !get_varint(buf, len, &pos, &edges[i].duration))
+			return false;
+		prev = ts;
+	}
+	return pos == len;
+}
+
+bool net_write(int fd, const void *buf, size_t len) {
+	const uint8_t *data = buf;
+
+	while (len > 0) {
+		ssize_t ret = write(fd, data, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+
+		data += ret;
+		len -= ret;
+	}
+	return true;
+}
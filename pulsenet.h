@@ -0,0 +1,47 @@
+/* Forwarding protocol between pulsefwd and pulserecv
+ *
+ * All integers are big-endian
+ *
+ * Hello (forwarder):  'H', version, name length, name of the receiver's mqueue
+ * Ack (receiver):     'A', u64 sequence number of the last edge received
+ * Batch (forwarder):  'B', u64 sequence number of the first edge, u32 count, u32 length, edges
+ *
+ * Edges are sequence numbered consecutively. Each edge is encoded as
+ * a zigzag varint of the time since the previous edge in the batch (µs),
+ * a varint of flags and a varint of the duration for completed pulses
+ */
+#define NET_VERSION 1
+
+#define NET_HELLO 'H'
+#define NET_ACK 'A'
+#define NET_BATCH 'B'
+
+#define NET_HELLO_SIZE 3
+#define NET_ACK_SIZE 9
+#define NET_BATCH_SIZE 17
+
+#define NET_FLAG_ON 1
+#define NET_FLAG_SPAN 2
+
+/* Maximum number of edges in a batch */
+#define NET_BATCH_MAX 1024
+
+/* Maximum encoded size of an edge */
+#define NET_EDGE_MAX 21
+
+#define NET_NAME_MAX 255
+
+struct net_edge {
+	struct timeval tv;
+	bool on;
+	bool span;
+	uint64_t duration;
+};
+
+void net_put32(uint8_t *buf, uint32_t value);
+void net_put64(uint8_t *buf, uint64_t value);
+uint32_t net_get32(const uint8_t *buf);
+uint64_t net_get64(const uint8_t *buf);
+size_t net_encode(uint8_t *buf, const struct net_edge *edges, unsigned int count);
+bool net_decode(const uint8_t *buf, size_t len, struct net_edge *edges, unsigned int count);
+bool net_write(int fd, const void *buf, size_t len);
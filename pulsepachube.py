@@ -90,12 +90,13 @@ if __name__ == "__main__":
 
 	parser = argparse.ArgumentParser(description='Update pachube with gas meter pulses')
 	parser.add_argument('-d', '--daemon', action='store_true', help='Run in the background')
+	parser.add_argument('-S', '--shards', metavar='FILE', help='Shard file with the database of each meter')
 	parser.add_argument('meter', help='Meter identifier')
 	parser.add_argument('feed', help='Pachube feed')
 	parser.add_argument('data', help='Pachube data stream prefix')
 	args = parser.parse_args()
 
-	db = pulselib.DB()
+	db = pulselib.Shards(args.shards).db(args.meter) if args.shards else pulselib.DB()
 	pachube = PulsePachube(db, args.meter, args.feed, args.data)
 
 	if args.daemon:
@@ -0,0 +1,91 @@
+#include <sys/time.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pulseq.h"
+#include "pulsepair.h"
+
+static uint64_t elapsed(struct timeval from, struct timeval to) {
+	uint64_t start = (uint64_t)from.tv_sec * 1000000 + from.tv_usec;
+	uint64_t end = (uint64_t)to.tv_sec * 1000000 + to.tv_usec;
+
+	return end > start ? end - start : 0;
+}
+
+/* optionally report the start of a pulse before it has finished */
+void pulse_pair_init(struct pulse_pair *p, bool hint, void (*emit)(void *ctx, const pulse_span_t *span), void *ctx) {
+	p->emit = emit;
+	p->ctx = ctx;
+	p->hint = hint;
+	p->active = false;
+	p->off = false;
+	p->hinted = false;
+}
+
+static void complete(struct pulse_pair *p) {
+	pulse_span_t span = {
+		.tv = p->start,
+		.on = true,
+		.duration = elapsed(p->start, p->stop)
+	};
+
+	/* a zero duration would look like a hint */
+	if (span.duration == 0)
+		span.duration = 1;
+
+	p->emit(p->ctx, &span);
+	p->active = false;
+	p->off = false;
+}
+
+void pulse_pair_edge(struct pulse_pair *p, struct timeval tv, bool on) {
+	/* complete the previous pulse if the gap is long enough */
+	pulse_pair_time(p, tv);
+
+	if (!p->active) {
+		if (on) { /* new on pulse */
+			p->active = true;
+			p->off = false;
+			p->hinted = false;
+			p->start = tv;
+		} else { /* discard unknown off pulse */ }
+	} else if (!p->off) {
+		if (!on) {
+			if (elapsed(p->start, tv) < MIN_PULSE) { /* discard short on+off pulse */
+				p->active = false;
+			} else { /* off pulse, wait for the gap */
+				p->off = true;
+				p->stop = tv;
+			}
+		} else { /* duplicate on pulse */ }
+	} else {
+		if (on) { /* resume interrupted pulse */
+			p->off = false;
+		} else { /* duplicate off pulse */ }
+	}
+}
+
+void pulse_pair_time(struct pulse_pair *p, struct timeval now) {
+	if (!p->active)
+		return;
+
+	if (p->off) {
+		if (elapsed(p->stop, now) >= MIN_PULSE)
+			complete(p);
+	} else if (p->hint && !p->hinted && elapsed(p->start, now) >= MIN_PULSE) {
+		pulse_span_t span = {
+			.tv = p->start,
+			.on = true,
+			.duration = 0
+		};
+
+		p->emit(p->ctx, &span);
+		p->hinted = true;
+	}
+}
+
+/* time needs to be advanced to complete a pulse or report the start of one */
+bool pulse_pair_pending(const struct pulse_pair *p) {
+	return p->active && (p->off || (p->hint && !p->hinted));
+}
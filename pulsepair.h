@@ -0,0 +1,23 @@
+/* Pairs on and off edges into completed pulses, applying the
+ * same rules as pulsedb:
+ *
+ * An on+off pulse shorter than MIN_PULSE is noise and ignored
+ * An off+on gap shorter than MIN_PULSE resumes the pulse
+ *
+ * A pulse is only complete when it has been off for MIN_PULSE
+ */
+struct pulse_pair {
+	void (*emit)(void *ctx, const pulse_span_t *span);
+	void *ctx;
+	bool hint;
+	bool active;
+	bool off;
+	bool hinted;
+	struct timeval start;
+	struct timeval stop;
+};
+
+void pulse_pair_init(struct pulse_pair *p, bool hint, void (*emit)(void *ctx, const pulse_span_t *span), void *ctx);
+void pulse_pair_edge(struct pulse_pair *p, struct timeval tv, bool on);
+void pulse_pair_time(struct pulse_pair *p, struct timeval now);
+bool pulse_pair_pending(const struct pulse_pair *p);
@@ -1,4 +1,26 @@
+/* Avoid false pulses caused by electricity noise at 50/60Hz
+ * 1s / 50Hz + 10% = 22000µs
+ * 1s / 60Hz + 10% = 18333µs
+ */
+#define MIN_PULSE 22000
+
 typedef struct {
 	struct timeval tv;
 	bool on;
 } __attribute__((__packed__)) pulse_t;
+
+/* Completed pulse (duration > 0) or the start of
+ * a pulse that has lasted at least MIN_PULSE (duration 0)
+ *
+ * The main queue may contain both types of message
+ */
+typedef struct {
+	struct timeval tv;
+	bool on;
+	uint64_t duration;
+} __attribute__((__packed__)) pulse_span_t;
+
+/* Suffix of the shared memory object used by a pair of pulsedb
+ * processes for the same main queue, to pass on the FSM state
+ */
+#define PAIR_STATE ".pair"
@@ -0,0 +1,602 @@
+#include <sys/time.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <postgresql/libpq-fe.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pulsefwd_log.h"
+#include "pulsenet.h"
+#include "pulseq.h"
+#include "pulsepair.h"
+#include "pulserecon.h"
+#include "pulseshard.h"
+
+#define SQL_TS(value) "(to_timestamp(0) + " value "::bigint * interval '1 microsecond')"
+#define SQL_US(col) "(extract(epoch FROM " col ") * 1000000)::bigint"
+
+/* start and stop in µs of the pulses in a range, except
+ * in intervals that have been counted instead
+ * ($1 meter, $2 from, $3 to, %s table, %s count table)
+ */
+#define SQL_PULSES \
+	"SELECT " SQL_US("start") " AS s, COALESCE(" SQL_US("stop") ", 0) AS e FROM %s AS p" \
+	" WHERE meter = $1 AND start >= " SQL_TS("$2") " AND start < " SQL_TS("$3") \
+	" AND NOT EXISTS (SELECT 1 FROM %s AS c WHERE c.meter = p.meter AND p.start >= c.start AND p.start < c.stop)"
+
+#define P STR(RECON_PRIME)
+
+/* count and hash of each part of a range ($4 width) */
+#define SQL_RANGES \
+	"SELECT (s - $2::bigint) / $4::bigint AS b, COUNT(*), SUM((h * h %% " P " + h * " STR(RECON_MIX) ") %% " P ") %% " P \
+	" FROM (SELECT s, ((s %% " P ") * " STR(RECON_MUL) " + e %% " P ") %% " P " AS h FROM (" SQL_PULSES ") AS p) AS p GROUP BY b"
+
+#define SQL_PULSES_ORDERED SQL_PULSES " ORDER BY start"
+
+/* pulses before this have been compacted into counts ($1 meter, $2 table) */
+#define SQL_COMPACTED \
+	"SELECT " SQL_US("compacted") " FROM meters WHERE id = $1 AND $2::regclass = 'pulses'::regclass"
+
+/* counted intervals overlapping a range ($1 meter, $2 from, $3 to, %s count table) */
+#define SQL_COUNTED \
+	"SELECT " SQL_US("start") ", " SQL_US("stop") " FROM %s" \
+	" WHERE meter = $1 AND stop > " SQL_TS("$2") " AND start < " SQL_TS("$3") " ORDER BY start"
+
+/* $1 table, $2 start */
+#define SQL_PARTITIONS \
+	"SELECT partition_ensure($1::regclass, m) FROM (SELECT DISTINCT date_trunc('month', " SQL_TS("s") ") AS m FROM unnest($2::bigint[]) AS s) AS months"
+
+/* $1 meter, $2 start, $3 stop */
+#define SQL_DELETE "DELETE FROM %s WHERE meter = $1 AND start IN (SELECT " SQL_TS("s") " FROM unnest($2::bigint[]) AS s)"
+#define SQL_UPDATE "UPDATE %s AS p SET stop = " SQL_TS("u.e") " FROM unnest($2::bigint[], $3::bigint[]) AS u(s, e) WHERE p.meter = $1 AND p.start = " SQL_TS("u.s")
+#define SQL_INSERT "INSERT INTO %s (meter, start, stop) SELECT $1::integer, " SQL_TS("u.s") ", " SQL_TS("u.e") " FROM unnest($2::bigint[], $3::bigint[]) AS u(s, e)"
+
+struct span {
+	int64_t start;
+	int64_t stop;
+};
+
+struct spans {
+	struct span *data;
+	size_t len;
+	size_t size;
+};
+
+const char *conninfo = NULL;
+char *shard_file = NULL;
+struct shards shards;
+const char *table = "pulses";
+const char *count_table = "pulse_counts";
+bool dry_run = false;
+int64_t from = -1;
+int64_t to = -1;
+int64_t compacted = INT64_MIN;
+char *log_file;
+char *meter;
+PGconn *conn;
+char *table_sql;
+char *count_sql;
+
+/* captured pulses in order, with the prefix sums of their hashes */
+struct spans local;
+uint64_t *prefix;
+
+struct spans inserts, updates, deletes;
+
+struct {
+	unsigned long queries;
+	unsigned long ranges;
+	unsigned long mismatched;
+	unsigned long fetched;
+	unsigned long counted;
+} stats;
+
+static void usage(const char *name) {
+	printf("Usage: %s [-c conninfo | -S shard file] [-T table] [-C count table] [-n] [-f from] [-t to] <log file> <meter>\n", name);
+	exit(EXIT_FAILURE);
+}
+
+/* seconds[.µs] */
+static int64_t parse_time(const char *value) {
+	char *end = NULL;
+	double secs;
+
+	errno = 0;
+	secs = strtod(value, &end);
+	cerror(value, errno != 0);
+
+	errno = EINVAL;
+	cerror(value, value[0] == '\0' || end[0] != '\0' || secs < 0);
+	return (int64_t)(secs * 1000000 + 0.5);
+}
+
+static void setup(int argc, char *argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:S:T:C:nf:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			conninfo = optarg;
+			break;
+
+		case 'S':
+			shard_file = optarg;
+			break;
+
+		case 'T':
+			table = optarg;
+			break;
+
+		case 'C':
+			count_table = optarg;
+			break;
+
+		case 'n':
+			dry_run = true;
+			break;
+
+		case 'f':
+			from = parse_time(optarg);
+			break;
+
+		case 't':
+			to = parse_time(optarg);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 2 || (conninfo != NULL && shard_file != NULL))
+		usage(argv[0]);
+
+	log_file = argv[optind];
+	meter = argv[optind + 1];
+}
+
+/* use the database of the shard for this meter */
+static void setup_shard(void) {
+	const struct shard *shard;
+	int ret;
+
+	ret = shard_load(shard_file, &shards);
+	cerror(shard_file, ret < 0);
+	if (ret > 0) {
+		fprintf(stderr, "%s:%d: Invalid shard\n", shard_file, ret);
+		exit(EXIT_FAILURE);
+	}
+
+	shard = shard_find(&shards, strtoul(meter, NULL, 10));
+	if (shard == NULL) {
+		fprintf(stderr, "%s: No shard for meter %s\n", shard_file, meter);
+		exit(EXIT_FAILURE);
+	}
+
+	conninfo = shard->conninfo;
+}
+
+static uint64_t pulse_hash(int64_t start, int64_t stop) {
+	uint64_t h = ((start % RECON_PRIME) * RECON_MUL + stop % RECON_PRIME) % RECON_PRIME;
+
+	return (h * h % RECON_PRIME + h * RECON_MIX) % RECON_PRIME;
+}
+
+static void spans_add(struct spans *s, int64_t start, int64_t stop) {
+	if (s->len == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		s->data = realloc(s->data, s->size * sizeof(*s->data));
+		cerror("realloc", s->data == NULL);
+	}
+
+	s->data[s->len].start = start;
+	s->data[s->len].stop = stop;
+	s->len++;
+}
+
+static int64_t tv_to_us(struct timeval tv) {
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void add_local(void *ctx, const pulse_span_t *span) {
+	int64_t start = tv_to_us(span->tv);
+	(void)ctx;
+
+	/* ignore hints, the pulse is added when it completes */
+	if (span->duration == 0)
+		return;
+
+	/* pulsedb ignores an edge that's earlier than the previous one */
+	if (local.len > 0 && start <= local.data[local.len - 1].start)
+		return;
+
+	spans_add(&local, start, start + span->duration);
+}
+
+/* read edges from the log, pairing them in the same way as pulsedb */
+static void load_local(void) {
+	struct pulse_pair pair;
+	struct timeval now;
+	fwd_header_t header;
+	fwd_record_t record;
+	FILE *f = fopen(log_file, "r");
+
+	cerror(log_file, f == NULL);
+	cerror(log_file, fread(&header, sizeof(header), 1, f) != 1);
+
+	errno = EINVAL;
+	cerror(log_file, header.magic != FWD_MAGIC || header.size != sizeof(fwd_record_t));
+
+	pulse_pair_init(&pair, false, add_local, NULL);
+	while (fread(&record, sizeof(record), 1, f) == 1) {
+		struct timeval tv = { .tv_sec = record.sec, .tv_usec = record.usec };
+
+		if (record.flags & NET_FLAG_SPAN) {
+			pulse_span_t span = { .tv = tv, .on = true, .duration = record.duration };
+
+			add_local(NULL, &span);
+		} else {
+			pulse_pair_edge(&pair, tv, (record.flags & NET_FLAG_ON) != 0);
+		}
+	}
+	cerror(log_file, ferror(f));
+	fclose(f);
+
+	/* a pulse that ended long enough ago is complete */
+	gettimeofday(&now, NULL);
+	pulse_pair_time(&pair, now);
+
+	/* pulses that are still in progress are not compared */
+	if (local.len > 0) {
+		if (from < 0)
+			from = local.data[0].start;
+		if (to < 0)
+			to = local.data[local.len - 1].start + 1;
+	}
+}
+
+static void local_prefix(void) {
+	size_t i;
+
+	prefix = malloc((local.len + 1) * sizeof(*prefix));
+	cerror("malloc", prefix == NULL);
+
+	prefix[0] = 0;
+	for (i = 0; i < local.len; i++)
+		prefix[i + 1] = (prefix[i] + pulse_hash(local.data[i].start, local.data[i].stop)) % RECON_PRIME;
+}
+
+/* index of the first local pulse at or after ts */
+static size_t local_index(int64_t ts) {
+	size_t lo = 0, hi = local.len;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (local.data[mid].start < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void db_error(const char *what) {
+	fprintf(stderr, "%s: %s", what, PQerrorMessage(conn));
+	exit(EXIT_FAILURE);
+}
+
+/* substitute the table names into a query */
+static char *sql_table(const char *format) {
+	char *sql = malloc(strlen(format) + strlen(table_sql) + strlen(count_sql) + 1);
+
+	cerror("malloc", sql == NULL);
+	sprintf(sql, format, table_sql, count_sql);
+	return sql;
+}
+
+static void init(void) {
+	if (shard_file != NULL)
+		setup_shard();
+
+	conn = PQconnectdb(conninfo != NULL ? conninfo : "");
+	if (conn == NULL || PQstatus(conn) != CONNECTION_OK)
+		db_error("PQconnectdb");
+
+	table_sql = PQescapeIdentifier(conn, table, strlen(table));
+	if (table_sql == NULL)
+		db_error("PQescapeIdentifier");
+
+	count_sql = PQescapeIdentifier(conn, count_table, strlen(count_table));
+	if (count_sql == NULL)
+		db_error("PQescapeIdentifier");
+}
+
+static PGresult *query(const char *format, int64_t a, int64_t b, int64_t width) {
+	char param_from[32], param_to[32], param_width[32];
+	const char *param[4] = { meter, param_from, param_to, param_width };
+	char *sql = sql_table(format);
+	PGresult *res;
+
+	snprintf(param_from, sizeof(param_from), "%lld", (long long)a);
+	snprintf(param_to, sizeof(param_to), "%lld", (long long)b);
+	snprintf(param_width, sizeof(param_width), "%lld", (long long)width);
+
+	res = PQexecParams(conn, sql, width > 0 ? 4 : 3, NULL, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		db_error("query");
+
+	free(sql);
+	stats.queries++;
+	return res;
+}
+
+/* the meter is locked until the end of the transaction if shared */
+static int64_t read_compacted(bool share) {
+	const char *param[2] = { meter, table };
+	PGresult *res = PQexecParams(conn, share ? SQL_COMPACTED " FOR SHARE" : SQL_COMPACTED, 2, NULL, param, NULL, NULL, 0);
+	int64_t ts = INT64_MIN;
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		db_error("query");
+	if (PQntuples(res) > 0 && !PQgetisnull(res, 0, 0))
+		ts = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+
+	PQclear(res);
+	stats.queries++;
+	return ts;
+}
+
+/* pulses that have been compacted (by pulses_compact()) are not
+ * compared, they'd be counted twice if they were inserted again
+ */
+static void skip_compacted(void) {
+	compacted = read_compacted(false);
+	if (from < compacted) {
+		printf("compacted before %lld.%06lld\n", (long long)compacted / 1000000, (long long)compacted % 1000000);
+		from = compacted;
+	}
+}
+
+/* pulses in intervals that have been counted instead (by
+ * pulsedb -i) are not compared, they'd be written twice
+ */
+static void remove_counted(void) {
+	PGresult *res;
+	char *sql, param_from[32], param_to[32];
+	const char *param[3] = { meter, param_from, param_to };
+	size_t i, len = 0;
+	int k = 0, n;
+
+	if (local.len == 0 || from >= to)
+		return;
+
+	snprintf(param_from, sizeof(param_from), "%lld", (long long)from);
+	snprintf(param_to, sizeof(param_to), "%lld", (long long)to);
+
+	/* the count table is the only one in this query */
+	sql = malloc(strlen(SQL_COUNTED) + strlen(count_sql) + 1);
+	cerror("malloc", sql == NULL);
+	sprintf(sql, SQL_COUNTED, count_sql);
+
+	res = PQexecParams(conn, sql, 3, NULL, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		db_error("query");
+	free(sql);
+	stats.queries++;
+
+	n = PQntuples(res);
+	for (i = 0; i < local.len; i++) {
+		int64_t start = local.data[i].start;
+
+		while (k < n && strtoll(PQgetvalue(res, k, 1), NULL, 10) <= start)
+			k++;
+
+		if (k < n && strtoll(PQgetvalue(res, k, 0), NULL, 10) <= start)
+			stats.counted++;
+		else
+			local.data[len++] = local.data[i];
+	}
+	local.len = len;
+
+	PQclear(res);
+}
+
+/* compare every pulse in the range */
+static void compare_pulses(int64_t a, int64_t b) {
+	PGresult *res = query(SQL_PULSES_ORDERED, a, b, 0);
+	size_t i = local_index(a), j = local_index(b);
+	int k = 0, n = PQntuples(res);
+
+	stats.fetched += n;
+	while (i < j || k < n) {
+		int64_t start = 0, stop = 0;
+
+		if (k < n) {
+			start = strtoll(PQgetvalue(res, k, 0), NULL, 10);
+			stop = strtoll(PQgetvalue(res, k, 1), NULL, 10);
+		}
+
+		if (k == n || (i < j && local.data[i].start < start)) {
+			spans_add(&inserts, local.data[i].start, local.data[i].stop);
+			i++;
+		} else if (i == j || start < local.data[i].start) {
+			spans_add(&deletes, start, stop);
+			k++;
+		} else {
+			if (stop != local.data[i].stop)
+				spans_add(&updates, start, local.data[i].stop);
+			i++;
+			k++;
+		}
+	}
+
+	PQclear(res);
+}
+
+/* compare the count and hash of each part of the range,
+ * recursing into the parts that don't match
+ */
+static void compare_ranges(int64_t a, int64_t b) {
+	unsigned long long count[RECON_FANOUT] = { 0 };
+	unsigned long long hash[RECON_FANOUT] = { 0 };
+	int64_t width = (b - a + RECON_FANOUT - 1) / RECON_FANOUT;
+	PGresult *res = query(SQL_RANGES, a, b, width);
+	int i;
+
+	for (i = 0; i < PQntuples(res); i++) {
+		int part = atoi(PQgetvalue(res, i, 0));
+
+		if (part >= 0 && part < RECON_FANOUT) {
+			count[part] = strtoull(PQgetvalue(res, i, 1), NULL, 10);
+			hash[part] = strtoull(PQgetvalue(res, i, 2), NULL, 10);
+		}
+	}
+	PQclear(res);
+
+	for (i = 0; i < RECON_FANOUT && a + i * width < b; i++) {
+		int64_t x = a + i * width;
+		int64_t y = x + width < b ? x + width : b;
+		size_t li = local_index(x), lj = local_index(y);
+
+		stats.ranges++;
+		if (count[i] == lj - li && hash[i] == (prefix[lj] + RECON_PRIME - prefix[li]) % RECON_PRIME)
+			continue;
+
+		stats.mismatched++;
+		if ((count[i] <= RECON_LEAF && lj - li <= RECON_LEAF) || y - x <= RECON_FANOUT)
+			compare_pulses(x, y);
+		else
+			compare_ranges(x, y);
+	}
+}
+
+/* PostgreSQL array of start or stop times */
+static char *spans_array(const struct spans *s, bool stop) {
+	char *buf = malloc(s->len * 21 + 3);
+	size_t i, len = 0;
+
+	cerror("malloc", buf == NULL);
+
+	buf[len++] = '{';
+	for (i = 0; i < s->len; i++)
+		len += sprintf(&buf[len], i ? ",%lld" : "%lld", (long long)(stop ? s->data[i].stop : s->data[i].start));
+	buf[len++] = '}';
+	buf[len] = 0;
+	return buf;
+}
+
+static void repair_exec(const char *format, const struct spans *s, bool stop, ExecStatusType status) {
+	char *start_array = spans_array(s, false);
+	char *stop_array = stop ? spans_array(s, true) : NULL;
+	const char *param[3] = { meter, start_array, stop_array };
+	char *sql = sql_table(format);
+	PGresult *res = PQexecParams(conn, sql, stop ? 3 : 2, NULL, param, NULL, NULL, 0);
+
+	if (PQresultStatus(res) != status)
+		db_error("repair");
+
+	PQclear(res);
+	free(sql);
+	free(stop_array);
+	free(start_array);
+}
+
+static void print_spans(const char *action, const struct spans *s) {
+	size_t i;
+
+	for (i = 0; i < s->len; i++)
+		printf("%s %lld.%06lld %lld.%06lld\n", action,
+			(long long)s->data[i].start / 1000000, (long long)s->data[i].start % 1000000,
+			(long long)s->data[i].stop / 1000000, (long long)s->data[i].stop % 1000000);
+}
+
+/* apply all of the differences in one transaction */
+static void repair(void) {
+	PGresult *res;
+
+	if (inserts.len > 0) {
+		char *start_array = spans_array(&inserts, false);
+		const char *param[2] = { table, start_array };
+
+		/* errors are ignored, like pulsedb */
+		res = PQexecParams(conn, SQL_PARTITIONS, 2, NULL, param, NULL, NULL, 0);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			fprintf(stderr, "partition_ensure: %s", PQerrorMessage(conn));
+		PQclear(res);
+		free(start_array);
+	}
+
+	res = PQexec(conn, "BEGIN");
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		db_error("BEGIN");
+	PQclear(res);
+
+	if (read_compacted(true) != compacted) {
+		fprintf(stderr, "Pulses have been compacted since they were compared\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (deletes.len > 0)
+		repair_exec(SQL_DELETE, &deletes, false, PGRES_COMMAND_OK);
+	if (updates.len > 0)
+		repair_exec(SQL_UPDATE, &updates, true, PGRES_COMMAND_OK);
+	if (inserts.len > 0)
+		repair_exec(SQL_INSERT, &inserts, true, PGRES_COMMAND_OK);
+
+	res = PQexec(conn, "COMMIT");
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		db_error("COMMIT");
+	PQclear(res);
+}
+
+static void run(void) {
+	if (local.len > 0 && from < to)
+		compare_ranges(from, to);
+
+	printf("%zu captured pulses from %lld.%06lld to %lld.%06lld\n", local.len,
+		(long long)from / 1000000, (long long)from % 1000000, (long long)to / 1000000, (long long)to % 1000000);
+	if (stats.counted > 0)
+		printf("%lu captured pulses in counted intervals\n", stats.counted);
+	printf("%lu queries, %lu ranges compared, %lu mismatched, %lu pulses fetched\n",
+		stats.queries, stats.ranges, stats.mismatched, stats.fetched);
+
+	if (dry_run) {
+		print_spans("insert", &inserts);
+		print_spans("update", &updates);
+		print_spans("delete", &deletes);
+	} else if (inserts.len > 0 || updates.len > 0 || deletes.len > 0) {
+		repair();
+	}
+
+	printf("%zu missing, %zu different, %zu extra%s\n", inserts.len, updates.len, deletes.len,
+		dry_run ? "" : (inserts.len > 0 || updates.len > 0 || deletes.len > 0 ? " (repaired)" : ""));
+}
+
+static void cleanup(void) {
+	PQfreemem(count_sql);
+	PQfreemem(table_sql);
+	PQfinish(conn);
+	free(inserts.data);
+	free(updates.data);
+	free(deletes.data);
+	free(prefix);
+	free(local.data);
+	shard_free(&shards);
+}
+
+int main(int argc, char *argv[]) {
+	setup(argc, argv);
+	load_local();
+	init();
+	skip_compacted();
+	remove_counted();
+	local_prefix();
+	run();
+	cleanup();
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,24 @@
+#define xerror(msg) do { perror(msg); exit(EXIT_FAILURE); } while(0)
+#define cerror(msg, expr) do { if (expr) xerror(msg); } while(0)
+
+#define _STR(x) #x
+#define STR(x) _STR(x)
+
+/* Ranges are split into 64 parts at each level */
+#define RECON_FANOUT 64
+
+/* Compare pulses individually when a range has at most 256 */
+#define RECON_LEAF 256
+
+/* The hash of a range is the sum modulo 2^31-1 of the hash of each
+ * (start, stop) in µs, calculated without overflow in C and SQL:
+ *
+ *   h = ((start % PRIME) * MUL + stop % PRIME) % PRIME
+ *   hash = (h * h % PRIME + h * MIX) % PRIME
+ *
+ * The squared term means that swapping stop times between
+ * pulses changes the hash. Pulses without a stop use 0.
+ */
+#define RECON_PRIME 2147483647
+#define RECON_MUL 1103515245
+#define RECON_MIX 40503
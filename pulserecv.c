@@ -0,0 +1,404 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <mqueue.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pulsenet.h"
+#include "pulseq.h"
+#include "pulserecv.h"
+
+#ifdef SYSLOG
+# include <syslog.h>
+#endif
+
+char *address = NULL;
+char *port;
+char *state_dir;
+char **mqueues;
+int mqueues_count;
+int lsock;
+struct client clients[RECV_CLIENTS];
+struct net_edge edges[NET_BATCH_MAX];
+
+static void setup(int argc, char *argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:")) != -1) {
+		switch (opt) {
+		case 'l':
+			address = optarg;
+			break;
+
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind < 3) {
+usage:
+		printf("Usage: %s [-l address] <port> <state dir> <mqueue> [mqueue...]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	port = argv[optind];
+	state_dir = argv[optind + 1];
+	mqueues = &argv[optind + 2];
+	mqueues_count = argc - optind - 2;
+
+#ifdef SYSLOG
+	openlog("pulserecv", LOG_PID, LOG_DAEMON);
+#endif
+}
+
+static void init(void) {
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE
+	};
+	struct addrinfo *res, *ai;
+	int one = 1;
+	int ret, i;
+
+	umask(0);
+
+	/* a closed connection is handled by write() */
+	cerror("signal SIGPIPE", signal(SIGPIPE, SIG_IGN) == SIG_ERR);
+
+	for (i = 0; i < RECV_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	ret = getaddrinfo(address, port, &hints, &res);
+	if (ret != 0) {
+		fprintf(stderr, "%s: %s\n", port, gai_strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+
+	lsock = -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		lsock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (lsock < 0)
+			continue;
+
+		setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(lsock, ai->ai_addr, ai->ai_addrlen) == 0 && listen(lsock, RECV_CLIENTS) == 0)
+			break;
+
+		close(lsock);
+		lsock = -1;
+	}
+	freeaddrinfo(res);
+	cerror(port, lsock < 0);
+}
+
+static char *state_file(const char *name, const char *suffix) {
+	char *file = malloc(strlen(state_dir) + strlen(name) + strlen(suffix) + 2);
+
+	cerror("malloc", file == NULL);
+
+	/* mqueue names start with a / */
+	sprintf(file, "%s/%s%s", state_dir, name[0] == '/' ? &name[1] : name, suffix);
+	return file;
+}
+
+static uint64_t state_load(const char *name) {
+	char *file = state_file(name, ".seq");
+	unsigned long long seq = 0;
+	FILE *f = fopen(file, "r");
+
+	if (f != NULL) {
+		if (fscanf(f, "%llu", &seq) != 1)
+			seq = 0;
+		fclose(f);
+	} else {
+		cerror(file, errno != ENOENT);
+	}
+
+	free(file);
+	return seq;
+}
+
+static void state_save(const char *name, uint64_t seq) {
+	char *file = state_file(name, ".seq");
+	char *tmp = state_file(name, ".seq~");
+	char buf[32];
+	int fd, len;
+
+	len = snprintf(buf, sizeof(buf), "%llu\n", (unsigned long long)seq);
+
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+	cerror(tmp, fd < 0);
+	cerror(tmp, write(fd, buf, len) != len);
+	cerror(tmp, fsync(fd) != 0);
+	cerror(tmp, close(fd) != 0);
+	cerror(file, rename(tmp, file) != 0);
+
+	free(tmp);
+	free(file);
+}
+
+static void client_close(struct client *c) {
+	if (c->name != NULL) {
+		_printf("%s: disconnected\n", c->name);
+		cerror(c->name, mq_close(c->q));
+	}
+
+	close(c->fd);
+	c->fd = -1;
+	c->name = NULL;
+	c->full = false;
+	c->len = 0;
+}
+
+static void client_accept(void) {
+	int fd = accept(lsock, NULL, NULL);
+	int i;
+
+	if (fd < 0) {
+		cerror("accept", errno != EINTR && errno != ECONNABORTED && errno != EAGAIN);
+		return;
+	}
+
+	for (i = 0; i < RECV_CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+			clients[i].fd = fd;
+			clients[i].active = time(NULL);
+			return;
+		}
+	}
+
+	_printf("too many connections\n");
+	close(fd);
+}
+
+static bool client_ack(struct client *c) {
+	uint8_t ack[NET_ACK_SIZE];
+
+	ack[0] = NET_ACK;
+	net_put64(&ack[1], c->seq);
+	return net_write(c->fd, ack, sizeof(ack));
+}
+
+/* returns the size of the message or 0 if more data is required */
+static ssize_t client_hello(struct client *c) {
+	struct mq_attr q_attr = {
+		.mq_flags = 0,
+		.mq_maxmsg = 4096,
+		.mq_msgsize = sizeof(pulse_span_t)
+	};
+	char name[NET_NAME_MAX + 1];
+	size_t len;
+	int i;
+
+	if (c->len < NET_HELLO_SIZE)
+		return 0;
+	if (c->buf[1] != NET_VERSION)
+		return -1;
+
+	len = c->buf[2];
+	if (c->len < NET_HELLO_SIZE + len)
+		return 0;
+
+	memcpy(name, &c->buf[NET_HELLO_SIZE], len);
+	name[len] = 0;
+
+	for (i = 0; i < mqueues_count; i++)
+		if (!strcmp(mqueues[i], name))
+			c->name = mqueues[i];
+	if (c->name == NULL) {
+		_printf("%s: unknown mqueue\n", name);
+		return -1;
+	}
+
+	c->q = mq_open(c->name, O_WRONLY|O_NONBLOCK|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP, &q_attr);
+	cerror(c->name, c->q < 0);
+
+	/* the forwarder has reconnected */
+	for (i = 0; i < RECV_CLIENTS; i++)
+		if (&clients[i] != c && clients[i].name == c->name)
+			client_close(&clients[i]);
+
+	c->seq = state_load(c->name);
+	_printf("%s: connected at %llu\n", c->name, (unsigned long long)c->seq);
+
+	if (!client_ack(c))
+		return -1;
+	return NET_HELLO_SIZE + len;
+}
+
+/* returns the size of the message or 0 if more data is required,
+ * or if the queue is full (the rest of the message is kept)
+ */
+static ssize_t client_batch(struct client *c) {
+	uint64_t first;
+	uint32_t count, len, i;
+
+	if (c->len < NET_BATCH_SIZE)
+		return 0;
+
+	first = net_get64(&c->buf[1]);
+	count = net_get32(&c->buf[9]);
+	len = net_get32(&c->buf[13]);
+
+	if (count > NET_BATCH_MAX || len > count * NET_EDGE_MAX || first == 0)
+		return -1;
+	if (c->len < NET_BATCH_SIZE + len)
+		return 0;
+
+	if (!net_decode(&c->buf[NET_BATCH_SIZE], len, edges, count))
+		return -1;
+
+	if (first > c->seq + 1)
+		_printf("%s: missing %llu-%llu\n", c->name, (unsigned long long)c->seq + 1, (unsigned long long)first - 1);
+
+	for (i = 0; i < count; i++) {
+		struct net_edge *edge = &edges[i];
+		pulse_span_t span;
+
+		/* already received */
+		if (first + i <= c->seq)
+			continue;
+
+		span.tv = edge->tv;
+		span.on = edge->on;
+		span.duration = edge->duration;
+
+		/* stop reading from the forwarder until there is space in the queue,
+		 * the remaining edges aren't acknowledged
+		 */
+		while (mq_send(c->q, (const char *)&span, edge->span ? sizeof(pulse_span_t) : sizeof(pulse_t), 0) != 0) {
+			cerror(c->name, errno != EINTR && errno != EAGAIN);
+			if (errno == EAGAIN) {
+				c->full = true;
+				break;
+			}
+		}
+		if (c->full)
+			break;
+	}
+
+	/* an edge may be sent again if this isn't saved, but never lost */
+	if (i > 0 && first + i - 1 > c->seq) {
+		c->seq = first + i - 1;
+		state_save(c->name, c->seq);
+	}
+
+	if (c->full)
+		_printf("%s: queue full at %llu\n", c->name, (unsigned long long)c->seq);
+	else
+		_printf("%s: received %llu-%llu\n", c->name, (unsigned long long)first, (unsigned long long)first + count - 1);
+
+	if (!client_ack(c))
+		return -1;
+	return c->full ? 0 : (ssize_t)(NET_BATCH_SIZE + len);
+}
+
+static void client_process(struct client *c) {
+	ssize_t ret;
+
+	while (c->len > 0 && !c->full) {
+		if (c->name == NULL)
+			ret = c->buf[0] == NET_HELLO ? client_hello(c) : -1;
+		else
+			ret = c->buf[0] == NET_BATCH ? client_batch(c) : -1;
+
+		if (ret < 0) {
+			_printf("%s: invalid message\n", c->name != NULL ? c->name : "client");
+			client_close(c);
+			return;
+		} else if (ret == 0) {
+			return;
+		}
+
+		c->len -= ret;
+		memmove(c->buf, &c->buf[ret], c->len);
+	}
+}
+
+static void client_read(struct client *c) {
+	ssize_t ret = read(c->fd, &c->buf[c->len], sizeof(c->buf) - c->len);
+
+	if (ret < 0 && errno == EINTR)
+		return;
+	if (ret <= 0) {
+		client_close(c);
+		return;
+	}
+
+	c->len += ret;
+	c->active = time(NULL);
+	client_process(c);
+}
+
+/* continue with the rest of the batch when there is space in the queue */
+static void client_resume(struct client *c) {
+	c->full = false;
+	c->active = time(NULL);
+	client_process(c);
+}
+
+static void loop(void) {
+	struct pollfd fds[RECV_CLIENTS + 1];
+	int i;
+
+	while (1) {
+		time_t now = time(NULL);
+
+		fds[0].fd = lsock;
+		fds[0].events = POLLIN;
+		for (i = 0; i < RECV_CLIENTS; i++) {
+			if (clients[i].fd >= 0 && now - clients[i].active >= RECV_TIMEOUT)
+				client_close(&clients[i]);
+
+			/* mqd_t is a file descriptor on Linux */
+			if (clients[i].fd >= 0 && clients[i].full) {
+				fds[i + 1].fd = clients[i].q;
+				fds[i + 1].events = POLLOUT;
+			} else {
+				fds[i + 1].fd = clients[i].fd;
+				fds[i + 1].events = POLLIN;
+			}
+		}
+
+		if (poll(fds, RECV_CLIENTS + 1, RECV_TIMEOUT * 1000) < 0) {
+			cerror("poll", errno != EINTR);
+			continue;
+		}
+
+		for (i = 0; i < RECV_CLIENTS; i++) {
+			if (clients[i].fd < 0)
+				continue;
+
+			if (clients[i].full) {
+				if (fds[i + 1].revents & (POLLOUT|POLLERR))
+					client_resume(&clients[i]);
+			} else if (fds[i + 1].revents & (POLLIN|POLLHUP|POLLERR)) {
+				client_read(&clients[i]);
+			}
+		}
+
+		if (fds[0].revents & POLLIN)
+			client_accept();
+	}
+}
+
+int main(int argc, char *argv[]) {
+	setup(argc, argv);
+	init();
+	loop();
+	exit(EXIT_FAILURE);
+}
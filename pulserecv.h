@@ -0,0 +1,35 @@
+#define xerror(msg) do { perror(msg); exit(EXIT_FAILURE); } while(0)
+#define cerror(msg, expr) do { if (expr) xerror(msg); } while(0)
+
+/* Maximum number of forwarders connected at once */
+#define RECV_CLIENTS 64
+
+/* Disconnect forwarders that are idle for 10 minutes */
+#define RECV_TIMEOUT 600
+
+#ifdef FORK
+# ifndef SYSLOG
+#  define SYSLOG
+# endif
+#endif
+
+#ifdef VERBOSE
+# if SYSLOG
+#  define _printf(...) syslog(LOG_INFO, __VA_ARGS__)
+# else
+#  define _printf(...) printf(__VA_ARGS__)
+# endif
+#else
+# define _printf(...) do { } while(0)
+#endif
+
+struct client {
+	int fd;
+	time_t active;
+	char *name;
+	mqd_t q;
+	uint64_t seq;
+	bool full; /* waiting for space in the queue */
+	size_t len;
+	uint8_t buf[NET_BATCH_SIZE + NET_BATCH_MAX * NET_EDGE_MAX];
+};
@@ -0,0 +1,203 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pulseshard.h"
+
+static char *trim(char *str) {
+	char *end;
+
+	while (isspace((unsigned char)*str))
+		str++;
+
+	end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1]))
+		end--;
+	*end = '\0';
+	return str;
+}
+
+static bool parse_id(const char *value, unsigned long *id) {
+	char *end = NULL;
+
+	if (!isdigit((unsigned char)value[0]))
+		return false;
+
+	errno = 0;
+	*id = strtoul(value, &end, 10);
+	return errno == 0 && end[0] == '\0';
+}
+
+/* <id>, <from>-<to>, %<modulus>=<from>-<to> or * */
+static bool parse_meters(char *value, struct shard *shard) {
+	char *to;
+
+	shard->modulus = 0;
+
+	if (!strcmp(value, "*")) {
+		shard->from = 0;
+		shard->to = ULONG_MAX;
+		return true;
+	}
+
+	if (value[0] == '%') {
+		char *range = strchr(value, '=');
+
+		if (range == NULL)
+			return false;
+		*range++ = '\0';
+
+		if (!parse_id(value + 1, &shard->modulus) || shard->modulus == 0)
+			return false;
+		value = range;
+	}
+
+	to = strchr(value, '-');
+	if (to != NULL)
+		*to++ = '\0';
+
+	if (!parse_id(value, &shard->from))
+		return false;
+
+	if (to == NULL)
+		shard->to = shard->from;
+	else if (!parse_id(to, &shard->to))
+		return false;
+
+	if (shard->to < shard->from)
+		return false;
+
+	return shard->modulus == 0 || shard->to < shard->modulus;
+}
+
+/* the conninfo strings point into the line */
+static bool parse_line(char *line, struct shard *shard) {
+	char *conninfo, *standby;
+
+	conninfo = line + strcspn(line, " \t");
+	if (conninfo[0] == '\0')
+		return false;
+	*conninfo++ = '\0';
+
+	if (!parse_meters(line, shard))
+		return false;
+
+	standby = strchr(conninfo, '|');
+	if (standby != NULL) {
+		*standby++ = '\0';
+		standby = trim(standby);
+		if (standby[0] == '\0')
+			return false;
+	}
+
+	conninfo = trim(conninfo);
+	if (conninfo[0] == '\0')
+		return false;
+
+	shard->conninfo = conninfo;
+	shard->standby = standby;
+	return true;
+}
+
+int shard_load(const char *file, struct shards *s) {
+	char buf[SHARD_LINE];
+	size_t size = 0;
+	int line = 0, err;
+	FILE *f;
+
+	s->shard = NULL;
+	s->n = 0;
+
+	f = fopen(file, "r");
+	if (f == NULL)
+		return -1;
+
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		struct shard *shard;
+		char *data;
+
+		line++;
+		if (strchr(buf, '\n') == NULL && !feof(f))
+			goto invalid;
+
+		data = trim(buf);
+		if (data[0] == '\0' || data[0] == '#')
+			continue;
+
+		if (s->n == size) {
+			struct shard *tmp = realloc(s->shard, (size ? size * 2 : 8) * sizeof(*s->shard));
+
+			if (tmp == NULL)
+				goto fail;
+
+			s->shard = tmp;
+			size = size ? size * 2 : 8;
+		}
+
+		shard = &s->shard[s->n];
+		if (!parse_line(data, shard))
+			goto invalid;
+
+		shard->conninfo = strdup(shard->conninfo);
+		if (shard->conninfo == NULL)
+			goto fail;
+
+		if (shard->standby != NULL) {
+			shard->standby = strdup(shard->standby);
+			if (shard->standby == NULL) {
+				free(shard->conninfo);
+				goto fail;
+			}
+		}
+		s->n++;
+	}
+
+	if (ferror(f))
+		goto fail;
+
+	fclose(f);
+	return 0;
+
+invalid:
+	fclose(f);
+	shard_free(s);
+	errno = EINVAL;
+	return line;
+
+fail:
+	err = errno;
+	fclose(f);
+	shard_free(s);
+	errno = err;
+	return -1;
+}
+
+const struct shard *shard_find(const struct shards *s, unsigned long meter) {
+	size_t i;
+
+	for (i = 0; i < s->n; i++) {
+		const struct shard *shard = &s->shard[i];
+		unsigned long value = shard->modulus ? meter % shard->modulus : meter;
+
+		if (value >= shard->from && value <= shard->to)
+			return shard;
+	}
+	return NULL;
+}
+
+void shard_free(struct shards *s) {
+	size_t i;
+
+	for (i = 0; i < s->n; i++) {
+		free(s->shard[i].conninfo);
+		free(s->shard[i].standby);
+	}
+	free(s->shard);
+
+	s->shard = NULL;
+	s->n = 0;
+}
@@ -0,0 +1,39 @@
+/* Meters stored in different databases (shards)
+ *
+ * Each line of a shard file maps meters to the conninfo of a database,
+ * with an optional standby conninfo after a "|":
+ *
+ *   # meters  conninfo [| standby conninfo]
+ *   1         host=db1 dbname=gasmeter
+ *   2-9       host=db2 dbname=gasmeter | host=db2b dbname=gasmeter
+ *   %4=0-1    host=db3 dbname=gasmeter
+ *   *         dbname=gasmeter
+ *
+ * Meters are a single id, a range of ids, a range of the id modulo
+ * a number of buckets (to spread meters evenly) or "*" for any meter.
+ * The first line that matches a meter is used.
+ */
+
+/* Maximum length of a line */
+#define SHARD_LINE 4096
+
+struct shard {
+	unsigned long from;
+	unsigned long to;
+	unsigned long modulus; /* 0 if the range is of meter ids */
+	char *conninfo;
+	char *standby; /* NULL if there is no standby */
+};
+
+struct shards {
+	struct shard *shard;
+	size_t n;
+};
+
+/* returns -1 with errno set if the file can't be read,
+ * otherwise the line number of the first invalid line
+ * or 0 if the whole file is valid
+ */
+int shard_load(const char *file, struct shards *s);
+const struct shard *shard_find(const struct shards *s, unsigned long meter);
+void shard_free(struct shards *s);
@@ -0,0 +1,121 @@
+#!/bin/sh
+# Check that pulsedb writes each meter to its own shard, using throwaway local databases
+#
+# Usage: pulseshard.sh [shards]
+#
+# Meters are spread over the shards by id (%<shards>=<n>). The first shard is
+# stopped while pulses are written so that the meters on the other shards can
+# be checked to continue without it, then it's restarted to receive its pulses.
+set -e
+
+shards="${1:-3}"
+meters=$((shards * 2))
+
+PATH="$(pg_config --bindir):$PATH"
+export PATH
+
+dir="$(mktemp -d)"
+pids=""
+cleanup() {
+	[ -z "$pids" ] || kill $pids 2>/dev/null || true
+	wait
+	n=0
+	while [ $n -lt "$shards" ]; do
+		pg_ctl -D "$dir/$n/data" -m immediate stop >/dev/null 2>&1 || true
+		n=$((n + 1))
+	done
+	rm -f /dev/mqueue/pulseshard.$$.*
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+start() {
+	pg_ctl -D "$dir/$1/data" -l "$dir/$1/log" -w -o "-k $dir/$1 -c listen_addresses=''" start >/dev/null
+}
+
+stop() {
+	pg_ctl -D "$dir/$1/data" -m fast -w stop >/dev/null
+}
+
+sql() {
+	psql -h "$dir/$1" -U postgres -d postgres -q -At -v ON_ERROR_STOP=1 -c "$2"
+}
+
+# every shard has the same meters
+n=0
+while [ $n -lt "$shards" ]; do
+	mkdir "$dir/$n"
+	initdb -D "$dir/$n/data" -A trust -U postgres >/dev/null
+	start $n
+	psql -h "$dir/$n" -U postgres -d postgres -q -v ON_ERROR_STOP=1 -f postgres.sql >/dev/null
+	sql $n "INSERT INTO meters (id, name, pulse, \"offset\") SELECT id, 'shard' || id, 0.01, 0 FROM generate_series(1, $meters) id"
+	echo "%$shards=$n-$n host=$dir/$n user=postgres dbname=postgres" >>"$dir/shards"
+	n=$((n + 1))
+done
+
+m=1
+while [ $m -le "$meters" ]; do
+	./pulsedb -S "$dir/shards" "/pulseshard.$$.$m" $m 2>"$dir/pulsedb.$m.log" &
+	pids="$pids $!"
+	m=$((m + 1))
+done
+sleep 1
+
+# pulsefake always exits with a failure status
+pulse() {
+	./pulsefake "/pulseshard.$$.$1" "$2.000000" on || true
+	./pulsefake "/pulseshard.$$.$1" "$2.100000" off || true
+}
+
+stop 0
+now="$(date +%s)"
+m=1
+while [ $m -le "$meters" ]; do
+	pulse $m $((now - 10))
+	pulse $m $((now - 5))
+	m=$((m + 1))
+done
+sleep 2
+
+# meters on the other shards are not delayed by the one that's down
+status=0
+m=1
+while [ $m -le "$meters" ]; do
+	if [ $((m % shards)) -ne 0 ]; then
+		count="$(sql $((m % shards)) "SELECT COUNT(*) FROM pulses WHERE meter = $m AND stop IS NOT NULL")"
+		if [ "$count" != 2 ]; then
+			echo "meter $m: $count pulses while shard 0 is down"
+			status=1
+		fi
+	fi
+	m=$((m + 1))
+done
+
+# pulsedb retries with an increasing backoff
+start 0
+tries=0
+while [ "$(sql 0 "SELECT COUNT(*) FROM pulses WHERE stop IS NOT NULL")" != $((meters / shards * 2)) ]; do
+	tries=$((tries + 1))
+	if [ $tries -ge 90 ]; then
+		echo "shard 0: pulses not written after restarting"
+		status=1
+		break
+	fi
+	sleep 1
+done
+
+# each meter is only on its own shard
+n=0
+while [ $n -lt "$shards" ]; do
+	printf "shard %d: " $n
+	sql $n "SELECT COUNT(DISTINCT meter) || ' meters, ' || COUNT(*) || ' pulses' FROM pulses"
+	wrong="$(sql $n "SELECT string_agg(DISTINCT meter::text, ',') FROM pulses WHERE meter % $shards <> $n")"
+	if [ -n "$wrong" ]; then
+		echo "shard $n: has pulses for meters $wrong"
+		status=1
+	fi
+	n=$((n + 1))
+done
+
+[ $status -eq 0 ] && echo ok
+exit $status
@@ -0,0 +1,528 @@
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pulseq.h"
+#include "pulsedb_sim.h"
+#include "pulsepair.h"
+#include "pulsesim.h"
+
+#define SIM_POINT_NAME(name) #name,
+static const char *point_names[SIM_POINT_MAX] = { SIM_POINTS };
+#undef SIM_POINT_NAME
+
+char *program;
+unsigned long seed = 1;
+unsigned long edges_count = SIM_EDGES;
+unsigned long samples = SIM_SAMPLES;
+bool verbose = false;
+char *only = NULL;
+char dir[32];
+char db_file[48];
+char db_tmp[48];
+char mqueue_main[32];
+char mqueue_backup[33];
+
+struct sim_edge *edges;
+unsigned long edges_used = 0;
+pulse_span_t *expected;
+unsigned long expected_count = 0;
+bool expected_reset = false;
+
+struct sim_header header;
+struct sim_pulse pulses[SIM_ROWS];
+struct sim_reading readings[SIM_ROWS];
+uint32_t dry_hits[SIM_POINT_MAX];
+int failed = 0;
+int lost = 0;
+
+static void setup(int argc, char *argv[]) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:n:k:f:v")) != -1) {
+		switch (opt) {
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			edges_count = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'k':
+			samples = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'f':
+			only = optarg;
+			break;
+
+		case 'v':
+			verbose = true;
+			break;
+
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 1 || edges_count < 10 || edges_count > SIM_ROWS) {
+usage:
+		printf("Usage: %s [-s seed] [-n edges] [-k samples per point] [-f fault] [-v] <pulsedbsim>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	program = argv[optind];
+}
+
+/* xorshift, so that the stream is the same everywhere */
+static uint32_t sim_rand(void) {
+	static uint64_t x = 0;
+
+	if (x == 0)
+		x = seed * 2654435761ULL + 1;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x >> 32;
+}
+
+static uint64_t sim_range(uint64_t min, uint64_t max) {
+	return min + sim_rand() % (max - min + 1);
+}
+
+static void add_edge(uint64_t us, bool on, uint64_t duration) {
+	struct sim_edge *e = &edges[edges_used++];
+
+	e->span.tv.tv_sec = us / 1000000;
+	e->span.tv.tv_usec = us % 1000000;
+	e->span.on = on;
+	e->span.duration = duration;
+	e->len = duration > 0 ? sizeof(pulse_span_t) : sizeof(pulse_t);
+}
+
+static void add_reset(void) {
+	struct sim_edge *e = &edges[edges_used++];
+
+	memset(e, 0, sizeof(*e));
+	e->len = sizeof(pulse_t);
+}
+
+/* a scripted stream of normal pulses mixed with noise,
+ * interruptions, stray edges, completed pulses and resets
+ */
+static void generate(void) {
+	uint64_t t = 1500000000ULL * 1000000;
+
+	edges = calloc(edges_count + 8, sizeof(*edges));
+	cerror("calloc", edges == NULL);
+
+	while (edges_used < edges_count) {
+		unsigned int r = sim_rand() % 100;
+
+		if (r < 65) { /* normal */
+			add_edge(t, true, 0);
+			t += sim_range(MIN_PULSE, 3000000);
+			add_edge(t, false, 0);
+		} else if (r < 75) { /* noise */
+			add_edge(t, true, 0);
+			t += sim_range(1, MIN_PULSE - 1);
+			add_edge(t, false, 0);
+		} else if (r < 83) { /* interrupted */
+			add_edge(t, true, 0);
+			t += sim_range(1000, 1000000);
+			add_edge(t, false, 0);
+			t += sim_range(1, MIN_PULSE - 1);
+			add_edge(t, true, 0);
+			t += sim_range(1000, 1000000);
+			add_edge(t, false, 0);
+		} else if (r < 88) { /* duplicate on */
+			add_edge(t, true, 0);
+			t += sim_range(1, 1000000);
+			add_edge(t, true, 0);
+			t += sim_range(MIN_PULSE, 1000000);
+			add_edge(t, false, 0);
+		} else if (r < 91) { /* unknown off */
+			add_edge(t, false, 0);
+		} else if (r < 97) { /* completed */
+			uint64_t duration = sim_range(MIN_PULSE, 3000000);
+
+			add_edge(t, true, duration);
+			t += duration;
+		} else {
+			add_reset();
+		}
+
+		t += sim_range(MIN_PULSE, 60000000);
+	}
+
+	/* finish with a normal pulse so that everything is complete */
+	add_edge(t, true, 0);
+	t += 1000000;
+	add_edge(t, false, 0);
+}
+
+static void expect(void *ctx, const pulse_span_t *span) {
+	(void)ctx;
+
+	if (span->duration > 0)
+		expected[expected_count++] = *span;
+}
+
+/* the correct result is the same as pairing the edges,
+ * without one message (or only its off edge) if it was lost
+ */
+static void calculate_expected(unsigned long skip, bool off_only) {
+	struct pulse_pair pair;
+	struct timeval end;
+	unsigned long i;
+
+	expected_count = 0;
+	expected_reset = false;
+
+	pulse_pair_init(&pair, false, expect, NULL);
+	for (i = 0; i < edges_used; i++) {
+		pulse_span_t *span = &edges[i].span;
+
+		if (i == skip && !off_only)
+			continue;
+
+		if (span->tv.tv_sec == 0) {
+			expected_reset = true;
+		} else if (span->duration > 0) {
+			uint64_t stop = (uint64_t)span->tv.tv_sec * 1000000 + span->tv.tv_usec + span->duration;
+			struct timeval off = { .tv_sec = stop / 1000000, .tv_usec = stop % 1000000 };
+
+			pulse_pair_edge(&pair, span->tv, true);
+			if (i != skip)
+				pulse_pair_edge(&pair, off, false);
+		} else {
+			pulse_pair_edge(&pair, span->tv, span->on);
+		}
+	}
+
+	end = edges[edges_used - 1].span.tv;
+	end.tv_sec++;
+	pulse_pair_time(&pair, end);
+
+	/* the last pulse is still open if its off edge is missing */
+	if (pair.active && !pair.off) {
+		expected[expected_count].tv = pair.start;
+		expected[expected_count].on = true;
+		expected[expected_count].duration = 0;
+		expected_count++;
+	}
+}
+
+static void init(void) {
+	sprintf(dir, "/tmp/pulsesim%lu", (unsigned long)getpid());
+	cerror(dir, mkdir(dir, S_IRWXU) != 0);
+	sprintf(db_file, "%s/db", dir);
+	sprintf(db_tmp, "%s/db~", dir);
+	sprintf(mqueue_main, "/pulsesim%lu", (unsigned long)getpid());
+	sprintf(mqueue_backup, "%s~", mqueue_main);
+
+	generate();
+
+	expected = calloc(edges_used, sizeof(*expected));
+	cerror("calloc", expected == NULL);
+	calculate_expected(edges_used, false);
+}
+
+static void cleanup(void) {
+	mq_unlink(mqueue_main);
+	mq_unlink(mqueue_backup);
+	unlink(db_file);
+	unlink(db_tmp);
+	rmdir(dir);
+	free(edges);
+	free(expected);
+}
+
+/* start with an empty database and every edge waiting to be read */
+static void reset_state(void) {
+	struct mq_attr attr = {
+		.mq_flags = 0,
+		.mq_maxmsg = edges_used + 1 < 4096 ? edges_used + 1 : 4096,
+		.mq_msgsize = sizeof(pulse_span_t)
+	};
+	unsigned long i;
+	mqd_t q;
+
+	if (mq_unlink(mqueue_main) != 0)
+		cerror(mqueue_main, errno != ENOENT);
+	if (mq_unlink(mqueue_backup) != 0)
+		cerror(mqueue_backup, errno != ENOENT);
+	if (unlink(db_file) != 0)
+		cerror(db_file, errno != ENOENT);
+
+	q = mq_open(mqueue_main, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR, &attr);
+	cerror(mqueue_main, q < 0);
+
+	errno = EFBIG;
+	cerror(mqueue_main, edges_used >= (unsigned long)attr.mq_maxmsg);
+	for (i = 0; i < edges_used; i++)
+		cerror(mqueue_main, mq_send(q, (const char *)&edges[i].span, edges[i].len, 0) != 0);
+
+	cerror(mqueue_main, mq_close(q) != 0);
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+	return read(fd, buf, len) == (ssize_t)len;
+}
+
+static void load_db(void) {
+	int fd = open(db_file, O_RDONLY);
+
+	memset(&header, 0, sizeof(header));
+	if (fd < 0) {
+		cerror(db_file, errno != ENOENT);
+		return;
+	}
+
+	errno = EIO;
+	cerror(db_file, !read_all(fd, &header, sizeof(header)) || header.magic != SIM_MAGIC
+		|| header.pulses > SIM_ROWS || header.readings > SIM_ROWS
+		|| !read_all(fd, pulses, header.pulses * sizeof(*pulses))
+		|| !read_all(fd, readings, header.readings * sizeof(*readings)));
+	cerror(db_file, close(fd) != 0);
+}
+
+/* returns the status of pulsedb or -1 if it had to be killed */
+static int run(const char *fault) {
+	struct timespec pause = { .tv_sec = 0, .tv_nsec = 10000000 };
+	time_t start = time(NULL);
+	pid_t pid, ret;
+	int status;
+
+	pid = fork();
+	cerror("fork", pid < 0);
+	if (pid == 0) {
+		if (fault != NULL)
+			setenv("PULSESIM_FAULT", fault, 1);
+		else
+			unsetenv("PULSESIM_FAULT");
+
+		if (!verbose) {
+			int fd = open("/dev/null", O_WRONLY);
+
+			if (fd >= 0) {
+				dup2(fd, STDOUT_FILENO);
+				close(fd);
+			}
+		}
+
+		execl(program, program, "-c", db_file, mqueue_main, "1", (char *)NULL);
+		xerror(program);
+	}
+
+	while ((ret = waitpid(pid, &status, WNOHANG)) == 0) {
+		if (time(NULL) - start >= SIM_TIMEOUT) {
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			return -1;
+		}
+		nanosleep(&pause, NULL);
+	}
+	cerror("waitpid", ret < 0);
+	return status;
+}
+
+static int compare_pulses(const void *a, const void *b) {
+	const struct sim_pulse *x = a, *y = b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static bool check(struct sim_result *result) {
+	unsigned long i;
+
+	qsort(pulses, header.pulses, sizeof(*pulses), compare_pulses);
+
+	for (i = 0; i < expected_count && i < header.pulses; i++) {
+		uint64_t start = (uint64_t)expected[i].tv.tv_sec * 1000000 + expected[i].tv.tv_usec;
+		uint64_t stop = expected[i].duration > 0 ? start + expected[i].duration : 0;
+
+		if (pulses[i].start != start || pulses[i].stop != stop) {
+			snprintf(result->error, sizeof(result->error), "pulse %lu is %llu-%llu not %llu-%llu", i,
+				(unsigned long long)pulses[i].start, (unsigned long long)pulses[i].stop,
+				(unsigned long long)start, (unsigned long long)stop);
+			return false;
+		}
+	}
+
+	if (header.pulses != expected_count) {
+		snprintf(result->error, sizeof(result->error), "%u pulses not %lu", header.pulses, expected_count);
+		return false;
+	}
+
+	if (header.readings != (expected_reset ? 1 : 0)) {
+		snprintf(result->error, sizeof(result->error), "%u readings not %u", header.readings, expected_reset ? 1 : 0);
+		return false;
+	}
+
+	return true;
+}
+
+/* signals are held in critical sections but SIGKILL can't be,
+ * so the message that has been read from the main queue and not
+ * yet written to the backup queue is lost when killed at one of
+ * these points (this is the only acceptable difference)
+ */
+static bool lost_edge(const char *fault) {
+	static const char *points[] = { "kill:receive:", "kill:off_pending:", "kill:keep:" };
+	struct sim_result tmp;
+	bool found = false;
+	unsigned long i;
+	int j, variant;
+
+	for (j = 0; j < (int)(sizeof(points) / sizeof(points[0])); j++)
+		if (!strncmp(fault, points[j], strlen(points[j])))
+			break;
+	if (j == (int)(sizeof(points) / sizeof(points[0])))
+		return false;
+
+	for (i = 0; i < edges_used && !found; i++) {
+		for (variant = 0; variant < (edges[i].span.duration > 0 ? 2 : 1) && !found; variant++) {
+			calculate_expected(i, variant == 1);
+			found = check(&tmp);
+		}
+	}
+
+	calculate_expected(edges_used, false);
+	return found;
+}
+
+/* run pulsedb with the fault, restarting it until every edge has been processed */
+static void scenario(const char *fault) {
+	struct sim_result result = { .restarts = 0, .ok = false, .lost = false, .error = "" };
+	const char *current = fault;
+
+	reset_state();
+
+	while (1) {
+		int status = run(current);
+
+		load_db();
+		if (status == -1) {
+			snprintf(result.error, sizeof(result.error), "timeout");
+			break;
+		}
+
+		if (WIFEXITED(status)) {
+			snprintf(result.error, sizeof(result.error), "exit %d", WEXITSTATUS(status));
+			break;
+		}
+
+		if (header.drained != 0) {
+			result.ok = check(&result);
+			result.lost = !result.ok && fault != NULL && lost_edge(fault);
+			break;
+		}
+
+		if (!WIFSIGNALED(status) || (WTERMSIG(status) != SIGKILL && WTERMSIG(status) != SIGTERM)) {
+			snprintf(result.error, sizeof(result.error), "status %d", status);
+			break;
+		}
+
+		if (++result.restarts > SIM_RESTARTS) {
+			snprintf(result.error, sizeof(result.error), "too many restarts");
+			break;
+		}
+
+		/* the fault only happens once */
+		current = NULL;
+	}
+
+	printf("%-24s %-4s %8d %8llu %8llu", fault != NULL ? fault : "none", result.ok ? "ok" : (result.lost ? "lost" : "FAIL"),
+		result.restarts, (unsigned long long)header.calls, (unsigned long long)header.failures);
+	if (header.fault != 0 && header.recovered >= header.fault)
+		printf(" %12llu", (unsigned long long)(header.recovered - header.fault));
+	else
+		printf(" %12s", "-");
+	if (header.drained != 0)
+		printf(" %12llu", (unsigned long long)(header.drained - header.fault));
+	else
+		printf(" %12s", "-");
+	if (!result.ok) {
+		printf("  %s", result.error);
+		if (result.lost)
+			lost++;
+		else
+			failed++;
+	}
+	printf("\n");
+}
+
+/* inject faults at a few hits of a point, always including the first and last */
+static void scenario_point(const char *signal_name, int point) {
+	unsigned long i, hit, last = 0;
+	char fault[64];
+
+	if (dry_hits[point] == 0)
+		return;
+
+	for (i = 0; i < samples; i++) {
+		hit = samples > 1 ? 1 + i * (dry_hits[point] - 1) / (samples - 1) : 1;
+		if (hit == last)
+			continue;
+		last = hit;
+
+		sprintf(fault, "%s:%s:%lu", signal_name, point_names[point], hit);
+		scenario(fault);
+	}
+}
+
+static void simulate(void) {
+	char fault[64];
+	int i;
+
+	printf("%lu edges, %lu pulses, seed %lu\n", edges_used, expected_count, seed);
+	printf("%-24s %-4s %8s %8s %8s %12s %12s\n", "fault", "", "restarts", "calls", "failures", "recover(ms)", "drain(ms)");
+
+	if (only != NULL) {
+		scenario(only);
+		return;
+	}
+
+	/* find out how often each point is reached */
+	scenario(NULL);
+	memcpy(dry_hits, header.hits, sizeof(dry_hits));
+
+	scenario("latency:50");
+	scenario("error:5");
+	sprintf(fault, "down:%llu:600000", (unsigned long long)header.calls / 2);
+	scenario(fault);
+
+	for (i = 0; i < SIM_POINT_MAX; i++) {
+		scenario_point("kill", i);
+		scenario_point("term", i);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	setup(argc, argv);
+	init();
+	simulate();
+	cleanup();
+
+	if (lost > 0)
+		printf("%d lost an edge when killed\n", lost);
+	if (failed > 0) {
+		printf("%d failed\n", failed);
+		exit(EXIT_FAILURE);
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,26 @@
+#define xerror(msg) do { perror(msg); exit(EXIT_FAILURE); } while(0)
+#define cerror(msg, expr) do { if (expr) xerror(msg); } while(0)
+
+/* Number of edges in the scripted stream */
+#define SIM_EDGES 1000
+
+/* Number of hits of each point to inject a fault at */
+#define SIM_SAMPLES 3
+
+/* Maximum number of restarts of pulsedb */
+#define SIM_RESTARTS 10
+
+/* Real time allowed for each run of pulsedb (s) */
+#define SIM_TIMEOUT 60
+
+struct sim_edge {
+	pulse_span_t span;
+	size_t len; /* sizeof(pulse_t) for an edge */
+};
+
+struct sim_result {
+	int restarts;
+	bool ok;
+	bool lost; /* killed in an unprotected window */
+	char error[128];
+};
@@ -0,0 +1,435 @@
+#!/usr/bin/env python2
+# coding=utf8
+
+from __future__ import division
+from __future__ import print_function
+import argparse
+import daemon
+import errno
+import fcntl
+import httplib
+import json
+import oauth2 as oauth
+import os
+import pulselib
+import Queue
+import sys
+import threading
+import time
+import urlparse
+
+URLS = {
+	"twitter": "https://api.twitter.com",
+	"pachube": "http://api.pachube.com"
+}
+
+class TokenBucket:
+	def __init__(self, interval, burst=1):
+		self.interval = interval
+		self.burst = burst
+		self.tokens = burst
+		self.last = time.time()
+
+	def take(self):
+		now = time.time()
+		self.tokens = min(self.burst, self.tokens + (now - self.last) / self.interval)
+		self.last = now
+
+		if self.tokens >= 1:
+			self.tokens -= 1
+			return 0
+		return (1 - self.tokens) * self.interval
+
+class Mailbox:
+	"""Holds only the latest item, older items that have not been sent are replaced"""
+
+	def __init__(self):
+		self.cond = threading.Condition()
+		self.item = None
+		self.coalesced = 0
+
+	def put(self, item):
+		with self.cond:
+			if self.item is not None and self.item != item:
+				self.coalesced += 1
+			self.item = item
+			self.cond.notify()
+
+	def retry(self, item):
+		with self.cond:
+			if self.item is None:
+				self.item = item
+
+	def get(self):
+		with self.cond:
+			while self.item is None:
+				self.cond.wait(60)
+			item = self.item
+			self.item = None
+			coalesced = self.coalesced
+			self.coalesced = 0
+			return (item, coalesced)
+
+class Wakeup:
+	def __init__(self):
+		(self.r, self.w) = os.pipe()
+		fcntl.fcntl(self.r, fcntl.F_SETFL, fcntl.fcntl(self.r, fcntl.F_GETFL) | os.O_NONBLOCK)
+
+	def fileno(self):
+		return self.r
+
+	def files(self):
+		return [self.r, self.w]
+
+	def set(self):
+		os.write(self.w, b"\0")
+
+	def clear(self):
+		try:
+			os.read(self.r, 4096)
+		except OSError, e:
+			if e.errno != errno.EAGAIN:
+				raise
+
+class Sink(threading.Thread):
+	"""Sends readings on a persistent connection without blocking the other sinks"""
+
+	interval = 60
+	timeout = 0
+
+	def __init__(self, name, url, log, results):
+		threading.Thread.__init__(self, name=name)
+		self.daemon = True
+		self.url = urlparse.urlsplit(url)
+		self.log = log
+		self.results = results
+		self.mailbox = Mailbox()
+		self.bucket = TokenBucket(self.interval)
+		self.conn = None
+		self.last_rate = ""
+		self.last_sent = None
+
+	def post(self, ts, value, rate):
+		self.mailbox.put((ts, value, "{0:04.2f}".format(rate)))
+
+	def request(self, method, path, body, headers):
+		for attempt in range(0, 2):
+			try:
+				if self.conn is None:
+					if self.url.scheme == "https":
+						self.conn = httplib.HTTPSConnection(self.url.netloc, timeout=30)
+					else:
+						self.conn = httplib.HTTPConnection(self.url.netloc, timeout=30)
+				self.conn.request(method, self.url.path + path, body, headers)
+				resp = self.conn.getresponse()
+				content = resp.read()
+				if resp.getheader("connection", "").lower() == "close":
+					self.close()
+				return (resp.status, content)
+			except (httplib.HTTPException, IOError), e:
+				self.close()
+				# the server may have closed an idle connection
+				if attempt > 0:
+					raise
+
+	def close(self):
+		if self.conn is not None:
+			self.conn.close()
+		self.conn = None
+
+	def send(self, ts, value, rate):
+		return True
+
+	def run(self):
+		backoff = self.interval
+		while True:
+			(item, coalesced) = self.mailbox.get()
+
+			wait = self.bucket.take()
+			if wait > 0:
+				print("{0}: waiting {1:.1f}s".format(self.name, wait))
+				time.sleep(wait)
+				# use the latest reading
+				self.mailbox.retry(item)
+				(item, more) = self.mailbox.get()
+				coalesced += more
+				self.bucket.take()
+
+			if coalesced > 0:
+				print("{0}: skipped {1} readings".format(self.name, coalesced))
+			if item == self.last_sent:
+				continue
+
+			(ts, value, rate) = item
+			if self.send(ts, value, rate):
+				self.last_sent = item
+				self.results.put((self, item))
+				backoff = self.interval
+			else:
+				self.mailbox.retry(item)
+				print("{0}: retry in {1}s".format(self.name, backoff))
+				time.sleep(backoff)
+				backoff = min(backoff * 2, self.interval * 10)
+
+class Twitter(Sink):
+	interval = 60
+
+	class NoSuchAccount(Exception):
+		pass
+
+	def __init__(self, db, meter, account, url, log, results):
+		CON_KEY, CON_SEC, ACC_TOK, ACC_SEC = range(0, 4)
+
+		data = db.select1("SELECT o.key,o.secret,a.token,a.secret FROM twitter_oauth o, twitter_accounts a WHERE a.name = %(account)s AND o.name = a.key", { "account": account })
+		if data is None:
+			raise self.NoSuchAccount(account)
+
+		Sink.__init__(self, "twitter/{0}".format(account), url, log, results)
+		self.meter = meter
+		self.account = account
+		self.consumer = oauth.Consumer(data[CON_KEY], data[CON_SEC])
+		self.token = oauth.Token(data[ACC_TOK], data[ACC_SEC])
+
+	def send(self, ts, value, rate):
+		message = "{0:08.2f} m³ ({1} m³/hr)".format(value, rate)
+		url = urlparse.urlunsplit(self.url) + "/1.1/statuses/update.json"
+		status = None
+		id = None
+		ok = False
+		err = []
+
+		req = oauth.Request.from_consumer_and_token(self.consumer, token=self.token, http_method="POST", http_url=url, parameters={ "status": message })
+		req.sign_request(oauth.SignatureMethod_HMAC_SHA1(), self.consumer, self.token)
+		try:
+			(status, content) = self.request("POST", "/1.1/statuses/update.json", req.to_postdata(), { "Content-Type": "application/x-www-form-urlencoded" })
+		except Exception, e:
+			err = [e]
+		else:
+			print("{0}: status {1}".format(self.name, status))
+			if status == 200:
+				ok = True
+			else:
+				err = [status, content]
+
+			try:
+				data = json.loads(content)
+			except Exception, e:
+				err = [status, content, e]
+			else:
+				if isinstance(data, dict):
+					if "id" in data:
+						id = data["id"]
+
+					if not ok and data.get("error") == "Status is a duplicate.":
+						ok = True
+						err = [content]
+
+		self.log("{0}: {1} <{2}> [{3}] {4}".format(self.name, message, ts, status, id))
+		for msg in err:
+			self.log("{0}:   {1}".format(self.name, msg))
+		return ok
+
+	def is_newer_update(self, db, ts):
+		return db.select1("SELECT 1 FROM twitter_accounts WHERE name = %(account)s AND (lastupdate IS NULL OR lastupdate < %(ts)s)", { "ts": ts, "account": self.account }) is not None
+
+	def set_last_update(self, db, ts):
+		db.update("UPDATE twitter_accounts SET lastupdate = %(ts)s WHERE name = %(account)s AND (lastupdate IS NULL OR lastupdate < %(ts)s)", { "ts": ts, "account": self.account })
+
+class Pachube(Sink):
+	interval = 4
+	timeout = 30
+
+	class NoSuchFeedData(Exception):
+		pass
+
+	def __init__(self, db, meter, feed, data, url, log, results):
+		key = db.select1("SELECT key FROM pachube WHERE feed = %(feed)s AND data = %(data)s", { "feed": feed, "data": data })
+		if key is None:
+			raise self.NoSuchFeedData("{0}/{1}".format(feed, data))
+
+		Sink.__init__(self, "pachube/{0}/{1}".format(feed, data), url, log, results)
+		self.meter = meter
+		self.feed = feed
+		self.data = data
+		self.key = key[0]
+
+	def send(self, ts, value, rate):
+		message = "{0:09.3f} m³ ({1} m³/hr) <{2}>".format(value, rate, ts)
+		ok = False
+		err = []
+
+		# value and rate in a single request
+		body = json.dumps({
+			"version": "1.0.0",
+			"datastreams": [
+				{ "id": "{0}.value".format(self.data), "current_value": str(value) },
+				{ "id": "{0}.rate".format(self.data), "current_value": rate }
+			]
+		})
+		try:
+			(status, content) = self.request("PUT", "/v2/feeds/{0}.json".format(self.feed), body, { "Content-Type": "application/json", "X-PachubeApiKey": self.key })
+		except Exception, e:
+			err = [e]
+		else:
+			if status == 200:
+				ok = True
+			else:
+				err = [status, content]
+
+		self.log("{0}: {1}".format(self.name, message))
+		for msg in err:
+			self.log("{0}:   {1}".format(self.name, msg))
+		return ok
+
+	def is_newer_update(self, db, ts):
+		return db.select1("SELECT 1 FROM pachube WHERE feed = %(feed)s AND data = %(data)s AND (lastupdate IS NULL OR lastupdate < %(ts)s)", { "ts": ts, "feed": self.feed, "data": self.data }) is not None
+
+	def set_last_update(self, db, ts):
+		db.update("UPDATE pachube SET lastupdate = %(ts)s WHERE feed = %(feed)s AND data = %(data)s AND (lastupdate IS NULL OR lastupdate < %(ts)s)", { "ts": ts, "feed": self.feed, "data": self.data })
+
+class Engine:
+	"""Reads the meters on one DB connection and posts readings to every sink"""
+
+	def __init__(self, db):
+		self.db = db
+		self.sinks = []
+		self.meters = {}
+		self.wakeup = Wakeup()
+		self.results = Results(self.wakeup)
+
+	def add(self, sink):
+		if sink.meter not in self.meters:
+			self.meters[sink.meter] = pulselib.Pulses(self.db, sink.meter)
+		self.sinks.append(sink)
+
+	def record_results(self):
+		self.wakeup.clear()
+		try:
+			while True:
+				(sink, (ts, value, rate)) = self.results.get_nowait()
+				sink.last_rate = rate
+				sink.set_last_update(self.db, ts)
+				self.db.commit()
+		except Queue.Empty:
+			pass
+
+	def process_reading(self, sink, reading):
+		if reading is None:
+			return
+
+		(ts, value, rate) = (reading["ts"], reading["value"], float(reading["step"]) / reading["delta"] * 3600)
+		if sink.is_newer_update(self.db, ts):
+			print("{0}: [{1}] {2:09.3f} m³ ({3:04.2f} m³/hr)".format(sink.name, ts, value, rate))
+			sink.post(ts, value, rate)
+		elif sink.timeout > 0 and reading["idle"] > sink.timeout:
+			idle_rate = float(reading["value"] + reading["step"]) / reading["idle"]
+			if idle_rate < rate and "{0:04.2f}".format(idle_rate) != sink.last_rate:
+				print("{0}: [{1}] {2:09.3f} m³ ({3:04.2f} m³/hr)".format(sink.name, ts, value, idle_rate))
+				sink.post(ts, value, idle_rate)
+
+	def wait_timeout(self):
+		# Getting down to a rate of "0.00" and disabling the early timeout will take a long time
+		special = {
+			"0.00": 0,
+			"0.01": 100,
+			"0.02": 10
+		}
+		timeouts = []
+		for sink in self.sinks:
+			timeout = sink.timeout
+			if sink.last_rate in special:
+				timeout = timeout * special[sink.last_rate]
+			if timeout > 0:
+				timeouts.append(timeout)
+		return min(timeouts) if timeouts else 0
+
+	def main_loop(self):
+		for sink in self.sinks:
+			sink.start()
+
+		while True:
+			try:
+				self.record_results()
+				for (meter, pulses) in self.meters.items():
+					reading = pulses.get_reading()
+					for sink in self.sinks:
+						if sink.meter == meter:
+							self.process_reading(sink, reading)
+				self.db.commit()
+
+				self.db.wait(self.wait_timeout(), self.wakeup)
+				# allow some time for invalid readings to be reverted
+				time.sleep(2)
+			except pulselib.DB.Reconnect:
+				time.sleep(5)
+				while not self.db.connect():
+					time.sleep(5)
+
+class Results(Queue.Queue):
+	"""Completed updates, the engine is woken up to record them"""
+
+	def __init__(self, wakeup):
+		Queue.Queue.__init__(self)
+		self.wakeup = wakeup
+
+	def put(self, item):
+		Queue.Queue.put(self, item)
+		self.wakeup.set()
+
+if __name__ == "__main__":
+	EXIT_SUCCESS, EXIT_FAILURE = range(0, 2)
+
+	parser = argparse.ArgumentParser(description='Send gas meter readings to twitter and pachube')
+	parser.add_argument('-d', '--daemon', action='store_true', help='Run in the background')
+	parser.add_argument('-S', '--shards', metavar='FILE', help='Shard file with the database of each meter')
+	parser.add_argument('-u', '--url', action='append', default=[], metavar='SERVICE=URL', help='Base URL of a service (e.g. for testing with a local server)')
+	parser.add_argument('sink', nargs='+', help='twitter:<meter>:<account> or pachube:<meter>:<feed>:<data>')
+	args = parser.parse_args()
+
+	urls = dict(URLS)
+	for url in args.url:
+		(service, _, url) = url.partition("=")
+		if service not in urls:
+			parser.error("Unknown service {0}".format(service))
+		urls[service] = url.rstrip("/")
+
+	shards = pulselib.Shards(args.shards) if args.shards else None
+	log = pulselib.Log("pulsesink")
+	engines = []
+
+	# one engine for each database, so that a slow database only delays its own meters
+	def engine_for(meter):
+		db = shards.db(meter) if shards is not None else None
+		for engine in engines:
+			if db is None or engine.db is db:
+				return engine
+		engines.append(Engine(db if db is not None else pulselib.DB()))
+		return engines[-1]
+
+	for sink in args.sink:
+		spec = sink.split(":")
+		if spec[0] == "twitter" and len(spec) == 3:
+			engine = engine_for(spec[1])
+			engine.add(Twitter(engine.db, spec[1], spec[2], urls["twitter"], log, engine.results))
+		elif spec[0] == "pachube" and len(spec) == 4:
+			engine = engine_for(spec[1])
+			engine.add(Pachube(engine.db, spec[1], spec[2], spec[3], urls["pachube"], log, engine.results))
+		else:
+			parser.error("Invalid sink {0}".format(sink))
+	for engine in engines:
+		engine.db.commit()
+
+	def main_loop():
+		for engine in engines[1:]:
+			thread = threading.Thread(target=engine.main_loop, name="engine")
+			thread.daemon = True
+			thread.start()
+		engines[0].main_loop()
+
+	if args.daemon:
+		with daemon.DaemonContext(files_preserve=sum([engine.wakeup.files() for engine in engines], [])):
+			main_loop()
+	else:
+		main_loop()
+
+	sys.exit(EXIT_FAILURE)
@@ -0,0 +1,113 @@
+#!/bin/sh
+# Benchmark the queries used to read meters against generated data in a throwaway local database
+#
+# Usage: pulsesqlbench.sh [-f schema] [-n runs] [-o output dir] [-c compact age] [pulsegen.py options...]
+#
+# Timings are written to stdout and <output dir>/results, with the plan of
+# each query (including statements run by SQL functions) in <output dir>/<query>.plan
+#
+# With -c, pulses older than the age are compacted before the queries are run
+# and the daily usage is checked to be the same as before compaction
+set -e
+
+schema=postgres.sql
+runs=10
+out="pulsesqlbench-$(date +%Y%m%d-%H%M%S)"
+compact=""
+
+while getopts f:n:o:c: opt; do
+	case "$opt" in
+	f) schema="$OPTARG" ;;
+	n) runs="$OPTARG" ;;
+	o) out="$OPTARG" ;;
+	c) compact="$OPTARG" ;;
+	*) exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+PATH="$(pg_config --bindir):$PATH"
+export PATH
+
+mkdir -p "$out"
+dir="$(mktemp -d)"
+trap 'pg_ctl -D "$dir/data" -m immediate stop >/dev/null 2>&1; rm -rf "$dir"' EXIT
+
+initdb -D "$dir/data" -A trust -U postgres >/dev/null
+pg_ctl -D "$dir/data" -l "$dir/log" -w -o "-k $dir -c listen_addresses=''" start >/dev/null
+
+PGHOST="$dir"
+PGUSER=postgres
+PGDATABASE=postgres
+export PGHOST PGUSER PGDATABASE
+
+psql -q -v ON_ERROR_STOP=1 -f "$schema" >/dev/null
+./pulsegen.py "$@" | psql -q -v ON_ERROR_STOP=1 >/dev/null
+meter="$(psql -At -c "SELECT min(id) FROM meters")"
+
+if [ -n "$compact" ]; then
+	psql -q -v ON_ERROR_STOP=1 -c "CREATE TABLE usage_before AS SELECT * FROM meter_usage"
+	echo "SELECT 'compacted ' || SUM(pulses_compact(id, :'age')) || ' pulses' FROM meters;" \
+		| psql -At -v ON_ERROR_STOP=1 -v age="$compact" | tee "$out/compact"
+	psql -At -v ON_ERROR_STOP=1 -c "SELECT 'meter_usage ' || CASE WHEN COUNT(*) = 0 THEN 'identical' ELSE COUNT(*) || ' days differ' END FROM ((SELECT * FROM usage_before EXCEPT ALL SELECT * FROM meter_usage) UNION ALL (SELECT * FROM meter_usage EXCEPT ALL SELECT * FROM usage_before)) AS diff" | tee -a "$out/compact"
+	psql -q -v ON_ERROR_STOP=1 -c "DROP TABLE usage_before" -c "VACUUM FULL"
+fi
+
+{
+	psql -At -F ' ' -c "SELECT 'meters', COUNT(*) FROM meters UNION ALL SELECT 'readings', COUNT(*) FROM readings UNION ALL SELECT 'pulses', COUNT(*) FROM pulses UNION ALL SELECT 'pulse_counts', COUNT(*) FROM pulse_counts"
+	psql -At -c "SELECT 'size ' || pg_size_pretty(pg_database_size(current_database()))"
+	echo
+	printf "%-16s %6s %10s %10s %10s\n" query runs "min(ms)" "median(ms)" "max(ms)"
+} | tee "$out/results"
+
+# run the query once to warm the cache, then time each run
+query() {
+	name="$1"
+	sql="$2"
+
+	{
+		printf '%s\n' '\o /dev/null' "$sql;" '\timing on'
+		i=0
+		while [ $i -lt "$runs" ]; do
+			printf '%s\n' "$sql;"
+			i=$((i + 1))
+		done
+	} | psql -q -v ON_ERROR_STOP=1 -v meter="$meter" \
+		| sed -n 's/^Time: \([0-9.]*\) ms.*/\1/p' | sort -n \
+		| awk -v name="$name" '{ t[NR] = $1 } END { printf "%-16s %6d %10.3f %10.3f %10.3f\n", name, NR, t[1], t[int((NR + 1) / 2)], t[NR] }' \
+		| tee -a "$out/results"
+
+	psql -q -v ON_ERROR_STOP=1 -v meter="$meter" >"$out/$name.plan" 2>&1 <<SQL
+LOAD 'auto_explain';
+SET auto_explain.log_min_duration = 0;
+SET auto_explain.log_analyze = on;
+SET auto_explain.log_buffers = on;
+SET auto_explain.log_nested_statements = on;
+SET client_min_messages = log;
+\o /dev/null
+$sql;
+\o
+SET client_min_messages = notice;
+EXPLAIN (ANALYZE, BUFFERS) $sql;
+SQL
+}
+
+# pulselib
+query latest "SELECT ts,value FROM abs_pulses WHERE meter = :meter ORDER BY ts DESC LIMIT 2"
+
+# daily usage
+query usage_month "SELECT * FROM meter_usage WHERE meter = :meter AND day >= to_char(now() - interval '31 days', 'YYYY-MM-DD')"
+query usage_all "SELECT * FROM meter_usage WHERE meter = :meter"
+query buckets_5min "SELECT * FROM usage_buckets(:meter, now() - interval '1 day', now(), interval '5 minutes')"
+query buckets_hour "SELECT * FROM usage_buckets(:meter, now() - interval '31 days', now(), interval '1 hour')"
+query buckets_month "SELECT * FROM usage_buckets(:meter, date_trunc('month', now()) - interval '3 years', now(), interval '1 month')"
+
+# range totals
+query total_day "SELECT reading_calculate(:meter, now()) - reading_calculate(:meter, now() - interval '1 day')"
+query total_year "SELECT reading_calculate(:meter, now()) - reading_calculate(:meter, now() - interval '1 year')"
+query pulses_day "SELECT ts,value FROM abs_pulses WHERE meter = :meter AND ts >= now() - interval '1 day' ORDER BY ts"
+
+# helpers
+query reading_calc "SELECT reading_calculate(:meter, now() - interval '6 months')"
+query prev_reading "SELECT prev_reading_ts(:meter, now()), prev_reading_value(:meter, now())"
+query next_reading "SELECT next_reading_ts(:meter, now() - interval '1 year'), next_reading_value(:meter, now() - interval '1 year')"
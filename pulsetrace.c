@@ -0,0 +1,88 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pulsetrace.h"
+
+#ifdef TRACE
+#define TRACE_SIZE (sizeof(trace_buf_t) + TRACE_RECORDS * sizeof(trace_t))
+
+static trace_buf_t *trace_buf = NULL;
+static uint32_t trace_pid;
+
+/* tracing is optional, so errors only disable it */
+void trace_open(void) {
+	const char *filename = getenv("PULSETRACE");
+	uint32_t magic = 0;
+	void *buf;
+	int fd;
+
+	if (filename == NULL || filename[0] == '\0')
+		return;
+
+	fd = open(filename, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	if (fd < 0) {
+		perror(filename);
+		return;
+	}
+
+	/* extending the file is safe if another process is already using it */
+	if (ftruncate(fd, TRACE_SIZE) != 0) {
+		perror(filename);
+		close(fd);
+		return;
+	}
+
+	buf = mmap(NULL, TRACE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED) {
+		perror(filename);
+		return;
+	}
+
+	trace_buf = buf;
+	trace_pid = getpid();
+
+	if (__atomic_compare_exchange_n(&trace_buf->magic, &magic, TRACE_MAGIC, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		trace_buf->size = TRACE_RECORDS;
+	} else if (magic != TRACE_MAGIC) {
+		fprintf(stderr, "%s: invalid trace file\n", filename);
+		trace_close();
+	}
+}
+
+void trace_event(uint16_t event, struct timeval edge, uint16_t arg) {
+	struct timespec ts;
+	trace_t *rec;
+	uint64_t i;
+
+	if (trace_buf == NULL)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	i = __atomic_fetch_add(&trace_buf->next, 1, __ATOMIC_RELAXED);
+	rec = &trace_buf->records[i % TRACE_RECORDS];
+
+	__atomic_store_n(&rec->event, TRACE_NONE, __ATOMIC_RELAXED);
+	rec->ts = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+	rec->edge = (uint64_t)edge.tv_sec * 1000000 + (uint64_t)edge.tv_usec;
+	rec->pid = trace_pid;
+	rec->arg = arg;
+	__atomic_store_n(&rec->event, event, __ATOMIC_RELEASE);
+}
+
+void trace_close(void) {
+	if (trace_buf != NULL) {
+		munmap(trace_buf, TRACE_SIZE);
+		trace_buf = NULL;
+	}
+}
+#endif
@@ -0,0 +1,57 @@
+/* Trace points, enabled with -DTRACE
+ *
+ * Records are written to a ring buffer in the file named by the
+ * PULSETRACE environment variable, shared by all processes using
+ * the same file. Use pulsetrace.py to convert it to a Chrome trace.
+ */
+#define TRACE_MAGIC 0x43525450 /* "PTRC" */
+#define TRACE_RECORDS 65536
+
+enum trace_event {
+	TRACE_NONE = 0,
+	TRACE_WAKEUP,     /* pulsemon: TIOCMIWAIT returned */
+	TRACE_CHECK,      /* pulsemon: line checked (arg: changed) */
+	TRACE_EDGE,       /* pulsemon: edge reported (arg: on) */
+	TRACE_RECEIVE,    /* pulsedb: edge read from main queue (arg: on) */
+	TRACE_SAVE,       /* pulsedb: save() attempt (arg: attempt) */
+	TRACE_SAVE_FAIL,  /* pulsedb: save() attempt failed (arg: attempt) */
+	TRACE_COMMIT,     /* pulsedb: database updated (arg: enum trace_op) */
+	TRACE_MISSED      /* pulsemon: edges missed (arg: count) */
+};
+
+enum trace_op {
+	TRACE_OP_ON = 0,
+	TRACE_OP_OFF,
+	TRACE_OP_ON_OFF,
+	TRACE_OP_CANCEL,
+	TRACE_OP_RESUME,
+	TRACE_OP_RESET,
+	TRACE_OP_COUNT
+};
+
+typedef struct {
+	uint64_t ts;      /* CLOCK_REALTIME (ns) */
+	uint64_t edge;    /* edge timestamp (µs), identifies the pulse */
+	uint32_t pid;
+	uint16_t event;   /* written last, TRACE_NONE if incomplete */
+	uint16_t arg;
+} trace_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t size;
+	uint64_t next;
+	trace_t records[];
+} trace_buf_t;
+
+#define TRACE_NO_EDGE ((struct timeval){ .tv_sec = 0 })
+
+#ifdef TRACE
+void trace_open(void);
+void trace_event(uint16_t event, struct timeval edge, uint16_t arg);
+void trace_close(void);
+#else
+# define trace_open() do { } while(0)
+# define trace_event(event, edge, arg) do { (void)(arg); } while(0)
+# define trace_close() do { } while(0)
+#endif
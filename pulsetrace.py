@@ -0,0 +1,96 @@
+#!/usr/bin/env python2
+# coding=utf8
+
+from __future__ import division
+from __future__ import print_function
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = 0x43525450
+HEADER = struct.Struct("=IIQ")
+RECORD = struct.Struct("=QQIHH")
+
+(NONE, WAKEUP, CHECK, EDGE, RECEIVE, SAVE, SAVE_FAIL, COMMIT, MISSED) = range(0, 9)
+NAMES = { WAKEUP: "wakeup", CHECK: "check", EDGE: "edge", RECEIVE: "receive", SAVE: "save", SAVE_FAIL: "save failed", COMMIT: "commit", MISSED: "missed" }
+OPS = [ "on", "off", "on+off", "cancel", "resume", "reset", "count" ]
+
+class Trace:
+	class InvalidTrace(Exception):
+		pass
+
+	def __init__(self, filename):
+		with open(filename, "rb") as f:
+			data = f.read()
+
+		(magic, size, next) = HEADER.unpack_from(data, 0)
+		if magic != MAGIC:
+			raise self.InvalidTrace(filename)
+
+		self.records = []
+		for i in range(max(0, next - size), next):
+			rec = RECORD.unpack_from(data, HEADER.size + (i % size) * RECORD.size)
+			if rec[3] != NONE:
+				self.records.append(rec)
+		self.records.sort()
+
+	def chrome(self):
+		TS, EDGE_TS, PID, EVENT, ARG = range(0, 5)
+		events = []
+		captured = {}
+		received = {}
+		saving = {}
+		pulses = {}
+
+		def us(ns):
+			return ns / 1000
+
+		for rec in self.records:
+			(ts, edge, pid, event, arg) = rec
+			args = { "arg": arg }
+			if edge != 0:
+				args["edge"] = "{0}.{1:06d}".format(edge // 10**6, edge % 10**6)
+			events.append({ "name": NAMES.get(event, str(event)), "ph": "i", "s": "t", "ts": us(ts), "pid": pid, "tid": pid, "args": args })
+
+			if event == EDGE:
+				captured[edge] = rec
+			elif event == RECEIVE:
+				# time spent in the main queue
+				start = captured[edge][TS] if edge in captured else edge * 1000
+				events.append({ "name": "queue", "ph": "X", "ts": us(start), "dur": us(ts - start), "pid": pid, "tid": pid, "args": args })
+				received[edge] = rec
+			elif event == SAVE:
+				saving[pid] = rec
+			elif event in (SAVE_FAIL, COMMIT) and pid in saving:
+				start = saving.pop(pid)
+				name = "save failed" if event == SAVE_FAIL else "save " + (OPS[arg] if arg < len(OPS) else str(arg))
+				events.append({ "name": name, "ph": "X", "ts": us(start[TS]), "dur": us(ts - start[TS]), "pid": pid, "tid": pid, "args": { "attempt": start[ARG] } })
+
+			if event == COMMIT and edge != 0:
+				pulses[edge] = ts
+
+		# whole pulse, from the edge being captured to the last commit
+		for (edge, ts) in pulses.items():
+			name = "pulse {0}.{1:06d}".format(edge // 10**6, edge % 10**6)
+			events.append({ "name": name, "cat": "pulse", "ph": "b", "id": edge, "ts": edge, "pid": 0, "tid": 0 })
+			events.append({ "name": name, "cat": "pulse", "ph": "e", "id": edge, "ts": us(ts), "pid": 0, "tid": 0 })
+
+		return { "traceEvents": events, "displayTimeUnit": "ms" }
+
+if __name__ == "__main__":
+	EXIT_SUCCESS, EXIT_FAILURE = range(0, 2)
+
+	parser = argparse.ArgumentParser(description='Convert a pulse trace buffer to a Chrome/Perfetto trace')
+	parser.add_argument('trace', help='Trace buffer (PULSETRACE)')
+	parser.add_argument('output', nargs='?', help='Output file (default: stdout)')
+	args = parser.parse_args()
+
+	trace = Trace(args.trace)
+	if args.output is None:
+		json.dump(trace.chrome(), sys.stdout)
+	else:
+		with open(args.output, "w") as f:
+			json.dump(trace.chrome(), f)
+
+	sys.exit(EXIT_SUCCESS)
@@ -112,11 +112,12 @@ if __name__ == "__main__":
 
 	parser = argparse.ArgumentParser(description='Tweet gas meter pulses')
 	parser.add_argument('-d', '--daemon', action='store_true', help='Run in the background')
+	parser.add_argument('-S', '--shards', metavar='FILE', help='Shard file with the database of each meter')
 	parser.add_argument('meter', help='Meter identifier')
 	parser.add_argument('account', help='Twitter account')
 	args = parser.parse_args()
 
-	db = pulselib.DB()
+	db = pulselib.Shards(args.shards).db(args.meter) if args.shards else pulselib.DB()
 	tweeter = PulseTweeter(db, args.meter, args.account)
 
 	if args.daemon: